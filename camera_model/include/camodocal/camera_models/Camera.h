@@ -90,6 +90,21 @@ public:
     virtual void undistToPlane(const Eigen::Vector2d& p_u, Eigen::Vector2d& p) const = 0;
     //%output p
 
+    // Precompute liftProjective for every integer pixel of the image
+    void initLiftTable(void);
+    bool hasLiftTable(void) const;
+
+    // Lift points from the image plane to the projective space using the
+    // lookup table with bilinear interpolation, falls back to liftProjective
+    // outside the table
+    void liftProjectiveFast(const Eigen::Vector2d& p, Eigen::Vector3d& P) const;
+    //%output P
+
+    // Lift a batch of image points to the normalised plane (x/z, y/z)
+    void liftProjectiveBatch(const std::vector<cv::Point2f>& p,
+                             std::vector<cv::Point2f>& p_u) const;
+    //%output p_u
+
     //virtual void initUndistortMap(cv::Mat& map1, cv::Mat& map2, double fScale = 1.0) const = 0;
     virtual cv::Mat initUndistortRectifyMap(cv::Mat& map1, cv::Mat& map2,
                                             float fx = -1.0f, float fy = -1.0f,
@@ -132,6 +147,7 @@ public:
                        std::vector<cv::Point2f>& imagePoints) const;
 protected:
     cv::Mat m_mask;
+    cv::Mat m_liftTable; // CV_32FC3, lifted rays on the unit sphere
 };
 
 typedef boost::shared_ptr<Camera> CameraPtr;
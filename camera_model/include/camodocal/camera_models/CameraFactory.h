@@ -23,6 +23,9 @@ public:
 
     CameraPtr generateCameraFromYamlFile(const std::string& filename);
 
+    // 图像按scale缩小解码时，用原分辨率的标定生成对应的相机，Scaramuzza模型不支持返回空指针
+    CameraPtr generateScaledCamera(const CameraConstPtr& camera, int scale) const;
+
 private:
     static boost::shared_ptr<CameraFactory> m_instance;
 };
@@ -0,0 +1,48 @@
+#ifndef COMPRESSEDIMAGE_H
+#define COMPRESSEDIMAGE_H
+
+#include <sensor_msgs/CompressedImage.h>
+#include <opencv2/opencv.hpp>
+
+namespace camodocal
+{
+
+/**
+ * @brief 压缩图像（jpeg/png）解码成灰度图，feature_tracker和pose_graph共用，两边的缩小倍数含义保持一致
+ *
+ * scale为2/4/8时用libjpeg的缩小解码，直接得到缩小后的图像，比解完整图再resize快得多，
+ * 相机用CameraFactory::generateScaledCamera()换算到同样的分辨率
+ */
+inline int decodeFlags(int scale)
+{
+    switch (scale)
+    {
+    case 2:
+        return cv::IMREAD_REDUCED_GRAYSCALE_2;
+    case 4:
+        return cv::IMREAD_REDUCED_GRAYSCALE_4;
+    case 8:
+        return cv::IMREAD_REDUCED_GRAYSCALE_8;
+    default:
+        return cv::IMREAD_GRAYSCALE;
+    }
+}
+
+inline cv::Mat decodeGray(const sensor_msgs::CompressedImage &msg, int scale)
+{
+    if (msg.data.empty())
+        return cv::Mat();
+    // 直接包住消息里的数据，不拷贝
+    cv::Mat buf(1, msg.data.size(), CV_8UC1, const_cast<uint8_t *>(&msg.data[0]));
+    return cv::imdecode(buf, decodeFlags(scale));
+}
+
+// 缩小解码后的图像尺寸，libjpeg向上取整
+inline int decodedSize(int size, int scale)
+{
+    return (size + scale - 1) / scale;
+}
+
+}
+
+#endif
@@ -119,6 +119,100 @@ Camera::mask(void) const
     return m_mask;
 }
 
+/**
+ * \brief Precomputes the projective ray of every integer pixel
+ *
+ * The rays are stored on the unit sphere so that models with a field of view
+ * larger than 180 degrees (z <= 0) can be interpolated as well.
+ */
+void
+Camera::initLiftTable(void)
+{
+    int w = imageWidth();
+    int h = imageHeight();
+    if (w <= 1 || h <= 1)
+    {
+        m_liftTable.release();
+        return;
+    }
+
+    m_liftTable.create(h, w, CV_32FC3);
+    for (int v = 0; v < h; ++v)
+    {
+        cv::Vec3f* row = m_liftTable.ptr<cv::Vec3f>(v);
+        for (int u = 0; u < w; ++u)
+        {
+            Eigen::Vector3d P;
+            liftProjective(Eigen::Vector2d(u, v), P);
+            P.normalize();
+
+            row[u] = cv::Vec3f(P(0), P(1), P(2));
+        }
+    }
+}
+
+bool
+Camera::hasLiftTable(void) const
+{
+    return !m_liftTable.empty();
+}
+
+/**
+ * \brief Lifts a point from the image plane to its projective ray using the
+ * lookup table built by initLiftTable()
+ *
+ * \param p image coordinates
+ * \param P coordinates of the projective ray (not normalised to z = 1)
+ */
+void
+Camera::liftProjectiveFast(const Eigen::Vector2d& p, Eigen::Vector3d& P) const
+{
+    double u = p(0);
+    double v = p(1);
+
+    // outside the table (or NaN): use the exact model
+    if (m_liftTable.empty() ||
+        !(u >= 0.0 && v >= 0.0 &&
+          u < m_liftTable.cols - 1 && v < m_liftTable.rows - 1))
+    {
+        liftProjective(p, P);
+        return;
+    }
+
+    int u0 = static_cast<int>(u);
+    int v0 = static_cast<int>(v);
+    float a = static_cast<float>(u - u0);
+    float b = static_cast<float>(v - v0);
+
+    const cv::Vec3f* r0 = m_liftTable.ptr<cv::Vec3f>(v0) + u0;
+    const cv::Vec3f* r1 = m_liftTable.ptr<cv::Vec3f>(v0 + 1) + u0;
+
+    cv::Vec3f q = (1.0f - a) * (1.0f - b) * r0[0] + a * (1.0f - b) * r0[1]
+                + (1.0f - a) * b * r1[0] + a * b * r1[1];
+
+    P << q[0], q[1], q[2];
+}
+
+/**
+ * \brief Lifts a batch of image points to the normalised plane
+ *
+ * \param p image coordinates
+ * \param p_u undistorted coordinates on the z = 1 plane
+ */
+void
+Camera::liftProjectiveBatch(const std::vector<cv::Point2f>& p,
+                            std::vector<cv::Point2f>& p_u) const
+{
+    p_u.resize(p.size());
+    for (size_t i = 0; i < p.size(); ++i)
+    {
+        Eigen::Vector3d P;
+        liftProjectiveFast(Eigen::Vector2d(p[i].x, p[i].y), P);
+
+        p_u[i] = cv::Point2f(P(0) / P(2), P(1) / P(2));
+    }
+}
+
 void
 Camera::estimateExtrinsics(const std::vector<cv::Point3f>& objectPoints,
                            const std::vector<cv::Point2f>& imagePoints,
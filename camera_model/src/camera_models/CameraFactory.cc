@@ -178,5 +178,67 @@ CameraFactory::generateCameraFromYamlFile(const std::string& filename)
     return CameraPtr();
 }
 
+/**
+ * @brief 缩小解码的图像配原分辨率的标定
+ *
+ * 畸变参数都定义在归一化平面或者入射角上，不用动；焦距除以scale，
+ * 主点按像素中心对齐换算(c + 0.5) / scale - 0.5，图像尺寸和libjpeg一样向上取整
+ */
+CameraPtr
+CameraFactory::generateScaledCamera(const CameraConstPtr& camera, int scale) const
+{
+    double s = scale;
+    int width = (camera->imageWidth() + scale - 1) / scale;
+    int height = (camera->imageHeight() + scale - 1) / scale;
+
+    switch (camera->modelType())
+    {
+    case Camera::KANNALA_BRANDT:
+    {
+        EquidistantCameraPtr scaled(new EquidistantCamera);
+
+        EquidistantCamera::Parameters params = boost::static_pointer_cast<const EquidistantCamera>(camera)->getParameters();
+        params.mu() /= s;
+        params.mv() /= s;
+        params.u0() = (params.u0() + 0.5) / s - 0.5;
+        params.v0() = (params.v0() + 0.5) / s - 0.5;
+        params.imageWidth() = width;
+        params.imageHeight() = height;
+        scaled->setParameters(params);
+        return scaled;
+    }
+    case Camera::PINHOLE:
+    {
+        PinholeCameraPtr scaled(new PinholeCamera);
+
+        PinholeCamera::Parameters params = boost::static_pointer_cast<const PinholeCamera>(camera)->getParameters();
+        params.fx() /= s;
+        params.fy() /= s;
+        params.cx() = (params.cx() + 0.5) / s - 0.5;
+        params.cy() = (params.cy() + 0.5) / s - 0.5;
+        params.imageWidth() = width;
+        params.imageHeight() = height;
+        scaled->setParameters(params);
+        return scaled;
+    }
+    case Camera::MEI:
+    {
+        CataCameraPtr scaled(new CataCamera);
+
+        CataCamera::Parameters params = boost::static_pointer_cast<const CataCamera>(camera)->getParameters();
+        params.gamma1() /= s;
+        params.gamma2() /= s;
+        params.u0() = (params.u0() + 0.5) / s - 0.5;
+        params.v0() = (params.v0() + 0.5) / s - 0.5;
+        params.imageWidth() = width;
+        params.imageHeight() = height;
+        scaled->setParameters(params);
+        return scaled;
+    }
+    default:
+        return CameraPtr();
+    }
+}
+
 }
 
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 常驻的工作线程池，run()把[0, n)个任务分给工作线程和调用线程，全部完成后才返回
+// feature_tracker导出给vins_estimator共用，两个包只维护这一份
+// 每个任务只写自己的输出，结果和串行执行一致
+class WorkerPool
+{
+  public:
+    explicit WorkerPool(int num_threads = 0)
+        : task_ptr(nullptr), next_task(0), n_tasks(0), n_done(0), generation(0), stop(false)
+    {
+        for (int i = 0; i < num_threads; i++)
+            workers.emplace_back(&WorkerPool::workerLoop, this);
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        cv_task.notify_all();
+        for (auto &t : workers)
+            t.join();
+    }
+
+    int size() const
+    {
+        return workers.size();
+    }
+
+    void run(int n, const std::function<void(int)> &task)
+    {
+        if (n <= 0)
+            return;
+        if (workers.empty() || n == 1)
+        {
+            for (int i = 0; i < n; i++)
+                task(i);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m);
+            task_ptr = &task;
+            next_task = 0;
+            n_tasks = n;
+            n_done = 0;
+            generation++;
+        }
+        cv_task.notify_all();
+        runTasks();
+        std::unique_lock<std::mutex> lock(m);
+        cv_done.wait(lock, [&]
+                     { return n_done == n_tasks; });
+        task_ptr = nullptr;
+    }
+
+  private:
+    void runTasks()
+    {
+        while (true)
+        {
+            int i;
+            const std::function<void(int)> *task;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if (task_ptr == nullptr || next_task >= n_tasks)
+                    return;
+                i = next_task++;
+                task = task_ptr;
+            }
+            (*task)(i);
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if (++n_done == n_tasks)
+                    cv_done.notify_all();
+            }
+        }
+    }
+
+    void workerLoop()
+    {
+        unsigned long seen = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv_task.wait(lock, [&]
+                             { return stop || generation != seen; });
+                if (stop)
+                    return;
+                seen = generation;
+            }
+            runTasks();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::condition_variable cv_task, cv_done;
+    const std::function<void(int)> *task_ptr;
+    int next_task, n_tasks, n_done;
+    unsigned long generation;
+    bool stop;
+};
@@ -10,28 +10,82 @@ bool inBorder(const cv::Point2f &pt)
     return BORDER_SIZE <= img_x && img_x < COL - BORDER_SIZE && BORDER_SIZE <= img_y && img_y < ROW - BORDER_SIZE;   // 在一个方框内
 }
 
-// > 双指针，根据状态位，进行“瘦身”
-void reduceVector(vector<cv::Point2f> &v, vector<uchar> status)
+// 按order重排一列，buf换出来的内存留给下一列复用
+template <typename T>
+static void gatherVector(vector<T> &v, const vector<int> &order, vector<T> &buf)
+{
+    buf.resize(order.size());
+    for (unsigned int k = 0; k < order.size(); k++)
+        buf[k] = v[order[k]];
+    v.swap(buf);
+}
+
+FeatureTracker::FeatureTracker()
+    : has_prediction(false), relative_R(Eigen::Matrix3d::Identity())
 {
-    int j = 0;
-    for (int i = 0; i < int(v.size()); i++)
-        if (status[i])
-            v[j++] = v[i];
-    v.resize(j);
 }
 
-void reduceVector(vector<int> &v, vector<uchar> status)
+// > 所有列根据同一个状态位一次性原地“瘦身”，保持相对顺序
+void FeatureTracker::reduceTracks(const vector<uchar> &status)
 {
     int j = 0;
-    for (int i = 0; i < int(v.size()); i++)
-        if (status[i])
-            v[j++] = v[i];
-    v.resize(j);
+    for (int i = 0; i < int(forw_pts.size()); i++)
+    {
+        if (!status[i])
+            continue;
+        if (i != j)
+        {
+            cur_pts[j] = cur_pts[i];
+            forw_pts[j] = forw_pts[i];
+            cur_un_pts[j] = cur_un_pts[i];
+            ids[j] = ids[i];
+            track_cnt[j] = track_cnt[i];
+        }
+        j++;
+    }
+    cur_pts.resize(j);
+    forw_pts.resize(j);
+    cur_un_pts.resize(j);
+    ids.resize(j);
+    track_cnt.resize(j);
 }
 
+// 按rows挑选并重排所有列
+void FeatureTracker::selectTracks(const vector<int> &rows)
+{
+    gatherVector(cur_pts, rows, pts_buf);
+    gatherVector(forw_pts, rows, pts_buf);
+    gatherVector(cur_un_pts, rows, pts_buf);
+    gatherVector(ids, rows, int_buf);
+    gatherVector(track_cnt, rows, int_buf);
+}
 
-FeatureTracker::FeatureTracker()
+// 设置上一帧到当前帧的相机相对旋转，只对下一次readImage有效
+void FeatureTracker::setPrediction(const Eigen::Matrix3d &_relative_R)
 {
+    relative_R = _relative_R;
+    has_prediction = true;
+}
+
+// 只考虑旋转，把cur_pts转到当前帧得到光流的初值，投影失败的点用原位置
+void FeatureTracker::predictPoints()
+{
+    forw_pts.resize(cur_pts.size());
+    Eigen::Matrix3d R_fc = relative_R.transpose();
+    for (unsigned int i = 0; i < cur_pts.size(); i++)
+    {
+        forw_pts[i] = cur_pts[i];
+        Eigen::Vector3d P;
+        m_camera->liftProjectiveFast(Eigen::Vector2d(cur_pts[i].x, cur_pts[i].y), P);
+        P = R_fc * P;
+        if (P.z() <= 0)
+            continue;
+        Eigen::Vector2d uv;
+        m_camera->spaceToPlane(P, uv);
+        cv::Point2f pt(uv.x(), uv.y());
+        if (inBorder(pt))
+            forw_pts[i] = pt;
+    }
 }
 
 // 给现有的特征点设置mask，目的为了特征点的均匀化
@@ -44,37 +98,191 @@ void FeatureTracker::setMask()
     
 
     // prefer to keep features that are tracked for long time
-    vector<pair<int, pair<cv::Point2f, int>>> cnt_pts_id;   // <跟踪次数，<跟踪点，id>>
-
-    for (unsigned int i = 0; i < forw_pts.size(); i++)
-        cnt_pts_id.push_back(make_pair(track_cnt[i], make_pair(forw_pts[i], ids[i])));
-
-    // 利用光流特点，追踪多的稳定性好，排前面
-    // > 排序函数一定不能声明在类内，因为std无法访问类内函数，一是像这样可以，二是声明为全局函数
-    sort(cnt_pts_id.begin(), cnt_pts_id.end(), [](const pair<int, pair<cv::Point2f, int>> &a, const pair<int, pair<cv::Point2f, int>> &b)
-         {
-            return a.first > b.first;
-         });
-
-    forw_pts.clear();
-    ids.clear();
-    track_cnt.clear();
+    // 利用光流特点，追踪多的稳定性好，排前面，只排行号不搬数据
+    sortByTrackCnt(order);
 
     // 将跟踪好坏得到的特征点集，再次检查是否被mask，并且防止过度集中
-    for (auto &it : cnt_pts_id)
+    keep.clear();
+    for (int i : order)
     {
-        if (mask.at<uchar>(it.second.first) == 255)  // 检测该点是否被mask覆盖
+        if (mask.at<uchar>(forw_pts[i]) == 255)  // 检测该点是否被mask覆盖
         {
-            // 把挑选剩下的特征点重新放进容器
-            forw_pts.push_back(it.second.first);
-            ids.push_back(it.second.second);
-            track_cnt.push_back(it.first);
+            // 把挑选剩下的特征点的行号记下来
+            keep.push_back(i);
 
             // opencv函数，把周围一个圆内全部置0,这个区域不允许别的特征点存在，避免特征点过于集中
             // > orb2中是使用四叉树来实现特征均匀分配，虽然这样更规格，但是远没有vins的该方法快，毕竟vins特征跟踪数量远高于orb2的orb特征提取
-            cv::circle(mask, it.second.first, MIN_DIST, 0, -1);
+            cv::circle(mask, forw_pts[i], MIN_DIST, 0, -1);
+        }
+    }
+    selectTracks(keep);
+}
+
+// 行号按追踪次数从多到少排序，相同次数保持原顺序
+void FeatureTracker::sortByTrackCnt(vector<int> &_order) const
+{
+    _order.resize(forw_pts.size());
+    for (unsigned int i = 0; i < _order.size(); i++)
+        _order[i] = i;
+    stable_sort(_order.begin(), _order.end(), [this](int a, int b)
+                {
+                    return track_cnt[a] > track_cnt[b];
+                });
+}
+
+// 栅格版本的setMask，用占据栅格代替整幅mask的拷贝和画圆
+void FeatureTracker::setMaskGrid()
+{
+    // 栅格对角线等于MIN_DIST，因此每个栅格最多只会有一个点
+    grid_cell = std::max(1.0f, static_cast<float>(MIN_DIST / sqrt(2.0)));
+    grid_cols = static_cast<int>(ceil(COL / grid_cell));
+    grid_rows = static_cast<int>(ceil(ROW / grid_cell));
+    occ_grid.assign(grid_cols * grid_rows, -1);
+    grid_pts.clear();
+
+    // prefer to keep features that are tracked for long time
+    sortByTrackCnt(order);
+
+    keep.clear();
+    for (int i : order)
+    {
+        const cv::Point2f &pt = forw_pts[i];
+        if (FISHEYE && fisheye_mask.at<uchar>(pt) != 255)
+            continue;
+        if (!gridFree(pt))
+            continue;
+        keep.push_back(i);
+        gridInsert(pt);
+    }
+    selectTracks(keep);
+}
+
+// 检查MIN_DIST范围内是否已有特征点，只需要查周围5x5个栅格
+bool FeatureTracker::gridFree(const cv::Point2f &pt) const
+{
+    int cx = static_cast<int>(pt.x / grid_cell);
+    int cy = static_cast<int>(pt.y / grid_cell);
+    if (cx < 0 || cy < 0 || cx >= grid_cols || cy >= grid_rows)
+        return false;
+    float min_dist2 = static_cast<float>(MIN_DIST * MIN_DIST);
+    for (int y = std::max(0, cy - 2); y <= std::min(grid_rows - 1, cy + 2); y++)
+        for (int x = std::max(0, cx - 2); x <= std::min(grid_cols - 1, cx + 2); x++)
+        {
+            int k = occ_grid[y * grid_cols + x];
+            if (k < 0)
+                continue;
+            float dx = grid_pts[k].x - pt.x;
+            float dy = grid_pts[k].y - pt.y;
+            if (dx * dx + dy * dy < min_dist2)
+                return false;
+        }
+    return true;
+}
+
+void FeatureTracker::gridInsert(const cv::Point2f &pt)
+{
+    int cx = static_cast<int>(pt.x / grid_cell);
+    int cy = static_cast<int>(pt.y / grid_cell);
+    occ_grid[cy * grid_cols + cx] = grid_pts.size();
+    grid_pts.push_back(pt);
+}
+
+// 每个分块单独提角点，用opencv的parallel_for_并行
+// 角点门限是整幅图最大响应的1%，和整图提点一致，不然纹理弱的分块会按自己的最大响应把噪声也提出来
+class TileDetector : public cv::ParallelLoopBody
+{
+  public:
+    TileDetector(const cv::Mat &_img, const cv::Mat &_mask, const cv::Mat &_eig, double _min_response,
+                 const vector<cv::Rect> &_tiles, const vector<int> &_need, vector<vector<cv::Point2f>> &_candidates)
+        : img(_img), mask(_mask), eig(_eig), min_response(_min_response), tiles(_tiles), need(_need), candidates(_candidates)
+    {
+    }
+
+    void operator()(const cv::Range &range) const
+    {
+        for (int t = range.start; t < range.end; t++)
+        {
+            if (need[t] <= 0)
+                continue;
+            const cv::Rect &r = tiles[t];
+            cv::Mat tile_mask;
+            if (!mask.empty())
+                tile_mask = mask(r);
+            double tile_max = 0;
+            cv::minMaxLoc(eig(r), 0, &tile_max, 0, 0, tile_mask);
+            if (tile_max <= 0 || tile_max < min_response)
+                continue;
+            // goodFeaturesToTrack的门限是分块内最大响应的比例，换算成同一个绝对门限；多提一些，后面还要经过栅格的MIN_DIST检查
+            cv::goodFeaturesToTrack(img(r), candidates[t], need[t] * 2, min_response / tile_max, MIN_DIST, tile_mask);
+            for (auto &p : candidates[t])
+            {
+                p.x += r.x;
+                p.y += r.y;
+            }
+        }
+    }
+
+  private:
+    cv::Mat img;
+    cv::Mat mask;
+    cv::Mat eig;
+    double min_response;
+    const vector<cv::Rect> &tiles;
+    const vector<int> &need;
+    vector<vector<cv::Point2f>> &candidates;
+};
+
+// 只在特征点不足的分块中提取新的特征点，结果轮流从各分块中取，保证分布均匀
+void FeatureTracker::detectGrid(int n_max_cnt)
+{
+    int n_tiles = GRID_ROW * GRID_COL;
+    int quota = (MAX_CNT + n_tiles - 1) / n_tiles;
+    vector<cv::Rect> tiles(n_tiles);
+    vector<int> need(n_tiles, quota);
+    for (int r = 0; r < GRID_ROW; r++)
+        for (int c = 0; c < GRID_COL; c++)
+        {
+            int x0 = c * COL / GRID_COL, x1 = (c + 1) * COL / GRID_COL;
+            int y0 = r * ROW / GRID_ROW, y1 = (r + 1) * ROW / GRID_ROW;
+            tiles[r * GRID_COL + c] = cv::Rect(x0, y0, x1 - x0, y1 - y0);
         }
+    // 已有的特征点占掉所在分块的名额
+    for (auto &p : grid_pts)
+    {
+        int c = std::min(GRID_COL - 1, static_cast<int>(p.x) * GRID_COL / COL);
+        int r = std::min(GRID_ROW - 1, static_cast<int>(p.y) * GRID_ROW / ROW);
+        need[r * GRID_COL + c]--;
     }
+
+    // 整幅图的最小特征值响应只算一次，和goodFeaturesToTrack一样blockSize为3
+    cv::Mat detect_mask = FISHEYE ? fisheye_mask : cv::Mat();
+    cv::Mat eig;
+    double max_response = 0;
+    cv::cornerMinEigenVal(forw_img, eig, 3, 3);
+    cv::minMaxLoc(eig, 0, &max_response, 0, 0, detect_mask);
+
+    vector<vector<cv::Point2f>> candidates(n_tiles);
+    cv::parallel_for_(cv::Range(0, n_tiles),
+                      TileDetector(forw_img, detect_mask, eig, 0.01 * max_response, tiles, need, candidates));
+
+    // 各分块内的候选点已经按响应排好序，按轮次依次取，跨分块的点再用栅格检查距离
+    n_pts.clear();
+    vector<int> taken(n_tiles, 0);
+    size_t max_len = 0;
+    for (auto &c : candidates)
+        max_len = std::max(max_len, c.size());
+    for (size_t k = 0; k < max_len && int(n_pts.size()) < n_max_cnt; k++)
+        for (int t = 0; t < n_tiles && int(n_pts.size()) < n_max_cnt; t++)
+        {
+            if (k >= candidates[t].size() || taken[t] >= need[t])
+                continue;
+            const cv::Point2f &pt = candidates[t][k];
+            if (!gridFree(pt))
+                continue;
+            gridInsert(pt);
+            n_pts.push_back(pt);
+            taken[t]++;
+        }
 }
 
 // 把新的点加入容器，id给-1作为区分
@@ -82,7 +290,9 @@ void FeatureTracker::addPoints()
 {
     for (auto &p : n_pts)
     {
+        cur_pts.push_back(p);   // 新点没有上一帧的观测，占位保持各列对齐
         forw_pts.push_back(p);
+        cur_un_pts.push_back(cv::Point2f(0, 0));
         ids.push_back(-1);
         track_cnt.push_back(1);
     }
@@ -116,39 +326,50 @@ void FeatureTracker::readImage(const cv::Mat &_img, double _cur_time)
     else
         img = _img;
 
-    // 这里forw表示当前，cur表示上一帧
-    if (forw_img.empty())   // 第一次输入图像，prev_img这个没用
-    {
-        prev_img = cur_img = forw_img = img;
-    }
-    else
-    {
-        forw_img = img;
-    }
-
     forw_pts.clear();
 
+    // 当前帧的金字塔只在这里建一次，下一帧作为cur_pyr直接复用
+    // 输入可能直接引用ros消息的内存，金字塔第0层总是拷贝一份（建金字塔本来就要拷贝进带边界的内存），
+    // 之后forw_img就用第0层，不再引用输入
+    TicToc t_p;
+    cv::buildOpticalFlowPyramid(img, forw_pyr, cv::Size(LK_WIN_SIZE, LK_WIN_SIZE), LK_PYR_LEVEL, true,
+                                cv::BORDER_REFLECT_101, cv::BORDER_CONSTANT, false);
+    // 这里forw表示当前，cur表示上一帧
+    forw_img = forw_pyr[0];
+    ROS_DEBUG("build pyramid costs: %fms", t_p.toc());
+
     if (cur_pts.size() > 0) // 上一帧有特征点，就可以进行光流追踪了
     {
         TicToc t_o;
         vector<uchar> status;
-        vector<float> err;
         
         // Step 1 通过opencv光流追踪给的状态位剔除outlier，灰度不变假设，灰度误差跟踪
         // > vins图像金字塔提高了光流追踪的鲁棒性，低分辨率做为高分辨率的追踪初值，防止直接高分辨率追踪导致的局部最优问题
         // > orb2图像金字塔是为了多尺度提取特征的鲁棒性
-        cv::calcOpticalFlowPyrLK(cur_img, forw_img, cur_pts, forw_pts, status, err, cv::Size(21, 21), 3);  // 4层金字塔
+        if (has_prediction)
+        {
+            // > 用陀螺仪预测的位置作为初值，大角速度下也不容易跟丢
+            predictPoints();
+            calcOpticalFlow(status, true);
+            int succ_num = 0;
+            for (auto s : status)
+                if (s)
+                    succ_num++;
+            // 预测失效（比如外参不准）时退回到不带初值的追踪
+            if (succ_num < 10)
+            {
+                ROS_DEBUG("imu prediction tracked %d points, track again without prediction", succ_num);
+                calcOpticalFlow(status, false);
+            }
+        }
+        else
+            calcOpticalFlow(status, false);
 
         // Step 2 通过图像边界剔除outlier
         for (int i = 0; i < int(forw_pts.size()); i++)
             if (status[i] && !inBorder(forw_pts[i]))    // 追踪状态好检查在不在图像范围
                 status[i] = 0;
-        reduceVector(prev_pts, status); // ! 没用到
-        reduceVector(cur_pts, status);
-        reduceVector(forw_pts, status);
-        reduceVector(ids, status);  // 特征点的id
-        reduceVector(cur_un_pts, status);   // 去畸变后的坐标
-        reduceVector(track_cnt, status);    // 追踪次数
+        reduceTracks(status);   // 像素坐标、去畸变坐标、id、追踪次数一起剔除
         ROS_DEBUG("temporal optical flow costs: %fms", t_o.toc());
     }
     // 被追踪到的是上一帧就存在的，因此追踪数+1
@@ -163,13 +384,20 @@ void FeatureTracker::readImage(const cv::Mat &_img, double _cur_time)
         // Step 4 当前帧特征不足，根据mask需要另外提取
         ROS_DEBUG("set mask begins");
         TicToc t_m;
-        setMask();
+        if (GRID_DETECT)
+            setMaskGrid();
+        else
+            setMask();
         ROS_DEBUG("set mask costs %fms", t_m.toc());
 
         ROS_DEBUG("detect feature begins");
         TicToc t_t;
         int n_max_cnt = MAX_CNT - static_cast<int>(forw_pts.size());
-        if (n_max_cnt > 0)
+        if (n_max_cnt > 0 && GRID_DETECT)
+        {
+            detectGrid(n_max_cnt);
+        }
+        else if (n_max_cnt > 0)
         {
             if(mask.empty())
                 cout << "mask is empty " << endl;
@@ -190,13 +418,30 @@ void FeatureTracker::readImage(const cv::Mat &_img, double _cur_time)
         addPoints();  // 将n_pts存入
         ROS_DEBUG("selectFeature costs: %fms", t_a.toc());
     }
-    prev_img = cur_img;
-    prev_pts = cur_pts;
-    prev_un_pts = cur_un_pts;   // 以上三个量无用
-    cur_img = forw_img; // 实际上是上一帧的图像
+    cur_img = forw_img; // 实际上是上一帧的图像，和cur_pyr[0]共用内存
+    cur_pyr.swap(forw_pyr); // 旧的金字塔内存留给下一帧重建时复用
     cur_pts = forw_pts; // 上一帧的特征点
     undistortedPoints();
     prev_time = cur_time;
+    has_prediction = false;
+}
+
+// 光流追踪，LK_TRACKER为1时用自带的KLT，否则用opencv，两者的输入输出完全一致
+void FeatureTracker::calcOpticalFlow(vector<uchar> &status, bool use_initial_flow)
+{
+    cv::Size win_size(LK_WIN_SIZE, LK_WIN_SIZE);
+    cv::TermCriteria criteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, LK_MAX_ITER, 0.01);
+    if (LK_TRACKER == 1)
+    {
+        klt.setParameters(LK_WIN_SIZE, LK_PYR_LEVEL, criteria);
+        klt.track(cur_pyr, forw_pyr, cur_pts, forw_pts, status, use_initial_flow);
+    }
+    else
+    {
+        vector<float> err;
+        cv::calcOpticalFlowPyrLK(cur_pyr, forw_pyr, cur_pts, forw_pts, status, err, win_size, LK_PYR_LEVEL,
+                                 criteria, use_initial_flow ? cv::OPTFLOW_USE_INITIAL_FLOW : 0);
+    }
 }
 
 /**
@@ -210,36 +455,28 @@ void FeatureTracker::rejectWithF()
     {
         ROS_DEBUG("FM ransac begins");
         TicToc t_f;
-        vector<cv::Point2f> un_cur_pts(cur_pts.size()), un_forw_pts(forw_pts.size());  // 存储去畸变的像素坐标系下的坐标
+        vector<cv::Point2f> un_cur_pts, un_forw_pts;  // 存储去畸变的像素坐标系下的坐标
+        // > 查表批量去畸变，得到归一化平面坐标
+        m_camera->liftProjectiveBatch(cur_pts, un_cur_pts);
+        m_camera->liftProjectiveBatch(forw_pts, un_forw_pts);
         for (unsigned int i = 0; i < cur_pts.size(); i++)
         {
-            Eigen::Vector3d tmp_p;
-            // > 得到去畸变的坐标
-            m_camera->liftProjective(Eigen::Vector2d(cur_pts[i].x, cur_pts[i].y), tmp_p); 
             // 这里用一个虚拟相机，原因同样参考https://github.com/HKUST-Aerial-Robotics/VINS-Mono/issues/48
             // 这里有个好处就是对F_THRESHOLD和相机无关
             // ! 投影到虚拟相机的像素坐标系，虚拟相机的参数是写死的，从而适配所有相机类型，肯定不如用真实的参数更精确，但这里只是通过对极约束来去除outliers而已
             // > 归一化同时转入像素坐标系，后面加COL / 2.0和ROW / 2.0是因为像素坐标系原点在图像顶角上
-            tmp_p.x() = FOCAL_LENGTH * tmp_p.x() / tmp_p.z() + COL / 2.0;
-            tmp_p.y() = FOCAL_LENGTH * tmp_p.y() / tmp_p.z() + ROW / 2.0;
-            un_cur_pts[i] = cv::Point2f(tmp_p.x(), tmp_p.y());
-
-            m_camera->liftProjective(Eigen::Vector2d(forw_pts[i].x, forw_pts[i].y), tmp_p);
-            tmp_p.x() = FOCAL_LENGTH * tmp_p.x() / tmp_p.z() + COL / 2.0;
-            tmp_p.y() = FOCAL_LENGTH * tmp_p.y() / tmp_p.z() + ROW / 2.0;
-            un_forw_pts[i] = cv::Point2f(tmp_p.x(), tmp_p.y());
+            un_cur_pts[i].x = FOCAL_LENGTH * un_cur_pts[i].x + COL / 2.0;
+            un_cur_pts[i].y = FOCAL_LENGTH * un_cur_pts[i].y + ROW / 2.0;
+
+            un_forw_pts[i].x = FOCAL_LENGTH * un_forw_pts[i].x + COL / 2.0;
+            un_forw_pts[i].y = FOCAL_LENGTH * un_forw_pts[i].y + ROW / 2.0;
         }
 
         vector<uchar> status;
         // opencv接口计算本质矩阵，某种意义也是一种对级约束的outlier剔除
         cv::findFundamentalMat(un_cur_pts, un_forw_pts, cv::FM_RANSAC, F_THRESHOLD, 0.99, status);
         int size_a = cur_pts.size();
-        reduceVector(prev_pts, status);
-        reduceVector(cur_pts, status);
-        reduceVector(forw_pts, status);
-        reduceVector(cur_un_pts, status);
-        reduceVector(ids, status);
-        reduceVector(track_cnt, status);
+        reduceTracks(status);
         ROS_DEBUG("FM ransac: %d -> %lu: %f", size_a, forw_pts.size(), 1.0 * forw_pts.size() / size_a);
         ROS_DEBUG("FM ransac costs: %fms", t_f.toc());
     }
@@ -270,6 +507,21 @@ void FeatureTracker::readIntrinsicParameter(const string &calib_file)
     ROS_INFO("reading paramerter of camera %s", calib_file.c_str());
     // 读到的相机内参赋给m_camera
     m_camera = CameraFactory::instance()->generateCameraFromYamlFile(calib_file);
+    // 压缩图像缩小解码时，标定还是原分辨率的，内参换算到解码后的分辨率
+    if (DECODE_SCALE != 1)
+    {
+        camodocal::CameraPtr scaled = CameraFactory::instance()->generateScaledCamera(m_camera, DECODE_SCALE);
+        if (!scaled)
+        {
+            ROS_ERROR("decode_scale %d is not supported for the camera model in %s, set it to 1", DECODE_SCALE, calib_file.c_str());
+            ROS_BREAK();
+        }
+        m_camera = scaled;
+    }
+    // 预先计算每个像素的去畸变结果，之后每帧查表插值即可
+    TicToc t_l;
+    m_camera->initLiftTable();
+    ROS_INFO("build lift table costs: %fms", t_l.toc());
 }
 
 void FeatureTracker::showUndistortion(const string &name)
@@ -311,58 +563,28 @@ void FeatureTracker::showUndistortion(const string &name)
 // 当前帧所有点统一去畸变，同时计算特征点速度，用来后续时间戳标定
 void FeatureTracker::undistortedPoints()
 {
-    cur_un_pts.clear();
-    cur_un_pts_map.clear();
     //cv::undistortPoints(cur_pts, un_pts, K, cv::Mat());
-    for (unsigned int i = 0; i < cur_pts.size(); i++)
-    {
-        // 有的之前去过畸变了，这里连同新人重新做一次
-        Eigen::Vector2d a(cur_pts[i].x, cur_pts[i].y);
-        Eigen::Vector3d b;
-
-        // > 同样使用这个接口，在camera_model中liftProjective的参数已经设置好了
-        m_camera->liftProjective(a, b);
+    // 有的之前去过畸变了，这里连同新人重新做一次
+    // > 查表得到归一化平面坐标，在readIntrinsicParameter中已经建好了表
+    // 结果先放到pts_buf，此时cur_un_pts里还是同一行特征点在上一帧的坐标
+    m_camera->liftProjectiveBatch(cur_pts, pts_buf);
 
-        cur_un_pts.push_back(cv::Point2f(b.x() / b.z(), b.y() / b.z()));
-        // id->坐标的map
-        cur_un_pts_map.insert(make_pair(ids[i], cv::Point2f(b.x() / b.z(), b.y() / b.z())));
-        //printf("cur pts id %d %f %f", ids[i], cur_un_pts[i].x, cur_un_pts[i].y);
-    }
     // caculate points velocity
-    if (!prev_un_pts_map.empty())
-    {
-        double dt = cur_time - prev_time;
-        pts_velocity.clear();
-        for (unsigned int i = 0; i < cur_un_pts.size(); i++)
-        {
-            if (ids[i] != -1)
-            {
-                std::map<int, cv::Point2f>::iterator it;
-                it = prev_un_pts_map.find(ids[i]);
-                // 找到同一个特征点
-                if (it != prev_un_pts_map.end())
-                {
-                    double v_x = (cur_un_pts[i].x - it->second.x) / dt;
-                    double v_y = (cur_un_pts[i].y - it->second.y) / dt;
-                    // 得到在归一化平面的速度
-                    pts_velocity.push_back(cv::Point2f(v_x, v_y));
-                }
-                else
-                    pts_velocity.push_back(cv::Point2f(0, 0));
-            }
-            else
-            {
-                pts_velocity.push_back(cv::Point2f(0, 0));
-            }
-        }
-    }
-    else
+    // 各列在剔除和重排时一直对齐，同一行就是同一个特征点，不需要再按id查找
+    double dt = cur_time - prev_time;
+    pts_velocity.resize(cur_pts.size());
+    for (unsigned int i = 0; i < cur_pts.size(); i++)
     {
-        // 第一帧的情况
-        for (unsigned int i = 0; i < cur_pts.size(); i++)
+        // 追踪次数为1的是新提的点（包括第一帧），没有上一帧的坐标
+        if (track_cnt[i] > 1)
         {
-            pts_velocity.push_back(cv::Point2f(0, 0));
+            double v_x = (pts_buf[i].x - cur_un_pts[i].x) / dt;
+            double v_y = (pts_buf[i].y - cur_un_pts[i].y) / dt;
+            // 得到在归一化平面的速度
+            pts_velocity[i] = cv::Point2f(v_x, v_y);
         }
+        else
+            pts_velocity[i] = cv::Point2f(0, 0);
     }
-    prev_un_pts_map = cur_un_pts_map;
+    cur_un_pts.swap(pts_buf);
 }
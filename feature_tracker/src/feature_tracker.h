@@ -15,6 +15,7 @@
 
 #include "parameters.h"
 #include "tic_toc.h"
+#include "klt_tracker.h"
 
 using namespace std;
 using namespace camodocal;
@@ -22,9 +23,6 @@ using namespace Eigen;
 
 bool inBorder(const cv::Point2f &pt);
 
-void reduceVector(vector<cv::Point2f> &v, vector<uchar> status);
-void reduceVector(vector<int> &v, vector<uchar> status);
-
 class FeatureTracker
 {
   public:
@@ -32,8 +30,28 @@ class FeatureTracker
 
     void readImage(const cv::Mat &_img,double _cur_time);
 
+    void setPrediction(const Eigen::Matrix3d &_relative_R);
+
+    void predictPoints();
+
+    void calcOpticalFlow(vector<uchar> &status, bool use_initial_flow);
+
+    void reduceTracks(const vector<uchar> &status);
+
+    void selectTracks(const vector<int> &rows);
+
+    void sortByTrackCnt(vector<int> &_order) const;
+
     void setMask();
 
+    void setMaskGrid();
+
+    bool gridFree(const cv::Point2f &pt) const;
+
+    void gridInsert(const cv::Point2f &pt);
+
+    void detectGrid(int n_max_cnt);
+
     void addPoints();
 
     bool updateID(unsigned int i);
@@ -46,19 +64,29 @@ class FeatureTracker
 
     void undistortedPoints();
 
-  // ! prev_*没有具体作用，只是转存上一帧信息；cur_*存储上一帧信息；forw_*存储当前帧信息
+  // ! cur_*存储上一帧信息；forw_*存储当前帧信息
     cv::Mat mask;
     cv::Mat fisheye_mask;
-    cv::Mat prev_img, cur_img, forw_img;
+    cv::Mat cur_img, forw_img;
+    KLTTracker klt;
+    vector<cv::Mat> cur_pyr, forw_pyr;  // 带梯度的光流金字塔，每帧只建一次，随cur/forw一起轮换
     vector<cv::Point2f> n_pts;
-    vector<cv::Point2f> prev_pts, cur_pts, forw_pts;  
-    vector<cv::Point2f> prev_un_pts, cur_un_pts;
+    // > 特征点表按列存储，同一行是同一个特征点，剔除和重排时所有列一起处理
+    vector<cv::Point2f> cur_pts, forw_pts;
+    vector<cv::Point2f> cur_un_pts;
     vector<cv::Point2f> pts_velocity;
     vector<int> ids;
     vector<int> track_cnt;
-    map<int, cv::Point2f> cur_un_pts_map;
-    map<int, cv::Point2f> prev_un_pts_map;
+    vector<int> order, keep;    // setMask用到的行号
+    vector<cv::Point2f> pts_buf;    // 重排和去畸变用的临时列，每帧复用
+    vector<int> int_buf;
+    vector<int> occ_grid;   // 占据栅格，存放grid_pts的索引，-1表示空
+    vector<cv::Point2f> grid_pts;
+    int grid_cols, grid_rows;
+    float grid_cell;
     camodocal::CameraPtr m_camera;
+    bool has_prediction;
+    Eigen::Matrix3d relative_R; // forw相机坐标系在cur相机坐标系下的旋转
     double cur_time;
     double prev_time;
 
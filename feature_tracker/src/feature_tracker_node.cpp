@@ -1,66 +1,158 @@
 #include <ros/ros.h>
 #include <sensor_msgs/Image.h>
+#include <sensor_msgs/CompressedImage.h>
 #include <sensor_msgs/image_encodings.h>
-#include <sensor_msgs/PointCloud.h>
 #include <sensor_msgs/Imu.h>
 #include <std_msgs/Bool.h>
 #include <cv_bridge/cv_bridge.h>
 #include <message_filters/subscriber.h>
+#include <feature_tracker/FeatureFrame.h>
+#include <feature_tracker/worker_pool.h>
 
 #include "feature_tracker.h"
+#include "image_decoder.h"
 
 #define SHOW_UNDISTORTION 0
 
 vector<uchar> r_status;
 vector<float> r_err;
 queue<sensor_msgs::ImageConstPtr> img_buf;
+queue<sensor_msgs::ImuConstPtr> imu_buf;   // 只在IMU_PREDICT打开时使用
+std::mutex m_imu;   // 压缩图像在解码线程里处理，和imu回调不在同一个线程
 
 ros::Publisher pub_img,pub_match;
 ros::Publisher pub_restart;
+ros::Subscriber sub_img, sub_imu;
 
 FeatureTracker trackerData[NUM_OF_CAM];  // 多相机
+WorkerPool camera_pool(NUM_OF_CAM - 1);   // 常驻线程，和回调线程一起每个相机一个，单目时不开线程
+ImageDecoder *decoder = NULL;   // 输入是压缩图像时才创建
 double first_image_time;
 int pub_count = 1;
 bool first_image_flag = true;
 double last_image_time = 0;
 bool init_pub = 0;
 
-// 图片的回调函数
-void img_callback(const sensor_msgs::ImageConstPtr &img_msg)
+// imu的回调函数，只缓存，图像来了再积分
+void imu_callback(const sensor_msgs::ImuConstPtr &imu_msg)
+{
+    m_imu.lock();
+    imu_buf.push(imu_msg);
+    m_imu.unlock();
+}
+
+/**
+ * @brief 积分(t0, t1]之间的陀螺仪读数，得到t1时刻相机坐标系在t0时刻相机坐标系下的旋转
+ * 
+ * @param[in] t0 上一帧图像时间戳
+ * @param[in] t1 当前帧图像时间戳
+ * @param[out] R_c 相机的相对旋转
+ * @return true 有imu数据参与积分
+ * 这里不考虑陀螺仪零偏，只用来给光流提供初值
+ */
+bool predictRotation(double t0, double t1, Eigen::Matrix3d &R_c)
 {
+    // 丢掉上一帧之前的数据
+    while (!imu_buf.empty() && imu_buf.front()->header.stamp.toSec() <= t0)
+        imu_buf.pop();
+    if (imu_buf.empty())
+        return false;
+
+    Eigen::Quaterniond q_b(1, 0, 0, 0);
+    double last_t = t0;
+    int cnt = 0;
+    while (!imu_buf.empty() && imu_buf.front()->header.stamp.toSec() <= t1)
+    {
+        const sensor_msgs::ImuConstPtr &imu_msg = imu_buf.front();
+        double t = imu_msg->header.stamp.toSec();
+        Eigen::Vector3d w(imu_msg->angular_velocity.x, imu_msg->angular_velocity.y, imu_msg->angular_velocity.z);
+        Eigen::Vector3d half_theta = w * (t - last_t) / 2.0;
+        q_b = q_b * Eigen::Quaterniond(1, half_theta.x(), half_theta.y(), half_theta.z());
+        q_b.normalize();
+        last_t = t;
+        imu_buf.pop();
+        cnt++;
+    }
+    // 最后一段用下一个imu读数补齐到图像时刻
+    if (!imu_buf.empty() && last_t < t1)
+    {
+        const sensor_msgs::ImuConstPtr &imu_msg = imu_buf.front();
+        Eigen::Vector3d w(imu_msg->angular_velocity.x, imu_msg->angular_velocity.y, imu_msg->angular_velocity.z);
+        Eigen::Vector3d half_theta = w * (t1 - last_t) / 2.0;
+        q_b = q_b * Eigen::Quaterniond(1, half_theta.x(), half_theta.y(), half_theta.z());
+        q_b.normalize();
+        cnt++;
+    }
+    if (cnt == 0)
+        return false;
+    // imu系的相对旋转转到相机系
+    R_c = RIC.transpose() * q_b.toRotationMatrix() * RIC;
+    return true;
+}
+
+/**
+ * @brief 处理一帧灰度图像：光流追踪，提点，发布特征点
+ * 
+ * @param[in] header 图像的header
+ * @param[in] image 灰度图，可能直接引用消息的内存，这里只读
+ */
+void process_image(const std_msgs::Header &header, const cv::Mat &image)
+{
+    // 分辨率要和配置的一致（缩小解码时已经换算过），不一致说明配置和话题对不上
+    if (image.rows != ROW * NUM_OF_CAM || image.cols != COL)
+    {
+        ROS_WARN_THROTTLE(1.0, "image size %dx%d does not match the config %dx%d, skip it",
+                          image.cols, image.rows, COL, ROW * NUM_OF_CAM);
+        return;
+    }
     if(first_image_flag) // 对第一帧图像的基本操作
     {
         first_image_flag = false;
-        first_image_time = img_msg->header.stamp.toSec();
-        last_image_time = img_msg->header.stamp.toSec();
+        first_image_time = header.stamp.toSec();
+        last_image_time = header.stamp.toSec();
         return;
     }
     // detect unstable camera stream
     // 检查时间戳是否正常，这里认为超过一秒或者错乱就异常
     // 图像时间差太多光流追踪就会失败，这里没有描述子匹配，因此对时间戳要求就高
-    if (img_msg->header.stamp.toSec() - last_image_time > 1.0 || img_msg->header.stamp.toSec() < last_image_time)
+    if (header.stamp.toSec() - last_image_time > 1.0 || header.stamp.toSec() < last_image_time)
     {
         // 一些常规的reset操作
         ROS_WARN("image discontinue! reset the feature tracker!");
         first_image_flag = true; 
+        m_imu.lock();
+        imu_buf = queue<sensor_msgs::ImuConstPtr>();
+        m_imu.unlock();
         last_image_time = 0;
         pub_count = 1;
-        std_msgs::Bool restart_flag;
-        restart_flag.data = true;
+        std_msgs::BoolPtr restart_flag(new std_msgs::Bool);
+        restart_flag->data = true;
         pub_restart.publish(restart_flag);  // > 告诉其他模块要重启了
         return;
     }
-    last_image_time = img_msg->header.stamp.toSec();
+    if (IMU_PREDICT)
+    {
+        Eigen::Matrix3d relative_R;
+        m_imu.lock();
+        bool predicted = predictRotation(last_image_time, header.stamp.toSec(), relative_R);
+        m_imu.unlock();
+        if (predicted)
+        {
+            for (int i = 0; i < NUM_OF_CAM; i++)
+                trackerData[i].setPrediction(relative_R);
+        }
+    }
+    last_image_time = header.stamp.toSec();
     // frequency control
     // 控制一下发给后端的频率
-    if (round(1.0 * pub_count / (img_msg->header.stamp.toSec() - first_image_time)) <= FREQ)    // 保证发给后端的不超过这个频率
+    if (round(1.0 * pub_count / (header.stamp.toSec() - first_image_time)) <= FREQ)    // 保证发给后端的不超过这个频率
     {
         PUB_THIS_FRAME = true;
         // reset the frequency control
         // 这段时间的频率和预设频率十分接近，就认为这段时间很棒，重启一下，避免delta t太大
-        if (abs(1.0 * pub_count / (img_msg->header.stamp.toSec() - first_image_time) - FREQ) < 0.01 * FREQ)
+        if (abs(1.0 * pub_count / (header.stamp.toSec() - first_image_time) - FREQ) < 0.01 * FREQ)
         {
-            first_image_time = img_msg->header.stamp.toSec();
+            first_image_time = header.stamp.toSec();
             pub_count = 0;
         }
     }
@@ -69,70 +161,51 @@ void img_callback(const sensor_msgs::ImageConstPtr &img_msg)
 
     // 即使不发布也是正常做光流追踪的！光流对图像的变化要求尽可能小
 
-    cv_bridge::CvImageConstPtr ptr;
-    // 把ros message转成cv::Mat
-    if (img_msg->encoding == "8UC1")
-    {
-        sensor_msgs::Image img;
-        img.header = img_msg->header;
-        img.height = img_msg->height;
-        img.width = img_msg->width;
-        img.is_bigendian = img_msg->is_bigendian;
-        img.step = img_msg->step;
-        img.data = img_msg->data;
-        img.encoding = "mono8";
-        ptr = cv_bridge::toCvCopy(img, sensor_msgs::image_encodings::MONO8);
-    }
-    else
-        ptr = cv_bridge::toCvCopy(img_msg, sensor_msgs::image_encodings::MONO8);
-
-    cv::Mat show_img = ptr->image;
+    cv::Mat show_img = image;
     TicToc t_r;
-    for (int i = 0; i < NUM_OF_CAM; i++)
+    // 各个相机的追踪互不相关，并行处理，整帧耗时取决于最慢的相机
+    camera_pool.run(NUM_OF_CAM, [&](int i)
     {
         ROS_DEBUG("processing camera %d", i);
         if (i != 1 || !STEREO_TRACK)
-            trackerData[i].readImage(ptr->image.rowRange(ROW * i, ROW * (i + 1)), img_msg->header.stamp.toSec());
+            trackerData[i].readImage(image.rowRange(ROW * i, ROW * (i + 1)), header.stamp.toSec());
         else
         {
             if (EQUALIZE)
             {
                 cv::Ptr<cv::CLAHE> clahe = cv::createCLAHE();
-                clahe->apply(ptr->image.rowRange(ROW * i, ROW * (i + 1)), trackerData[i].cur_img);
+                clahe->apply(image.rowRange(ROW * i, ROW * (i + 1)), trackerData[i].cur_img);
             }
             else
-                trackerData[i].cur_img = ptr->image.rowRange(ROW * i, ROW * (i + 1));
+                trackerData[i].cur_img = image.rowRange(ROW * i, ROW * (i + 1)).clone();   // 要留到下一帧，不能引用消息的内存
         }
 
 #if SHOW_UNDISTORTION
         trackerData[i].showUndistortion("undistrotion_" + std::to_string(i));
 #endif
-    }
+    });
 
-    for (unsigned int i = 0;; i++)
-    {
-        bool completed = false;
-        for (int j = 0; j < NUM_OF_CAM; j++)
-            if (j != 1 || !STEREO_TRACK)
-                completed |= trackerData[j].updateID(i);    // 单目的情况下可以直接用=号
-        if (!completed)
-            break;
-    }
+    // 新点的id在回调线程里按相机顺序统一分配，和线程的完成顺序无关
+    for (int j = 0; j < NUM_OF_CAM; j++)
+        if (j != 1 || !STEREO_TRACK)
+            for (unsigned int i = 0; trackerData[j].updateID(i); i++)
+                ;
     // 给后端喂数据
    if (PUB_THIS_FRAME)
    {
         pub_count++;    // 计数器更新
-        sensor_msgs::PointCloudPtr feature_points(new sensor_msgs::PointCloud);
-        sensor_msgs::ChannelFloat32 id_of_point;
-        sensor_msgs::ChannelFloat32 u_of_point;
-        sensor_msgs::ChannelFloat32 v_of_point;
-        sensor_msgs::ChannelFloat32 velocity_x_of_point;
-        sensor_msgs::ChannelFloat32 velocity_y_of_point;
-
-        feature_points->header = img_msg->header;
+        feature_tracker::FeatureFramePtr feature_points(new feature_tracker::FeatureFrame);
+        feature_points->header = header;
         feature_points->header.frame_id = "world";
 
-        vector<set<int>> hash_ids(NUM_OF_CAM);
+        int n_pub = 0;
+        for (int i = 0; i < NUM_OF_CAM; i++)
+            n_pub += trackerData[i].ids.size();
+        feature_points->id.reserve(n_pub);
+        feature_points->camera_id.reserve(n_pub);
+        feature_points->un_pts.reserve(n_pub * 2);
+        feature_points->pts.reserve(n_pub * 2);
+        feature_points->velocity.reserve(n_pub * 2);
         for (int i = 0; i < NUM_OF_CAM; i++)
         {
             auto &un_pts = trackerData[i].cur_un_pts;   // 去畸变的归一化相机坐标系
@@ -144,28 +217,17 @@ void img_callback(const sensor_msgs::ImageConstPtr &img_msg)
                 // 只发布追踪大于1的，因为等于1没法构成重投影约束，也没法三角化
                 if (trackerData[i].track_cnt[j] > 1)
                 {
-                    int p_id = ids[j];
-                    hash_ids[i].insert(p_id);   // 这个并没有用到
-                    geometry_msgs::Point32 p;
-                    p.x = un_pts[j].x;
-                    p.y = un_pts[j].y;
-                    p.z = 1;
-
-                    // > 利用这个ros消息的格式进行信息存储
-                    feature_points->points.push_back(p);
-                    id_of_point.values.push_back(p_id * NUM_OF_CAM + i);
-                    u_of_point.values.push_back(cur_pts[j].x);
-                    v_of_point.values.push_back(cur_pts[j].y);
-                    velocity_x_of_point.values.push_back(pts_velocity[j].x);
-                    velocity_y_of_point.values.push_back(pts_velocity[j].y);
+                    feature_points->id.push_back(ids[j]);
+                    feature_points->camera_id.push_back(i);
+                    feature_points->un_pts.push_back(un_pts[j].x);
+                    feature_points->un_pts.push_back(un_pts[j].y);
+                    feature_points->pts.push_back(cur_pts[j].x);
+                    feature_points->pts.push_back(cur_pts[j].y);
+                    feature_points->velocity.push_back(pts_velocity[j].x);
+                    feature_points->velocity.push_back(pts_velocity[j].y);
                 }
             }
         }
-        feature_points->channels.push_back(id_of_point);
-        feature_points->channels.push_back(u_of_point);
-        feature_points->channels.push_back(v_of_point);
-        feature_points->channels.push_back(velocity_x_of_point);
-        feature_points->channels.push_back(velocity_y_of_point);
         ROS_DEBUG("publish %f, at %f", feature_points->header.stamp.toSec(), ros::Time::now().toSec());
         // skip the first image; since no optical speed on frist image
         if (!init_pub)
@@ -178,9 +240,11 @@ void img_callback(const sensor_msgs::ImageConstPtr &img_msg)
         // 可视化相关操作
         if (SHOW_TRACK)
         {
-            ptr = cv_bridge::cvtColor(ptr, sensor_msgs::image_encodings::BGR8);
+            // 要在图上画点，单独开一块彩色图，不动共享的输入图像
+            cv_bridge::CvImagePtr show_ptr(new cv_bridge::CvImage(header, sensor_msgs::image_encodings::BGR8));
+            cv::cvtColor(show_img, show_ptr->image, CV_GRAY2BGR);
             //cv::Mat stereo_img(ROW * NUM_OF_CAM, COL, CV_8UC3);
-            cv::Mat stereo_img = ptr->image;
+            cv::Mat stereo_img = show_ptr->image;
 
             for (int i = 0; i < NUM_OF_CAM; i++)
             {
@@ -209,17 +273,38 @@ void img_callback(const sensor_msgs::ImageConstPtr &img_msg)
             }
             //cv::imshow("vis", stereo_img);  // 这里一定要注释掉，否则程序不往下运行了
             //cv::waitKey(5); 
-            pub_match.publish(ptr->toImageMsg());
+            pub_match.publish(show_ptr->toImageMsg());
         }
     }
     ROS_INFO("whole feature tracker processing costs: %f", t_r.toc());
 }
 
-int main(int argc, char **argv)
+// 图片的回调函数
+void img_callback(const sensor_msgs::ImageConstPtr &img_msg)
+{
+    cv_bridge::CvImageConstPtr ptr;
+    // 把ros message转成cv::Mat
+    // 灰度图直接包住消息里的数据，不做拷贝，ptr持有img_msg的引用；需要保存或者修改图像的地方自己拷贝
+    if (img_msg->encoding == "8UC1" || img_msg->encoding == sensor_msgs::image_encodings::MONO8)
+        ptr = cv_bridge::toCvShare(img_msg);
+    else
+        ptr = cv_bridge::toCvCopy(img_msg, sensor_msgs::image_encodings::MONO8);
+    process_image(img_msg->header, ptr->image);
+}
+
+// 压缩图像的回调函数，只交给解码线程，解码完按顺序调用process_image
+void compressed_img_callback(const sensor_msgs::CompressedImageConstPtr &img_msg)
+{
+    decoder->push(img_msg);
+}
+
+/**
+ * @brief 读参数，注册publisher和subscriber，节点和nodelet共用
+ * 
+ * @param[in] n 节点的私有句柄，～代表这个节点的命名空间
+ */
+void setupNode(ros::NodeHandle &n)
 {
-    ros::init(argc, argv, "feature_tracker");   // ros节点初始化
-    ros::NodeHandle n("~"); // 声明一个句柄，～代表这个节点的命名空间
-    ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Info);    // 设置ros log级别
     readParameters(n); // 读取配置文件
 
     for (int i = 0; i < NUM_OF_CAM; i++)
@@ -237,23 +322,46 @@ int main(int argc, char **argv)
             }
             else
                 ROS_INFO("load mask success");
+            // mask和原图一样大，缩小解码时跟着缩小
+            if (DECODE_SCALE != 1)
+                cv::resize(trackerData[i].fisheye_mask, trackerData[i].fisheye_mask, cv::Size(COL, ROW), 0, 0, cv::INTER_NEAREST);
         }
     }
 
-    // 这个向roscore注册订阅这个topic，收到一次message就执行一次回调函数
-    ros::Subscriber sub_img = n.subscribe(IMAGE_TOPIC, 100, img_callback);
-    // 注册一些publisher
-    pub_img = n.advertise<sensor_msgs::PointCloud>("feature", 1000); // 实际发出去的是 /feature_tracker/feature
+    // 注册一些publisher，放在subscriber前面，nodelet里回调可能马上就开始执行
+    pub_img = n.advertise<feature_tracker::FeatureFrame>("feature", 1000); // 实际发出去的是 /feature_tracker/feature
     pub_match = n.advertise<sensor_msgs::Image>("feature_img",1000);
     pub_restart = n.advertise<std_msgs::Bool>("restart",1000);
     /*
     if (SHOW_TRACK)
         cv::namedWindow("vis", cv::WINDOW_NORMAL);
     */
+
+    // 这个向roscore注册订阅这个topic，收到一次message就执行一次回调函数
+    if (COMPRESSED_IMAGE)
+    {
+        decoder = new ImageDecoder(DECODE_THREADS, DECODE_SCALE, process_image);
+        sub_img = n.subscribe(IMAGE_TOPIC, 100, compressed_img_callback);
+    }
+    else
+        sub_img = n.subscribe(IMAGE_TOPIC, 100, img_callback);
+    if (IMU_PREDICT)
+        sub_imu = n.subscribe(IMU_TOPIC, 2000, imu_callback, ros::TransportHints().tcpNoDelay());
+}
+
+#ifndef BUILD_NODELET
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, "feature_tracker");   // ros节点初始化
+    ros::NodeHandle n("~"); // 声明一个句柄，～代表这个节点的命名空间
+    ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Info);    // 设置ros log级别
+    setupNode(n);
     ros::spin();    // spin代表这个节点开始循环查询topic是否接收
+    sub_img.shutdown();
+    delete decoder;
     return 0;
 }
-
+#endif
 
 // new points velocity is 0, pub or not?
 // track cnt > 1 pub?
\ No newline at end of file
@@ -0,0 +1,19 @@
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+void setupNode(ros::NodeHandle &n);
+
+namespace feature_tracker
+{
+// 和feature_tracker节点是同一份代码，装进nodelet manager后和后端在同一个进程里，消息直接传指针不做序列化
+class FeatureTrackerNodelet : public nodelet::Nodelet
+{
+  private:
+    virtual void onInit()
+    {
+        setupNode(getPrivateNodeHandle());
+    }
+};
+}
+
+PLUGINLIB_EXPORT_CLASS(feature_tracker::FeatureTrackerNodelet, nodelet::Nodelet)
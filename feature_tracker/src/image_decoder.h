@@ -0,0 +1,143 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <ros/ros.h>
+#include <camodocal/camera_models/CompressedImage.h>
+
+#include "tic_toc.h"
+
+/**
+ * @brief 常驻的解码线程，多帧并行解码，按收到的顺序串行交给回调
+ *
+ * 解码完成的顺序是乱的，只有队首那一帧解完了才往外交，回调看到的帧序和话题里的时间戳顺序一致；
+ * 回调在解码线程里执行，同一时刻只有一个线程在跑回调。
+ * 解码跟不上相机帧率时，等着解码的帧最多留max_pending个（每个解码线程一个），多出来的丢掉最老的
+ */
+class ImageDecoder
+{
+  public:
+    typedef std::function<void(const std_msgs::Header &, const cv::Mat &)> Callback;
+
+    ImageDecoder(int num_threads, int _scale, const Callback &_callback)
+        : scale(_scale), max_pending(std::max(num_threads, 1)), callback(_callback), delivering(false), stop(false)
+    {
+        for (int i = 0; i < std::max(num_threads, 1); i++)
+            workers.emplace_back(&ImageDecoder::workerLoop, this);
+    }
+
+    ~ImageDecoder()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        cv_frame.notify_all();
+        for (auto &t : workers)
+            t.join();
+    }
+
+    // ros回调线程里调用，只入队，不解码
+    void push(const sensor_msgs::CompressedImageConstPtr &msg)
+    {
+        int dropped = 0;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            frames.emplace_back();
+            frames.back().msg = msg;
+
+            int pending = 0;
+            for (auto &f : frames)
+                if (!f.taken)
+                    pending++;
+            // 从队首开始丢还没开始解的帧，只打标记不出队，解码线程手里的引用不受影响，交付时当作解码失败跳过
+            for (auto it = frames.begin(); pending > max_pending; ++it)
+            {
+                if (it->taken)
+                    continue;
+                it->taken = true;
+                it->done = true;
+                it->msg.reset();
+                pending--;
+                dropped++;
+            }
+        }
+        if (dropped > 0)
+            ROS_WARN("image decoding falls behind, drop %d frame(s)", dropped);
+        cv_frame.notify_one();
+    }
+
+  private:
+    struct Frame
+    {
+        Frame() : taken(false), done(false) {}
+        sensor_msgs::CompressedImageConstPtr msg;
+        cv::Mat image;
+        bool taken, done;
+    };
+
+    void workerLoop()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        while (true)
+        {
+            // deque只在两端增删，其他元素的引用一直有效
+            Frame *frame = nullptr;
+            cv_frame.wait(lock, [&]
+                          {
+                              if (stop)
+                                  return true;
+                              for (auto &f : frames)
+                                  if (!f.taken)
+                                  {
+                                      frame = &f;
+                                      return true;
+                                  }
+                              return false; });
+            if (stop)
+                return;
+            frame->taken = true;
+            sensor_msgs::CompressedImageConstPtr msg = frame->msg;
+            lock.unlock();
+
+            TicToc t_d;
+            cv::Mat image = camodocal::decodeGray(*msg, scale);
+            ROS_DEBUG("decode image costs: %fms", t_d.toc());
+            if (image.empty())
+                ROS_WARN("fail to decode compressed image %f (%s)", msg->header.stamp.toSec(), msg->format.c_str());
+
+            lock.lock();
+            frame->image = image;
+            frame->done = true;
+            // 已经有线程在往外交的话，它交完当前帧会回来检查队首，这里直接去解下一帧
+            if (delivering)
+                continue;
+            delivering = true;
+            while (!frames.empty() && frames.front().done)
+            {
+                Frame front = frames.front();
+                frames.pop_front();
+                if (front.image.empty())
+                    continue;
+                lock.unlock();
+                callback(front.msg->header, front.image);
+                lock.lock();
+            }
+            delivering = false;
+        }
+    }
+
+    int scale;
+    int max_pending;    // 还没开始解码的帧最多留几个
+    Callback callback;
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::condition_variable cv_frame;
+    std::deque<Frame> frames;  // 按收到的顺序排列
+    bool delivering;
+    bool stop;
+};
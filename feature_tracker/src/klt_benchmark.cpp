@@ -0,0 +1,93 @@
+// 自带KLT和cv::calcOpticalFlowPyrLK的对比，输入是录好的图像序列（比如euroc的cam0/data）
+// 用法: klt_benchmark <image_dir> [win_size] [pyr_level] [max_cnt]
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "klt_tracker.h"
+#include "tic_toc.h"
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s <image_dir> [win_size] [pyr_level] [max_cnt]\n", argv[0]);
+        return 1;
+    }
+    string image_dir = argv[1];
+    int win = argc > 2 ? atoi(argv[2]) : 21;
+    int level = argc > 3 ? atoi(argv[3]) : 3;
+    int max_cnt = argc > 4 ? atoi(argv[4]) : 150;
+
+    vector<cv::String> files;
+    cv::glob(image_dir + "/*.png", files, false);
+    if (files.size() < 2)
+    {
+        printf("need at least two png images in %s\n", image_dir.c_str());
+        return 1;
+    }
+
+    cv::Size win_size(win, win);
+    cv::TermCriteria criteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 30, 0.01);
+    KLTTracker klt;
+    klt.setParameters(win, level, criteria);
+    printf("klt kernel: %s, win %d, level %d, max_cnt %d, %zu images\n",
+           kltKernelName(), win, level, max_cnt, files.size());
+
+    vector<cv::Mat> prev_pyr, cur_pyr;
+    cv::Mat prev_img = cv::imread(files[0], cv::IMREAD_GRAYSCALE);
+    cv::buildOpticalFlowPyramid(prev_img, prev_pyr, win_size, level, true);
+
+    double t_cv = 0, t_klt = 0;
+    long n_pts = 0, n_cv = 0, n_klt = 0, n_both = 0, n_agree = 0;
+    double sum_diff = 0;
+    for (size_t k = 1; k < files.size(); k++)
+    {
+        cv::Mat cur_img = cv::imread(files[k], cv::IMREAD_GRAYSCALE);
+        cv::buildOpticalFlowPyramid(cur_img, cur_pyr, win_size, level, true);
+
+        // 每一帧都重新提点，两种方法用同样的输入
+        vector<cv::Point2f> prev_pts;
+        cv::goodFeaturesToTrack(prev_img, prev_pts, max_cnt, 0.01, 30);
+
+        vector<cv::Point2f> pts_cv, pts_klt;
+        vector<uchar> status_cv, status_klt;
+        vector<float> err;
+
+        TicToc t_a;
+        cv::calcOpticalFlowPyrLK(prev_pyr, cur_pyr, prev_pts, pts_cv, status_cv, err, win_size, level, criteria);
+        t_cv += t_a.toc();
+
+        TicToc t_b;
+        klt.track(prev_pyr, cur_pyr, prev_pts, pts_klt, status_klt);
+        t_klt += t_b.toc();
+
+        for (size_t i = 0; i < prev_pts.size(); i++)
+        {
+            n_cv += status_cv[i];
+            n_klt += status_klt[i];
+            if (status_cv[i] && status_klt[i])
+            {
+                double d = cv::norm(pts_cv[i] - pts_klt[i]);
+                n_both++;
+                sum_diff += d;
+                if (d < 0.1)
+                    n_agree++;
+            }
+        }
+        n_pts += prev_pts.size();
+
+        prev_img = cur_img;
+        swap(prev_pyr, cur_pyr);
+    }
+
+    int n_frames = files.size() - 1;
+    printf("opencv: %.3f ms/frame, tracked %.2f%%\n", t_cv / n_frames, 100.0 * n_cv / max(1L, n_pts));
+    printf("klt   : %.3f ms/frame, tracked %.2f%%\n", t_klt / n_frames, 100.0 * n_klt / max(1L, n_pts));
+    printf("speedup %.2fx, mean diff %.4f px, %.2f%% within 0.1 px\n",
+           t_cv / max(t_klt, 1e-9), sum_diff / max(1L, n_both), 100.0 * n_agree / max(1L, n_both));
+    return 0;
+}
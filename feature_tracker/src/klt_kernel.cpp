@@ -0,0 +1,174 @@
+#include "klt_kernel.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define KLT_HAVE_NEON
+#endif
+
+#define KLT_DESCALE(x, n) (((x) + (1 << ((n)-1))) >> (n))
+
+void kltTemplate(const uint8_t *src, ptrdiff_t src_step, const int16_t *dsrc, ptrdiff_t dsrc_step,
+                 int win, const int iw[4], int16_t *I, int16_t *Ix, int16_t *Iy, float A[3])
+{
+    float A11 = 0, A12 = 0, A22 = 0;
+    for (int y = 0; y < win; y++)
+    {
+        const uint8_t *p = src + y * src_step;
+        const int16_t *dp = dsrc + y * dsrc_step;
+        int16_t *pI = I + y * win;
+        int16_t *pIx = Ix + y * win;
+        int16_t *pIy = Iy + y * win;
+        for (int x = 0; x < win; x++)
+        {
+            int ival = KLT_DESCALE(p[x] * iw[0] + p[x + 1] * iw[1] +
+                                   p[x + src_step] * iw[2] + p[x + src_step + 1] * iw[3], KLT_W_BITS - 5);
+            int ixval = KLT_DESCALE(dp[x * 2] * iw[0] + dp[x * 2 + 2] * iw[1] +
+                                    dp[dsrc_step + x * 2] * iw[2] + dp[dsrc_step + x * 2 + 2] * iw[3], KLT_W_BITS);
+            int iyval = KLT_DESCALE(dp[x * 2 + 1] * iw[0] + dp[x * 2 + 3] * iw[1] +
+                                    dp[dsrc_step + x * 2 + 1] * iw[2] + dp[dsrc_step + x * 2 + 3] * iw[3], KLT_W_BITS);
+            pI[x] = (int16_t)ival;
+            pIx[x] = (int16_t)ixval;
+            pIy[x] = (int16_t)iyval;
+            A11 += (float)(ixval * ixval);
+            A12 += (float)(ixval * iyval);
+            A22 += (float)(iyval * iyval);
+        }
+    }
+    A[0] = A11;
+    A[1] = A12;
+    A[2] = A22;
+}
+
+void kltResidualScalar(const uint8_t *src, ptrdiff_t src_step, int win, const int iw[4],
+                       const int16_t *I, const int16_t *Ix, const int16_t *Iy, float b[2])
+{
+    float b1 = 0, b2 = 0;
+    for (int y = 0; y < win; y++)
+    {
+        const uint8_t *p = src + y * src_step;
+        const int16_t *pI = I + y * win;
+        const int16_t *pIx = Ix + y * win;
+        const int16_t *pIy = Iy + y * win;
+        int r1 = 0, r2 = 0;
+        for (int x = 0; x < win; x++)
+        {
+            int diff = KLT_DESCALE(p[x] * iw[0] + p[x + 1] * iw[1] +
+                                   p[x + src_step] * iw[2] + p[x + src_step + 1] * iw[3], KLT_W_BITS - 5) - pI[x];
+            r1 += diff * pIx[x];
+            r2 += diff * pIy[x];
+        }
+        b1 += (float)r1;
+        b2 += (float)r2;
+    }
+    b[0] = b1;
+    b[1] = b2;
+}
+
+#ifdef KLT_HAVE_NEON
+static inline int kltHsum(int32x4_t v)
+{
+#if defined(__aarch64__)
+    return vaddvq_s32(v);
+#else
+    int32x2_t s = vadd_s32(vget_low_s32(v), vget_high_s32(v));
+    s = vpadd_s32(s, s);
+    return vget_lane_s32(s, 0);
+#endif
+}
+
+static void kltResidualNEON(const uint8_t *src, ptrdiff_t src_step, int win, const int iw[4],
+                            const int16_t *I, const int16_t *Ix, const int16_t *Iy, float b[2])
+{
+    const uint16_t w0 = (uint16_t)iw[0], w1 = (uint16_t)iw[1], w2 = (uint16_t)iw[2], w3 = (uint16_t)iw[3];
+    float b1 = 0, b2 = 0;
+    for (int y = 0; y < win; y++)
+    {
+        const uint8_t *p = src + y * src_step;
+        const int16_t *pI = I + y * win;
+        const int16_t *pIx = Ix + y * win;
+        const int16_t *pIy = Iy + y * win;
+        int32x4_t acc1 = vdupq_n_s32(0), acc2 = vdupq_n_s32(0);
+        int x = 0;
+        for (; x + 8 <= win; x += 8)
+        {
+            uint16x8_t a = vmovl_u8(vld1_u8(p + x));
+            uint16x8_t c = vmovl_u8(vld1_u8(p + x + 1));
+            uint16x8_t d = vmovl_u8(vld1_u8(p + x + src_step));
+            uint16x8_t e = vmovl_u8(vld1_u8(p + x + src_step + 1));
+
+            uint32x4_t lo = vmull_n_u16(vget_low_u16(a), w0);
+            lo = vmlal_n_u16(lo, vget_low_u16(c), w1);
+            lo = vmlal_n_u16(lo, vget_low_u16(d), w2);
+            lo = vmlal_n_u16(lo, vget_low_u16(e), w3);
+            uint32x4_t hi = vmull_n_u16(vget_high_u16(a), w0);
+            hi = vmlal_n_u16(hi, vget_high_u16(c), w1);
+            hi = vmlal_n_u16(hi, vget_high_u16(d), w2);
+            hi = vmlal_n_u16(hi, vget_high_u16(e), w3);
+
+            int16x8_t val = vreinterpretq_s16_u16(vcombine_u16(vrshrn_n_u32(lo, KLT_W_BITS - 5),
+                                                               vrshrn_n_u32(hi, KLT_W_BITS - 5)));
+            int16x8_t diff = vsubq_s16(val, vld1q_s16(pI + x));
+            int16x8_t gx = vld1q_s16(pIx + x);
+            int16x8_t gy = vld1q_s16(pIy + x);
+            acc1 = vmlal_s16(acc1, vget_low_s16(diff), vget_low_s16(gx));
+            acc1 = vmlal_s16(acc1, vget_high_s16(diff), vget_high_s16(gx));
+            acc2 = vmlal_s16(acc2, vget_low_s16(diff), vget_low_s16(gy));
+            acc2 = vmlal_s16(acc2, vget_high_s16(diff), vget_high_s16(gy));
+        }
+        int r1 = kltHsum(acc1), r2 = kltHsum(acc2);
+        for (; x < win; x++)
+        {
+            int diff = KLT_DESCALE(p[x] * iw[0] + p[x + 1] * iw[1] +
+                                   p[x + src_step] * iw[2] + p[x + src_step + 1] * iw[3], KLT_W_BITS - 5) - pI[x];
+            r1 += diff * pIx[x];
+            r2 += diff * pIy[x];
+        }
+        b1 += (float)r1;
+        b2 += (float)r2;
+    }
+    b[0] = b1;
+    b[1] = b2;
+}
+#endif
+
+typedef void (*KLTResidualFunc)(const uint8_t *, ptrdiff_t, int, const int *,
+                                const int16_t *, const int16_t *, const int16_t *, float *);
+
+// 运行时选择实现：x86上检查cpu是否支持avx2，arm上neon是基础指令集
+static KLTResidualFunc selectResidual(const char **name)
+{
+#ifdef KLT_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+    {
+        *name = "avx2";
+        return kltResidualAVX2;
+    }
+#endif
+#ifdef KLT_HAVE_NEON
+    *name = "neon";
+    return kltResidualNEON;
+#else
+    *name = "scalar";
+    return kltResidualScalar;
+#endif
+}
+
+static const char *residual_name = "scalar";
+
+static KLTResidualFunc residualFunc()
+{
+    static KLTResidualFunc func = selectResidual(&residual_name);
+    return func;
+}
+
+void kltResidual(const uint8_t *src, ptrdiff_t src_step, int win, const int iw[4],
+                 const int16_t *I, const int16_t *Ix, const int16_t *Iy, float b[2])
+{
+    residualFunc()(src, src_step, win, iw, I, Ix, Iy, b);
+}
+
+const char *kltKernelName()
+{
+    residualFunc();
+    return residual_name;
+}
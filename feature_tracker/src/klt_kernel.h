@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// KLT光流的内层循环，只依赖原始指针，不包含opencv/eigen，方便单独用-mavx2编译
+// 定点格式和opencv的lkpyramid一致：双线性插值权重14位，模板灰度保留5位小数，梯度为Scharr原始尺度
+
+const int KLT_W_BITS = 14;
+const int KLT_MAX_WIN = 31;    // 模板的最大边长，缓冲区按这个大小固定分配
+
+/**
+ * @brief 在上一帧图像和梯度上双线性插值得到模板，同时累加Hessian
+ *
+ * @param[in] src 图像中窗口左上角整数像素的指针
+ * @param[in] src_step 图像一行的字节数
+ * @param[in] dsrc 梯度图(dx,dy交错的int16)中窗口左上角的指针
+ * @param[in] dsrc_step 梯度图一行的int16个数
+ * @param[in] win 窗口边长
+ * @param[in] iw 双线性插值的定点权重(左上，右上，左下，右下)
+ * @param[out] I 模板灰度，win*win
+ * @param[out] Ix 模板x方向梯度，win*win
+ * @param[out] Iy 模板y方向梯度，win*win
+ * @param[out] A Hessian的三个元素(A11, A12, A22)，未乘尺度
+ */
+void kltTemplate(const uint8_t *src, ptrdiff_t src_step, const int16_t *dsrc, ptrdiff_t dsrc_step,
+                 int win, const int iw[4], int16_t *I, int16_t *Ix, int16_t *Iy, float A[3]);
+
+/**
+ * @brief 在当前帧图像上双线性插值并和模板作差，累加梯度和残差的乘积
+ *
+ * @param[in] src 图像中窗口左上角整数像素的指针
+ * @param[in] src_step 图像一行的字节数
+ * @param[in] win 窗口边长
+ * @param[in] iw 双线性插值的定点权重
+ * @param[in] I 模板灰度
+ * @param[in] Ix 模板x方向梯度
+ * @param[in] Iy 模板y方向梯度
+ * @param[out] b 残差向量(b1, b2)，未乘尺度
+ * 每一行先用int32精确累加，再加到float上，各个版本的结果完全一致
+ */
+void kltResidual(const uint8_t *src, ptrdiff_t src_step, int win, const int iw[4],
+                 const int16_t *I, const int16_t *Ix, const int16_t *Iy, float b[2]);
+
+void kltResidualScalar(const uint8_t *src, ptrdiff_t src_step, int win, const int iw[4],
+                       const int16_t *I, const int16_t *Ix, const int16_t *Iy, float b[2]);
+
+#ifdef KLT_HAVE_AVX2
+void kltResidualAVX2(const uint8_t *src, ptrdiff_t src_step, int win, const int iw[4],
+                     const int16_t *I, const int16_t *Ix, const int16_t *Iy, float b[2]);
+#endif
+
+// 当前使用的内层循环实现，用于打印
+const char *kltKernelName();
@@ -0,0 +1,101 @@
+// 这个文件单独用-mavx2编译，不要包含opencv/eigen等带内联函数的头文件
+#include "klt_kernel.h"
+
+#ifdef KLT_HAVE_AVX2
+#include <immintrin.h>
+
+#define KLT_DESCALE(x, n) (((x) + (1 << ((n)-1))) >> (n))
+
+static inline int kltHsum(__m256i v)
+{
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+    return _mm_cvtsi128_si32(s);
+}
+
+static inline int kltHsum(__m128i s)
+{
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+    return _mm_cvtsi128_si32(s);
+}
+
+void kltResidualAVX2(const uint8_t *src, ptrdiff_t src_step, int win, const int iw[4],
+                     const int16_t *I, const int16_t *Ix, const int16_t *Iy, float b[2])
+{
+    // 权重两两打包成int16对，配合madd一次算两个像素的乘加
+    const int w01 = (iw[0] & 0xffff) | (iw[1] << 16);
+    const int w23 = (iw[2] & 0xffff) | (iw[3] << 16);
+    const __m256i vw01 = _mm256_set1_epi32(w01), vw23 = _mm256_set1_epi32(w23);
+    const __m256i vdelta = _mm256_set1_epi32(1 << (KLT_W_BITS - 5 - 1));
+    const __m128i sw01 = _mm_set1_epi32(w01), sw23 = _mm_set1_epi32(w23);
+    const __m128i sdelta = _mm_set1_epi32(1 << (KLT_W_BITS - 5 - 1));
+
+    float b1 = 0, b2 = 0;
+    for (int y = 0; y < win; y++)
+    {
+        const uint8_t *p = src + y * src_step;
+        const int16_t *pI = I + y * win;
+        const int16_t *pIx = Ix + y * win;
+        const int16_t *pIy = Iy + y * win;
+        __m256i acc1 = _mm256_setzero_si256(), acc2 = _mm256_setzero_si256();
+        int x = 0;
+        // 每次16个像素，读到的最右边正好是插值需要的x+16
+        for (; x + 16 <= win; x += 16)
+        {
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + x)));
+            __m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + x + 1)));
+            __m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + x + src_step)));
+            __m256i e = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + x + src_step + 1)));
+
+            // unpack和pack都是按128位分段的，两次打乱正好抵消，结果保持原顺序
+            __m256i t0 = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(a, c), vw01),
+                                          _mm256_madd_epi16(_mm256_unpacklo_epi16(d, e), vw23));
+            __m256i t1 = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(a, c), vw01),
+                                          _mm256_madd_epi16(_mm256_unpackhi_epi16(d, e), vw23));
+            t0 = _mm256_srai_epi32(_mm256_add_epi32(t0, vdelta), KLT_W_BITS - 5);
+            t1 = _mm256_srai_epi32(_mm256_add_epi32(t1, vdelta), KLT_W_BITS - 5);
+
+            __m256i diff = _mm256_sub_epi16(_mm256_packs_epi32(t0, t1),
+                                            _mm256_loadu_si256((const __m256i *)(pI + x)));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(diff, _mm256_loadu_si256((const __m256i *)(pIx + x))));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(diff, _mm256_loadu_si256((const __m256i *)(pIy + x))));
+        }
+        int r1 = kltHsum(acc1), r2 = kltHsum(acc2);
+
+        // 剩下的不足16个时再按8个处理一次
+        if (x + 8 <= win)
+        {
+            __m128i a = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(p + x)));
+            __m128i c = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(p + x + 1)));
+            __m128i d = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(p + x + src_step)));
+            __m128i e = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(p + x + src_step + 1)));
+
+            __m128i t0 = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, c), sw01),
+                                       _mm_madd_epi16(_mm_unpacklo_epi16(d, e), sw23));
+            __m128i t1 = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, c), sw01),
+                                       _mm_madd_epi16(_mm_unpackhi_epi16(d, e), sw23));
+            t0 = _mm_srai_epi32(_mm_add_epi32(t0, sdelta), KLT_W_BITS - 5);
+            t1 = _mm_srai_epi32(_mm_add_epi32(t1, sdelta), KLT_W_BITS - 5);
+
+            __m128i diff = _mm_sub_epi16(_mm_packs_epi32(t0, t1), _mm_loadu_si128((const __m128i *)(pI + x)));
+            r1 += kltHsum(_mm_madd_epi16(diff, _mm_loadu_si128((const __m128i *)(pIx + x))));
+            r2 += kltHsum(_mm_madd_epi16(diff, _mm_loadu_si128((const __m128i *)(pIy + x))));
+            x += 8;
+        }
+
+        for (; x < win; x++)
+        {
+            int diff = KLT_DESCALE(p[x] * iw[0] + p[x + 1] * iw[1] +
+                                   p[x + src_step] * iw[2] + p[x + src_step + 1] * iw[3], KLT_W_BITS - 5) - pI[x];
+            r1 += diff * pIx[x];
+            r2 += diff * pIy[x];
+        }
+        b1 += (float)r1;
+        b2 += (float)r2;
+    }
+    b[0] = b1;
+    b[1] = b2;
+}
+#endif
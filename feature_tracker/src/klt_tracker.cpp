@@ -0,0 +1,180 @@
+#include <cfloat>
+#include <cmath>
+
+#include "klt_tracker.h"
+
+// 模板灰度带5位小数，梯度是Scharr尺度，Hessian和残差统一乘这个尺度，和opencv保持一致
+static const float KLT_FLT_SCALE = 1.f / (1 << 20);
+
+// 双线性插值的定点权重
+static inline void kltWeights(const cv::Point2f &pt, const cv::Point2i &ipt, int iw[4])
+{
+    float a = pt.x - ipt.x;
+    float b = pt.y - ipt.y;
+    iw[0] = cvRound((1.f - a) * (1.f - b) * (1 << KLT_W_BITS));
+    iw[1] = cvRound(a * (1.f - b) * (1 << KLT_W_BITS));
+    iw[2] = cvRound((1.f - a) * b * (1 << KLT_W_BITS));
+    iw[3] = (1 << KLT_W_BITS) - iw[0] - iw[1] - iw[2];
+}
+
+// 每个线程负责一段特征点
+class KLTInvoker : public cv::ParallelLoopBody
+{
+  public:
+    KLTInvoker(const KLTTracker &_tracker, const std::vector<cv::Mat> &_prev_pyr, const std::vector<cv::Mat> &_next_pyr,
+               int _max_level, const std::vector<cv::Point2f> &_prev_pts, std::vector<cv::Point2f> &_next_pts,
+               std::vector<uchar> &_status, bool _use_initial_flow)
+        : tracker(_tracker), prev_pyr(_prev_pyr), next_pyr(_next_pyr), max_level(_max_level),
+          prev_pts(_prev_pts), next_pts(_next_pts), status(_status), use_initial_flow(_use_initial_flow)
+    {
+    }
+
+    void operator()(const cv::Range &range) const
+    {
+        for (int i = range.start; i < range.end; i++)
+            tracker.trackPoint(prev_pyr, next_pyr, max_level, prev_pts[i], next_pts[i], status[i], use_initial_flow);
+    }
+
+  private:
+    const KLTTracker &tracker;
+    const std::vector<cv::Mat> &prev_pyr;
+    const std::vector<cv::Mat> &next_pyr;
+    int max_level;
+    const std::vector<cv::Point2f> &prev_pts;
+    std::vector<cv::Point2f> &next_pts;
+    std::vector<uchar> &status;
+    bool use_initial_flow;
+};
+
+KLTTracker::KLTTracker()
+    : win_size(21), max_level(3),
+      criteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 30, 0.01),
+      min_eig_threshold(1e-4f)
+{
+}
+
+void KLTTracker::setParameters(int _win_size, int _max_level, const cv::TermCriteria &_criteria)
+{
+    CV_Assert(_win_size >= 3 && _win_size <= KLT_MAX_WIN);
+    win_size = _win_size;
+    max_level = _max_level;
+    criteria = _criteria;
+}
+
+void KLTTracker::track(const std::vector<cv::Mat> &prev_pyr, const std::vector<cv::Mat> &next_pyr,
+                       const std::vector<cv::Point2f> &prev_pts, std::vector<cv::Point2f> &next_pts,
+                       std::vector<uchar> &status, bool use_initial_flow) const
+{
+    int n = prev_pts.size();
+    status.resize(n);
+    if (use_initial_flow)
+        CV_Assert((int)next_pts.size() == n);
+    else
+        next_pts = prev_pts;
+    if (n == 0)
+        return;
+
+    // 只支持带梯度的金字塔：[图像0, 梯度0, 图像1, 梯度1, ...]
+    CV_Assert(prev_pyr.size() >= 2 && next_pyr.size() >= 2);
+    CV_Assert(prev_pyr[0].type() == CV_8UC1 && prev_pyr[1].type() == CV_16SC2 && next_pyr[0].type() == CV_8UC1);
+    int levels = std::min(max_level, (int)std::min(prev_pyr.size(), next_pyr.size()) / 2 - 1);
+
+    cv::parallel_for_(cv::Range(0, n), KLTInvoker(*this, prev_pyr, next_pyr, levels, prev_pts, next_pts, status, use_initial_flow));
+}
+
+/**
+ * @brief 单个点从金字塔顶层到底层逐层追踪
+ *
+ * 和opencv一样：某一层窗口出界或者Hessian退化时，只有在最底层才判为追踪失败
+ */
+void KLTTracker::trackPoint(const std::vector<cv::Mat> &prev_pyr, const std::vector<cv::Mat> &next_pyr, int levels,
+                            const cv::Point2f &prev_pt, cv::Point2f &next_pt, uchar &st, bool use_initial_flow) const
+{
+    int16_t I[KLT_MAX_WIN * KLT_MAX_WIN];
+    int16_t Ix[KLT_MAX_WIN * KLT_MAX_WIN];
+    int16_t Iy[KLT_MAX_WIN * KLT_MAX_WIN];
+
+    const cv::Point2f half_win((win_size - 1) * 0.5f, (win_size - 1) * 0.5f);
+    const int max_iter = (criteria.type & cv::TermCriteria::COUNT) ? std::max(criteria.maxCount, 1) : 30;
+    const float eps2 = (criteria.type & cv::TermCriteria::EPS) ? (float)(criteria.epsilon * criteria.epsilon) : 0.f;
+
+    st = 1;
+    float top_scale = 1.f / (1 << levels);
+    cv::Point2f next = (use_initial_flow ? next_pt : prev_pt) * top_scale;
+    for (int level = levels; level >= 0; level--)
+    {
+        const cv::Mat &img_i = prev_pyr[level * 2];
+        const cv::Mat &deriv_i = prev_pyr[level * 2 + 1];
+        const cv::Mat &img_j = next_pyr[level * 2];
+        const ptrdiff_t step_i = img_i.step[0], step_d = deriv_i.step[0], step_j = img_j.step[0];
+
+        bool ok = true;
+        cv::Point2f prev = prev_pt * (1.f / (1 << level)) - half_win;
+        cv::Point2i iprev(cvFloor(prev.x), cvFloor(prev.y));
+        // 金字塔每层都有win_size的边界，窗口可以伸进边界里
+        if (iprev.x < -win_size || iprev.x >= deriv_i.cols || iprev.y < -win_size || iprev.y >= deriv_i.rows)
+            ok = false;
+
+        float A11 = 0, A12 = 0, A22 = 0, D = 0;
+        if (ok)
+        {
+            int iw[4];
+            kltWeights(prev, iprev, iw);
+            const uint8_t *src = img_i.data + iprev.y * step_i + iprev.x;
+            const int16_t *dsrc = (const int16_t *)(deriv_i.data + iprev.y * step_d) + iprev.x * 2;
+            float A[3];
+            kltTemplate(src, step_i, dsrc, step_d / sizeof(int16_t), win_size, iw, I, Ix, Iy, A);
+            A11 = A[0] * KLT_FLT_SCALE;
+            A12 = A[1] * KLT_FLT_SCALE;
+            A22 = A[2] * KLT_FLT_SCALE;
+            D = A11 * A22 - A12 * A12;
+            float min_eig = (A22 + A11 - std::sqrt((A11 - A22) * (A11 - A22) + 4.f * A12 * A12)) /
+                            (2 * win_size * win_size);
+            if (min_eig < min_eig_threshold || D < FLT_EPSILON)
+                ok = false;
+            else
+                D = 1.f / D;
+        }
+
+        if (ok)
+        {
+            cv::Point2f cur = next - half_win;
+            cv::Point2f prev_delta(0, 0);
+            for (int j = 0; j < max_iter; j++)
+            {
+                cv::Point2i inext(cvFloor(cur.x), cvFloor(cur.y));
+                if (inext.x < -win_size || inext.x >= img_j.cols || inext.y < -win_size || inext.y >= img_j.rows)
+                {
+                    ok = false;
+                    break;
+                }
+                int iw[4];
+                kltWeights(cur, inext, iw);
+                float b[2];
+                kltResidual(img_j.data + inext.y * step_j + inext.x, step_j, win_size, iw, I, Ix, Iy, b);
+                float b1 = b[0] * KLT_FLT_SCALE;
+                float b2 = b[1] * KLT_FLT_SCALE;
+
+                cv::Point2f delta((A12 * b2 - A22 * b1) * D, (A12 * b1 - A11 * b2) * D);
+                cur += delta;
+                // 每个点单独判断收敛，收敛就提前结束
+                if (delta.x * delta.x + delta.y * delta.y <= eps2)
+                    break;
+                // 来回震荡时取中点
+                if (j > 0 && std::abs(delta.x + prev_delta.x) < 0.01f && std::abs(delta.y + prev_delta.y) < 0.01f)
+                {
+                    cur -= delta * 0.5f;
+                    break;
+                }
+                prev_delta = delta;
+            }
+            next = cur + half_win;
+        }
+
+        if (!ok && level == 0)
+            st = 0;
+        if (level > 0)
+            next *= 2.f;
+    }
+    next_pt = next;
+}
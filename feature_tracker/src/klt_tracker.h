@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "klt_kernel.h"
+
+/**
+ * @brief 金字塔KLT光流，输入输出和cv::calcOpticalFlowPyrLK一致
+ *
+ * 金字塔直接用cv::buildOpticalFlowPyramid(..., true)建好的（图像和int16 Scharr梯度交错存放，带winSize的边界），
+ * 固定大小的模板，内层循环用avx2/neon，每个点收敛后立即停止迭代
+ */
+class KLTTracker
+{
+  public:
+    KLTTracker();
+
+    void setParameters(int _win_size, int _max_level, const cv::TermCriteria &_criteria);
+
+    /**
+     * @brief 光流追踪
+     *
+     * @param[in] prev_pyr 上一帧的金字塔（带梯度）
+     * @param[in] next_pyr 当前帧的金字塔（带梯度）
+     * @param[in] prev_pts 上一帧的特征点
+     * @param[in,out] next_pts 当前帧的特征点，use_initial_flow时作为初值
+     * @param[out] status 追踪成功为1
+     * @param[in] use_initial_flow 是否使用next_pts作为初值
+     */
+    void track(const std::vector<cv::Mat> &prev_pyr, const std::vector<cv::Mat> &next_pyr,
+               const std::vector<cv::Point2f> &prev_pts, std::vector<cv::Point2f> &next_pts,
+               std::vector<uchar> &status, bool use_initial_flow = false) const;
+
+    void trackPoint(const std::vector<cv::Mat> &prev_pyr, const std::vector<cv::Mat> &next_pyr, int max_level,
+                    const cv::Point2f &prev_pt, cv::Point2f &next_pt, uchar &status, bool use_initial_flow) const;
+
+    int win_size;
+    int max_level;
+    cv::TermCriteria criteria;
+    float min_eig_threshold;
+};
@@ -1,4 +1,7 @@
 #include "parameters.h"
+#include <opencv2/core/eigen.hpp>
+#include "klt_kernel.h"
+#include <camodocal/camera_models/CompressedImage.h>
 
 std::string IMAGE_TOPIC;
 std::string IMU_TOPIC;
@@ -16,6 +19,18 @@ int ROW;
 int COL;
 int FOCAL_LENGTH;
 int FISHEYE;
+int GRID_DETECT;
+int GRID_ROW;
+int GRID_COL;
+int LK_PYR_LEVEL;
+int LK_WIN_SIZE;
+int LK_MAX_ITER;
+int LK_TRACKER;
+int IMU_PREDICT;
+int COMPRESSED_IMAGE;
+int DECODE_THREADS;
+int DECODE_SCALE;
+Eigen::Matrix3d RIC;
 bool PUB_THIS_FRAME;
 
 template <typename T>
@@ -63,6 +78,73 @@ void readParameters(ros::NodeHandle &n)
         FISHEYE_MASK = VINS_FOLDER_PATH + "config/fisheye_mask.jpg";
     CAM_NAMES.push_back(config_file);
 
+    // 栅格化均匀化和分块提取特征点，不配置时默认关闭
+    GRID_DETECT = fsSettings["grid_detect"];
+    GRID_ROW = fsSettings["grid_row"];
+    GRID_COL = fsSettings["grid_col"];
+    if (GRID_ROW <= 0)
+        GRID_ROW = 4;
+    if (GRID_COL <= 0)
+        GRID_COL = 6;
+
+    // 光流金字塔层数和窗口大小，不配置时沿用原来的3层和21x21；层数0表示只在原图上跟踪，是合法配置
+    if (fsSettings["lk_pyr_level"].empty())
+        LK_PYR_LEVEL = 3;
+    else
+        LK_PYR_LEVEL = fsSettings["lk_pyr_level"];
+    if (LK_PYR_LEVEL < 0)
+    {
+        ROS_WARN("lk_pyr_level %d is negative, use 3", LK_PYR_LEVEL);
+        LK_PYR_LEVEL = 3;
+    }
+    LK_WIN_SIZE = fsSettings["lk_win_size"];
+    LK_MAX_ITER = fsSettings["lk_max_iter"];
+    if (LK_WIN_SIZE <= 0)
+        LK_WIN_SIZE = 21;
+    if (LK_MAX_ITER <= 0)
+        LK_MAX_ITER = 30;
+    // 0: opencv光流，1: 自带的KLT（窗口最大KLT_MAX_WIN）
+    LK_TRACKER = fsSettings["lk_tracker"];
+    if (LK_TRACKER == 1 && LK_WIN_SIZE > KLT_MAX_WIN)
+    {
+        ROS_WARN("lk_win_size %d is too large for the in-tree klt tracker, use opencv instead", LK_WIN_SIZE);
+        LK_TRACKER = 0;
+    }
+    if (LK_TRACKER == 1)
+        ROS_INFO("in-tree klt tracker uses %s kernel", kltKernelName());
+
+    // 用陀螺仪积分的旋转预测光流初值，需要知道相机到imu的旋转外参
+    IMU_PREDICT = fsSettings["imu_predict"];
+    RIC.setIdentity();
+    if (IMU_PREDICT)
+    {
+        int estimate_extrinsic = fsSettings["estimate_extrinsic"];
+        if (estimate_extrinsic == 2)
+        {
+            ROS_WARN("no prior extrinsic rotation, disable imu aided optical flow prediction");
+            IMU_PREDICT = 0;
+        }
+        else
+        {
+            cv::Mat cv_R;
+            fsSettings["extrinsicRotation"] >> cv_R;
+            cv::cv2eigen(cv_R, RIC);
+            RIC = Eigen::Quaterniond(RIC).normalized().toRotationMatrix();
+        }
+    }
+
+    // image_topic是sensor_msgs/CompressedImage时直接在节点里解码，不用再单独republish
+    COMPRESSED_IMAGE = fsSettings["compressed_image"];
+    DECODE_THREADS = fsSettings["decode_threads"];
+    DECODE_SCALE = fsSettings["decode_scale"];
+    if (DECODE_THREADS <= 0)
+        DECODE_THREADS = 2;
+    if (!COMPRESSED_IMAGE || (DECODE_SCALE != 2 && DECODE_SCALE != 4 && DECODE_SCALE != 8))
+        DECODE_SCALE = 1;
+    // 配置里的分辨率和标定都是原图的，缩小解码时换算过去，内参在readIntrinsicParameter()里换算
+    ROW = camodocal::decodedSize(ROW, DECODE_SCALE);
+    COL = camodocal::decodedSize(COL, DECODE_SCALE);
+
     WINDOW_SIZE = 20;
     STEREO_TRACK = false;
     FOCAL_LENGTH = 460;
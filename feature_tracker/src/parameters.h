@@ -1,6 +1,7 @@
 #pragma once
 #include <ros/ros.h>
 #include <opencv2/highgui/highgui.hpp>
+#include <eigen3/Eigen/Dense>
 
 extern int ROW;
 extern int COL;
@@ -21,6 +22,18 @@ extern int SHOW_TRACK;
 extern int STEREO_TRACK;
 extern int EQUALIZE;
 extern int FISHEYE;
+extern int GRID_DETECT;
+extern int GRID_ROW;
+extern int GRID_COL;
+extern int LK_PYR_LEVEL;
+extern int LK_WIN_SIZE;
+extern int LK_MAX_ITER;
+extern int LK_TRACKER;
+extern int IMU_PREDICT;
+extern int COMPRESSED_IMAGE;
+extern int DECODE_THREADS;
+extern int DECODE_SCALE;
+extern Eigen::Matrix3d RIC;
 extern bool PUB_THIS_FRAME;
 
 void readParameters(ros::NodeHandle &n);
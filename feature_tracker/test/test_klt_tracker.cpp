@@ -0,0 +1,110 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "../src/klt_tracker.h"
+
+namespace
+{
+// 高斯模糊过的随机纹理，角点多而且灰度平滑，双线性插值误差小
+cv::Mat makeTexture(const cv::Size &size, cv::Mat &texture)
+{
+    texture.create(size, CV_32F);
+    cv::RNG rng(7);
+    rng.fill(texture, cv::RNG::UNIFORM, 0, 255);
+    cv::GaussianBlur(texture, texture, cv::Size(0, 0), 2.0);
+    cv::normalize(texture, texture, 10, 245, cv::NORM_MINMAX);
+    cv::Mat img;
+    texture.convertTo(img, CV_8U);
+    return img;
+}
+
+// 整幅图平移shift，在浮点纹理上插值后再量化，真值就是shift
+cv::Mat shiftImage(const cv::Mat &texture, const cv::Point2f &shift)
+{
+    cv::Mat M = (cv::Mat_<double>(2, 3) << 1, 0, shift.x, 0, 1, shift.y);
+    cv::Mat shifted, img;
+    cv::warpAffine(texture, shifted, M, texture.size(), cv::INTER_CUBIC, cv::BORDER_REFLECT);
+    shifted.convertTo(img, CV_8U);
+    return img;
+}
+}
+
+// 自带的KLT在已知平移的合成图像上要和cv::calcOpticalFlowPyrLK一样追上，误差在亚像素以内
+TEST(KLTTracker, TracksSyntheticShiftLikeOpenCV)
+{
+    const int win = 21, level = 3;
+    const cv::Point2f shift(6.35f, -4.6f);
+    cv::Mat texture;
+    cv::Mat prev_img = makeTexture(cv::Size(640, 480), texture);
+    cv::Mat next_img = shiftImage(texture, shift);
+
+    // 离边界足够远，平移后窗口不会出界
+    cv::Mat mask = cv::Mat::zeros(prev_img.size(), CV_8UC1);
+    mask(cv::Rect(40, 40, prev_img.cols - 80, prev_img.rows - 80)).setTo(255);
+    std::vector<cv::Point2f> prev_pts;
+    cv::goodFeaturesToTrack(prev_img, prev_pts, 200, 0.01, 10, mask);
+    ASSERT_GE(prev_pts.size(), 100u);
+
+    cv::Size win_size(win, win);
+    cv::TermCriteria criteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 30, 0.01);
+    std::vector<cv::Mat> prev_pyr, next_pyr;
+    cv::buildOpticalFlowPyramid(prev_img, prev_pyr, win_size, level, true);
+    cv::buildOpticalFlowPyramid(next_img, next_pyr, win_size, level, true);
+
+    std::vector<cv::Point2f> pts_cv, pts_klt;
+    std::vector<uchar> status_cv, status_klt;
+    std::vector<float> err;
+    cv::calcOpticalFlowPyrLK(prev_pyr, next_pyr, prev_pts, pts_cv, status_cv, err, win_size, level, criteria);
+    KLTTracker klt;
+    klt.setParameters(win, level, criteria);
+    klt.track(prev_pyr, next_pyr, prev_pts, pts_klt, status_klt);
+    ASSERT_EQ(pts_klt.size(), prev_pts.size());
+    ASSERT_EQ(status_klt.size(), prev_pts.size());
+
+    int n = prev_pts.size(), n_klt = 0, n_same_status = 0;
+    double sum_err = 0, max_err = 0, max_diff = 0;
+    for (int i = 0; i < n; i++)
+    {
+        n_same_status += status_cv[i] == status_klt[i];
+        if (!status_klt[i])
+            continue;
+        n_klt++;
+        double e = cv::norm(pts_klt[i] - (prev_pts[i] + shift));
+        sum_err += e;
+        max_err = std::max(max_err, e);
+        if (status_cv[i])
+            max_diff = std::max(max_diff, (double)cv::norm(pts_klt[i] - pts_cv[i]));
+    }
+    EXPECT_GE(n_klt, n * 95 / 100);
+    EXPECT_GE(n_same_status, n * 98 / 100);
+    EXPECT_LT(sum_err / n_klt, 0.05);
+    EXPECT_LT(max_err, 0.2);
+    EXPECT_LT(max_diff, 0.05);
+}
+
+// 向量化的内层循环和标量版本逐位一致
+TEST(KLTTracker, ResidualKernelMatchesScalar)
+{
+    const int win = KLT_MAX_WIN;
+    cv::RNG rng(3);
+    cv::Mat img(win + 1, win + 1, CV_8UC1);
+    rng.fill(img, cv::RNG::UNIFORM, 0, 256);
+    std::vector<int16_t> I(win * win), Ix(win * win), Iy(win * win);
+    for (int k = 0; k < win * win; k++)
+    {
+        I[k] = (int16_t)rng.uniform(0, 255 << 5);
+        Ix[k] = (int16_t)rng.uniform(-4000, 4000);
+        Iy[k] = (int16_t)rng.uniform(-4000, 4000);
+    }
+    for (int w = 3; w <= win; w += 2)
+    {
+        const int iw[4] = {9000, 3000, 3000, (1 << KLT_W_BITS) - 15000};
+        float b[2], b_scalar[2];
+        kltResidual(img.data, img.step[0], w, iw, I.data(), Ix.data(), Iy.data(), b);
+        kltResidualScalar(img.data, img.step[0], w, iw, I.data(), Ix.data(), Iy.data(), b_scalar);
+        EXPECT_EQ(b[0], b_scalar[0]) << "win " << w << " kernel " << kltKernelName();
+        EXPECT_EQ(b[1], b_scalar[1]) << "win " << w << " kernel " << kltKernelName();
+    }
+}
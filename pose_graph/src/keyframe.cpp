@@ -1,4 +1,5 @@
 #include "keyframe.h"
+#include <boost/make_shared.hpp>
 
 template <typename Derived>
 static void reduceVector(vector<Derived> &v, vector<uchar> status)
@@ -37,7 +38,8 @@ KeyFrame::KeyFrame(double _time_stamp, int _index, Vector3d &_vio_T_w_i, Matrix3
 	R_w_i = vio_R_w_i;
 	origin_vio_T = vio_T_w_i;		
 	origin_vio_R = vio_R_w_i;
-	image = _image.clone();
+	// 只有DEBUG_IMAGE才保留原图，否则构造函数里只读一下提描述子，结束就释放，不用拷贝
+	image = DEBUG_IMAGE ? _image.clone() : _image;
 	cv::resize(image, thumbnail, cv::Size(80, 60)); // 这个缩小尺寸应该是为了可视化
 	point_3d = _point_3d;
 	point_2d_uv = _point_2d_uv;
@@ -137,12 +139,14 @@ void KeyFrame::computeBRIEFPoint()
 		}
 	}
 	extractor(image, keypoints, brief_descriptors);
+	vector<cv::Point2f> tmp_pts(keypoints.size()), tmp_un_pts;
+	for (int i = 0; i < (int)keypoints.size(); i++)
+		tmp_pts[i] = keypoints[i].pt;
+	m_camera->liftProjectiveBatch(tmp_pts, tmp_un_pts);	// 查表得到去畸变的归一化坐标
 	for (int i = 0; i < (int)keypoints.size(); i++)
 	{
-		Eigen::Vector3d tmp_p;
-		m_camera->liftProjective(Eigen::Vector2d(keypoints[i].pt.x, keypoints[i].pt.y), tmp_p);	// 得到去畸变的坐标
 		cv::KeyPoint tmp_norm;
-		tmp_norm.pt = cv::Point2f(tmp_p.x()/tmp_p.z(), tmp_p.y()/tmp_p.z());	// 再归一化一下
+		tmp_norm.pt = tmp_un_pts[i];
 		keypoints_norm.push_back(tmp_norm);
 	}
 }
@@ -595,7 +599,7 @@ bool KeyFrame::findConnection(KeyFrame* old_kf)
 			    t_q_index.values.push_back(Q.z());
 			    t_q_index.values.push_back(index);	// 当前帧的索引
 			    msg_match_points.channels.push_back(t_q_index);
-			    pub_match_points.publish(msg_match_points);
+			    pub_match_points.publish(boost::make_shared<sensor_msgs::PointCloud>(std::move(msg_match_points)));	// 按指针发布，同一进程里不做序列化
 	    	}
 	        return true;
 	    }
@@ -7,6 +7,7 @@ PoseGraph::PoseGraph()
     posegraph_visualization->setScale(0.1);
     posegraph_visualization->setLineWidth(0.01);
     // 生成一个线程，该线程用于进行4自由度全局优化
+    stop_optimization = false;
 	t_optimization = std::thread(&PoseGraph::optimize4DoF, this);
     // 初始化一些变量
     earliest_loop_index = -1;
@@ -24,6 +25,7 @@ PoseGraph::PoseGraph()
 
 PoseGraph::~PoseGraph()
 {
+    stop_optimization = true;
 	t_optimization.join();
 }
 /**
@@ -445,7 +447,7 @@ void PoseGraph::addKeyFrameIntoVoc(KeyFrame* keyframe)
  */
 void PoseGraph::optimize4DoF()
 {
-    while(true)
+    while(!stop_optimization)
     {
         int cur_index = -1;
         int first_looped_index = -1;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <thread>
+#include <atomic>
 #include <mutex>
 #include <opencv2/opencv.hpp>
 #include <eigen3/Eigen/Dense>
@@ -69,6 +70,7 @@ private:
 	std::mutex m_path;
 	std::mutex m_drift;
 	std::thread t_optimization;
+	std::atomic<bool> stop_optimization;	// 析构时置位，让优化线程退出后再join
 	std::queue<int> optimize_buf;
 
 	int global_index;
@@ -4,15 +4,18 @@
 #include <nav_msgs/Path.h>
 #include <sensor_msgs/PointCloud.h>
 #include <sensor_msgs/Image.h>
+#include <sensor_msgs/CompressedImage.h>
 #include <sensor_msgs/image_encodings.h>
 #include <visualization_msgs/Marker.h>
 #include <std_msgs/Bool.h>
 #include <cv_bridge/cv_bridge.h>
+#include <camodocal/camera_models/CompressedImage.h>
 #include <iostream>
 #include <ros/package.h>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <atomic>
 #include <eigen3/Eigen/Dense>
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/eigen.hpp>
@@ -24,7 +27,14 @@
 #define SKIP_FIRST_CNT 10
 using namespace std;
 
-queue<sensor_msgs::ImageConstPtr> image_buf;
+// 原图或者压缩图，压缩图只有真正建KF的那一帧才解码，大部分帧在process里就被跳过了
+struct ImageBuf
+{
+    std_msgs::Header header;
+    sensor_msgs::ImageConstPtr image;
+    sensor_msgs::CompressedImageConstPtr compressed;
+};
+queue<ImageBuf> image_buf;
 queue<sensor_msgs::PointCloudConstPtr> point_buf;
 queue<nav_msgs::Odometry::ConstPtr> pose_buf;
 queue<Eigen::Vector3d> odometry_buf;
@@ -48,6 +58,8 @@ int DEBUG_IMAGE;
 int VISUALIZE_IMU_FORWARD;
 int LOOP_CLOSURE;
 int FAST_RELOCALIZATION;
+int COMPRESSED_IMAGE;
+int DECODE_SCALE;
 
 camodocal::CameraPtr m_camera;
 Eigen::Vector3d tic;
@@ -57,6 +69,9 @@ ros::Publisher pub_match_points;
 ros::Publisher pub_camera_pose_visual;
 ros::Publisher pub_key_odometrys;
 ros::Publisher pub_vio_path;
+ros::Subscriber sub_imu_forward, sub_vio, sub_image, sub_pose, sub_extrinsic, sub_point, sub_relo_relative_pose;
+std::atomic<bool> shutdown_process(false);  // 节点/nodelet退出时置位，回环检测线程下一轮循环退出
+std::thread measurement_process;
 nav_msgs::Path no_loop_path;
 
 std::string BRIEF_PATTERN_FILE;
@@ -94,27 +109,46 @@ void new_sequence()
     m_buf.unlock();
 }
 
-// 原图的回调函数
-void image_callback(const sensor_msgs::ImageConstPtr &image_msg)
+void push_image(const ImageBuf &image)
 {
-    //ROS_INFO("image_callback!");
-    if(!LOOP_CLOSURE)   // 不检测回环，原图也没有意义
-        return;
     m_buf.lock();
-    image_buf.push(image_msg);  // 存入buffer
+    image_buf.push(image);  // 存入buffer
     m_buf.unlock();
-    //printf(" image time %f \n", image_msg->header.stamp.toSec());
+    //printf(" image time %f \n", image.header.stamp.toSec());
 
     // detect unstable camera stream
     if (last_image_time == -1)
-        last_image_time = image_msg->header.stamp.toSec();
+        last_image_time = image.header.stamp.toSec();
     // 检查时间戳是否错乱以及延时过大
-    else if (image_msg->header.stamp.toSec() - last_image_time > 1.0 || image_msg->header.stamp.toSec() < last_image_time)
+    else if (image.header.stamp.toSec() - last_image_time > 1.0 || image.header.stamp.toSec() < last_image_time)
     {
         ROS_WARN("image discontinue! detect a new sequence!");
         new_sequence(); // 如果发生了就新建一个序列 TODO: sequense 是否可以合并？
     }
-    last_image_time = image_msg->header.stamp.toSec();
+    last_image_time = image.header.stamp.toSec();
+}
+
+// 原图的回调函数
+void image_callback(const sensor_msgs::ImageConstPtr &image_msg)
+{
+    //ROS_INFO("image_callback!");
+    if(!LOOP_CLOSURE)   // 不检测回环，原图也没有意义
+        return;
+    ImageBuf image;
+    image.header = image_msg->header;
+    image.image = image_msg;
+    push_image(image);
+}
+
+// 压缩图像的回调函数，先不解码
+void compressed_image_callback(const sensor_msgs::CompressedImageConstPtr &image_msg)
+{
+    if(!LOOP_CLOSURE)
+        return;
+    ImageBuf image;
+    image.header = image_msg->header;
+    image.compressed = image_msg;
+    push_image(image);
 }
 
 // VIO中KF关于地图点的信息
@@ -322,9 +356,9 @@ void process()
 {
     if (!LOOP_CLOSURE)  // 不检测回环就啥都不干
         return;
-    while (true)
+    while (!shutdown_process)
     {
-        sensor_msgs::ImageConstPtr image_msg = NULL;
+        ImageBuf image_msg;
         sensor_msgs::PointCloudConstPtr point_msg = NULL;
         nav_msgs::Odometry::ConstPtr pose_msg = NULL;
 
@@ -334,19 +368,19 @@ void process()
         if(!image_buf.empty() && !point_buf.empty() && !pose_buf.empty())
         {
             // 原图时间戳比另外两个晚，只能扔掉早于第一个原图的消息
-            if (image_buf.front()->header.stamp.toSec() > pose_buf.front()->header.stamp.toSec())
+            if (image_buf.front().header.stamp.toSec() > pose_buf.front()->header.stamp.toSec())
             {
                 pose_buf.pop();
                 printf("throw pose at beginning\n");
             }
-            else if (image_buf.front()->header.stamp.toSec() > point_buf.front()->header.stamp.toSec())
+            else if (image_buf.front().header.stamp.toSec() > point_buf.front()->header.stamp.toSec())
             {
                 point_buf.pop();
                 printf("throw point at beginning\n");
             }
             // 上面确保了image_buf <= point_buf && image_buf <= pose_buf
             // 下面根据pose时间找时间戳同步的原图和地图点
-            else if (image_buf.back()->header.stamp.toSec() >= pose_buf.front()->header.stamp.toSec() 
+            else if (image_buf.back().header.stamp.toSec() >= pose_buf.front()->header.stamp.toSec() 
                 && point_buf.back()->header.stamp.toSec() >= pose_buf.front()->header.stamp.toSec())
             {
                 pose_msg = pose_buf.front();    // 取出来pose
@@ -354,7 +388,7 @@ void process()
                 while (!pose_buf.empty())   // ! 清空所有的pose，回环的帧率慢一些没关系，尽量让最新帧即时参与回环，防止"回环处理速率太慢，导致buf里的kf太老了"
                     pose_buf.pop();
                 // 找到对应pose的原图
-                while (image_buf.front()->header.stamp.toSec() < pose_msg->header.stamp.toSec())
+                while (image_buf.front().header.stamp.toSec() < pose_msg->header.stamp.toSec())
                     image_buf.pop();
                 image_msg = image_buf.front();
                 image_buf.pop();
@@ -371,7 +405,7 @@ void process()
         {
             //printf(" pose time %f \n", pose_msg->header.stamp.toSec());
             //printf(" point time %f \n", point_msg->header.stamp.toSec());
-            //printf(" image time %f \n", image_msg->header.stamp.toSec());
+            //printf(" image time %f \n", image_msg.header.stamp.toSec());
             // skip fisrt few
             if (skip_first_cnt < SKIP_FIRST_CNT)    // 跳过最开始的SKIP_FIRST_CNT帧
             {
@@ -389,23 +423,29 @@ void process()
                 skip_cnt = 0;
             }
             // 通过cvbridge得到opencv格式的图像
+            // 灰度图直接引用消息里的数据，只有真正建KF时KeyFrame里才会拷贝一份
+            cv::Mat image;
             cv_bridge::CvImageConstPtr ptr;
-            if (image_msg->encoding == "8UC1")
+            if (image_msg.compressed != NULL)
             {
-                sensor_msgs::Image img;
-                img.header = image_msg->header;
-                img.height = image_msg->height;
-                img.width = image_msg->width;
-                img.is_bigendian = image_msg->is_bigendian;
-                img.step = image_msg->step;
-                img.data = image_msg->data;
-                img.encoding = "mono8";
-                ptr = cv_bridge::toCvCopy(img, sensor_msgs::image_encodings::MONO8);
+                // 压缩图像直接解码成灰度图，缩小倍数和feature_tracker一致
+                TicToc t_d;
+                image = camodocal::decodeGray(*image_msg.compressed, DECODE_SCALE);
+                ROS_DEBUG("decode image costs: %fms", t_d.toc());
+                if (image.empty())
+                {
+                    ROS_WARN("fail to decode compressed image %f", image_msg.header.stamp.toSec());
+                    continue;
+                }
             }
             else
-                ptr = cv_bridge::toCvCopy(image_msg, sensor_msgs::image_encodings::MONO8);
-            
-            cv::Mat image = ptr->image;
+            {
+                if (image_msg.image->encoding == "8UC1" || image_msg.image->encoding == sensor_msgs::image_encodings::MONO8)
+                    ptr = cv_bridge::toCvShare(image_msg.image);
+                else
+                    ptr = cv_bridge::toCvCopy(image_msg.image, sensor_msgs::image_encodings::MONO8);
+                image = ptr->image;
+            }
             // build keyframe
             // 得到KF的位姿，转成eigen格式
             Vector3d T = Vector3d(pose_msg->pose.pose.position.x,
@@ -485,10 +525,13 @@ void command()
     }
 }
 
-int main(int argc, char **argv)
+/**
+ * @brief 读参数，加载词袋和地图，注册publisher和subscriber，启动处理线程，节点和nodelet共用
+ * 
+ * @param[in] n 节点的私有句柄
+ */
+void setupNode(ros::NodeHandle &n)
 {
-    ros::init(argc, argv, "pose_graph");
-    ros::NodeHandle n("~");
     posegraph.registerPub(n);
 
     // read param
@@ -523,13 +566,29 @@ int main(int argc, char **argv)
 
         BRIEF_PATTERN_FILE = pkg_path + "/../support_files/brief_pattern.yml";  // 计算描述子pattern的文件
         cout << "BRIEF_PATTERN_FILE" << BRIEF_PATTERN_FILE << endl;
-        // 和前面一样，生成一个相机模型
-        m_camera = camodocal::CameraFactory::instance()->generateCameraFromYamlFile(config_file.c_str());
 
         fsSettings["image_topic"] >> IMAGE_TOPIC;         // 原图的topic
         fsSettings["pose_graph_save_path"] >> POSE_GRAPH_SAVE_PATH;
         fsSettings["output_path"] >> VINS_RESULT_PATH;
         fsSettings["save_image"] >> DEBUG_IMAGE;
+        COMPRESSED_IMAGE = fsSettings["compressed_image"];   // 原图的topic是压缩图像
+        DECODE_SCALE = fsSettings["decode_scale"];
+        if (!COMPRESSED_IMAGE || (DECODE_SCALE != 2 && DECODE_SCALE != 4 && DECODE_SCALE != 8))
+            DECODE_SCALE = 1;
+        // 和前面一样，生成一个相机模型，缩小解码时分辨率和内参都换算到解码后的图像上，和feature_tracker一致
+        ROW = camodocal::decodedSize(ROW, DECODE_SCALE);
+        COL = camodocal::decodedSize(COL, DECODE_SCALE);
+        m_camera = camodocal::CameraFactory::instance()->generateCameraFromYamlFile(config_file.c_str());
+        if (DECODE_SCALE != 1)
+        {
+            m_camera = camodocal::CameraFactory::instance()->generateScaledCamera(m_camera, DECODE_SCALE);
+            if (!m_camera)
+            {
+                ROS_ERROR("decode_scale %d is not supported for the camera model in %s, set it to 1", DECODE_SCALE, config_file.c_str());
+                ROS_BREAK();
+            }
+        }
+        m_camera->initLiftTable();  // 预先建好去畸变查找表，computeBRIEFPoint中批量查表
 
         // create folder if not exists
         FileSystemHelper::createDirectoryIfNotExists(POSE_GRAPH_SAVE_PATH.c_str());
@@ -562,28 +621,61 @@ int main(int argc, char **argv)
 
     fsSettings.release();
 
-    ros::Subscriber sub_imu_forward = n.subscribe("/vins_estimator/imu_propagate", 2000, imu_forward_callback);
-    ros::Subscriber sub_vio = n.subscribe("/vins_estimator/odometry", 2000, vio_callback);
-    ros::Subscriber sub_image = n.subscribe(IMAGE_TOPIC, 2000, image_callback);
-    ros::Subscriber sub_pose = n.subscribe("/vins_estimator/keyframe_pose", 2000, pose_callback);
-    ros::Subscriber sub_extrinsic = n.subscribe("/vins_estimator/extrinsic", 2000, extrinsic_callback);
-    ros::Subscriber sub_point = n.subscribe("/vins_estimator/keyframe_point", 2000, point_callback);
-    ros::Subscriber sub_relo_relative_pose = n.subscribe("/vins_estimator/relo_relative_pose", 2000, relo_relative_pose_callback);
-
+    // publisher放在subscriber前面，nodelet里回调可能马上就开始执行
     pub_match_img = n.advertise<sensor_msgs::Image>("match_image", 1000);
     pub_camera_pose_visual = n.advertise<visualization_msgs::MarkerArray>("camera_pose_visual", 1000);
     pub_key_odometrys = n.advertise<visualization_msgs::Marker>("key_odometrys", 1000);
     pub_vio_path = n.advertise<nav_msgs::Path>("no_loop_path", 1000);
     pub_match_points = n.advertise<sensor_msgs::PointCloud>("match_points", 100);
 
-    std::thread measurement_process;
-    std::thread keyboard_command_process;
-
+    sub_imu_forward = n.subscribe("/vins_estimator/imu_propagate", 2000, imu_forward_callback);
+    sub_vio = n.subscribe("/vins_estimator/odometry", 2000, vio_callback);
+    if (COMPRESSED_IMAGE)
+        sub_image = n.subscribe(IMAGE_TOPIC, 2000, compressed_image_callback);
+    else
+        sub_image = n.subscribe(IMAGE_TOPIC, 2000, image_callback);
+    sub_pose = n.subscribe("/vins_estimator/keyframe_pose", 2000, pose_callback);
+    sub_extrinsic = n.subscribe("/vins_estimator/extrinsic", 2000, extrinsic_callback);
+    sub_point = n.subscribe("/vins_estimator/keyframe_point", 2000, point_callback);
+    sub_relo_relative_pose = n.subscribe("/vins_estimator/relo_relative_pose", 2000, relo_relative_pose_callback);
+
+    shutdown_process = false;
     measurement_process = std::thread(process);
-    keyboard_command_process = std::thread(command);
+    // nodelet和别的nodelet共用一个进程，没有自己的终端，不读键盘
+#ifndef BUILD_NODELET
+    // getchar()一直阻塞，没法join，随进程退出
+    std::thread keyboard_command_process(command);
+    keyboard_command_process.detach();
+#endif
+}
 
+/**
+ * @brief 停掉订阅并等回环检测线程退出，nodelet卸载时必须在析构前调用
+ */
+void shutdownNode()
+{
+    sub_imu_forward.shutdown();
+    sub_vio.shutdown();
+    sub_image.shutdown();
+    sub_pose.shutdown();
+    sub_extrinsic.shutdown();
+    sub_point.shutdown();
+    sub_relo_relative_pose.shutdown();
+    shutdown_process = true;
+    if (measurement_process.joinable())
+        measurement_process.join();
+}
+
+#ifndef BUILD_NODELET
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, "pose_graph");
+    ros::NodeHandle n("~");
+    setupNode(n);
 
     ros::spin();
+    shutdownNode();
 
     return 0;
 }
+#endif
@@ -0,0 +1,27 @@
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+void setupNode(ros::NodeHandle &n);
+void shutdownNode();
+
+namespace pose_graph
+{
+// 和pose_graph节点是同一份代码，回环检测线程在setupNode里启动，nodelet不起键盘线程
+class PoseGraphNodelet : public nodelet::Nodelet
+{
+  public:
+    // 回环检测线程用的是这个库里的全局状态，卸载前要等它退出
+    virtual ~PoseGraphNodelet()
+    {
+        shutdownNode();
+    }
+
+  private:
+    virtual void onInit()
+    {
+        setupNode(getPrivateNodeHandle());
+    }
+};
+}
+
+PLUGINLIB_EXPORT_CLASS(pose_graph::PoseGraphNodelet, nodelet::Nodelet)
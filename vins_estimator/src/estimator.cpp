@@ -1,16 +1,32 @@
 #include "estimator.h"
 
-Estimator::Estimator(): f_manager{Rs}
+template <int WINDOW_SIZE>
+Estimator<WINDOW_SIZE>::Estimator(): EstimatorBase(WINDOW_SIZE), pre_integrations{}, f_manager{Rs}, initial_ex_rotation(WINDOW_SIZE),
+    problem(nullptr), loss_function(new ceres::CauchyLoss(1.0)), last_marginalization_info(nullptr), tmp_pre_integration(nullptr)
 {
     ROS_INFO("init begins");
     clearState();
 }
 
+template <int WINDOW_SIZE>
+Estimator<WINDOW_SIZE>::~Estimator()
+{
+    for (int i = 0; i < WINDOW_SIZE + 1; i++)
+        delete pre_integrations[i];
+    for (auto &it : all_image_frame)
+        delete it.second.pre_integration;
+    delete tmp_pre_integration;
+    delete last_marginalization_info;
+    delete problem;
+    delete loss_function;
+}
+
 /**
  * @brief 外参，重投影置信度，延时设置
  * 
  */
-void Estimator::setParameter()
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::setParameter()
 {
     for (int i = 0; i < NUM_OF_CAM; i++)
     {
@@ -21,11 +37,13 @@ void Estimator::setParameter()
     // 这里可以看到虚拟相机的用法，1.5个像素误差，给了个重投影误差的准确度
     ProjectionFactor::sqrt_info = FOCAL_LENGTH / 1.5 * Matrix2d::Identity();
     ProjectionTdFactor::sqrt_info = FOCAL_LENGTH / 1.5 * Matrix2d::Identity();
+    ProjectionGroupFactor::sqrt_info = FOCAL_LENGTH / 1.5 * Matrix2d::Identity();
     td = TD;
 }
 
 // 所有状态全部重置
-void Estimator::clearState()
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::clearState()
 {
     for (int i = 0; i < WINDOW_SIZE + 1; i++)
     {
@@ -34,9 +52,6 @@ void Estimator::clearState()
         Vs[i].setZero();
         Bas[i].setZero();
         Bgs[i].setZero();
-        dt_buf[i].clear();
-        linear_acceleration_buf[i].clear();
-        angular_velocity_buf[i].clear();
 
         if (pre_integrations[i] != nullptr)
             delete pre_integrations[i];
@@ -75,13 +90,17 @@ void Estimator::clearState()
         delete last_marginalization_info;
 
     tmp_pre_integration = nullptr;
+    imu_buffer.clear();     // 预积分都删完了才能清
     last_marginalization_info = nullptr;
     last_marginalization_parameter_blocks.clear();
 
     f_manager.clearState();
+    resetProblem();
 
     failure_occur = 0;
     relocalization_info = 0;
+    t_pre_marginalization = 0;
+    t_marginalization = 0;
 
     drift_correct_r = Matrix3d::Identity();
     drift_correct_t = Vector3d::Zero();
@@ -94,7 +113,8 @@ void Estimator::clearState()
  * @param[in] linear_acceleration 
  * @param[in] angular_velocity 
  */
-void Estimator::processIMU(double dt, const Vector3d &linear_acceleration, const Vector3d &angular_velocity)
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::processIMU(double dt, const Vector3d &linear_acceleration, const Vector3d &angular_velocity, int count)
 {
     if (!first_imu)
     {
@@ -102,26 +122,29 @@ void Estimator::processIMU(double dt, const Vector3d &linear_acceleration, const
         acc_0 = linear_acceleration;
         gyr_0 = angular_velocity;
     }
+    // 预平均后的采样代表整段的平均值，段内按常值积分
+    if (IMU_AVERAGE_RATE > 0)
+    {
+        acc_0 = linear_acceleration;
+        gyr_0 = angular_velocity;
+    }
     
     // ! 滑窗中保留11帧，维护11个预积分量，frame_count表示现在处理第几帧(每两帧之间有一个预积分对象)，一般处理到第11帧时就保持不变了
     // ! 由于预积分是帧间约束，因此第1个预积分量实际上是用不到的
     if (!pre_integrations[frame_count])  // 没有预积分头则创建
     {
-        pre_integrations[frame_count] = new IntegrationBase{acc_0, gyr_0, Bas[frame_count], Bgs[frame_count]};
+        pre_integrations[frame_count] = new IntegrationBase{acc_0, gyr_0, Bas[frame_count], Bgs[frame_count], &imu_buffer};
     }
     // ! 只有大于0才处理，也就是说第一帧不处理，因为第一帧imu在最开头，并未产生图像帧间约束
     if (frame_count != 0)   // ! frame_count 后续会有+1，在processImage()中
     {
-        pre_integrations[frame_count]->push_back(dt, linear_acceleration, angular_velocity);
+        // 采样只存进imu_buffer一次，两个预积分都只是把区间往后延长
+        long end = imu_buffer.push(dt, linear_acceleration, angular_velocity, count) + 1;
+        pre_integrations[frame_count]->extend(end);
         //if(solver_flag != NON_LINEAR)
 
             // !  这个量用来做初始化用的
-            tmp_pre_integration->push_back(dt, linear_acceleration, angular_velocity);   // 它存储了更多imu数据
-
-        // 这次直接存储了imu加速度、加速度和时间，之前我们只是单纯地存储了imu的原始信息sensor_msg
-        dt_buf[frame_count].push_back(dt);
-        linear_acceleration_buf[frame_count].push_back(linear_acceleration);
-        angular_velocity_buf[frame_count].push_back(angular_velocity);
+            tmp_pre_integration->extend(end);   // 它覆盖了非kf之间的imu数据
 		
         // ? 又是一个中值积分，更新滑窗中状态量，本质是给非线性优化提供可信的初始值？到底什么用？processImage()中初始化用的，因为VIOI初始化用到所有帧image，包括kf和非kf
         // ? 因为滑窗内每个Image不一定都是kf，这就意味着是kf的image之间要重新预积分来更新，但是非kf之间的预积分量就丢失了，tmp_pre_integration只是用来事先填充每一帧(包括非kf)image之间的预积分
@@ -139,7 +162,8 @@ void Estimator::processIMU(double dt, const Vector3d &linear_acceleration, const
 }
 
 // 一是负责滑窗管理；二是负责vio初始化；三是这个接口比processImu()更重要
-void Estimator::processImage(const map<int, vector<pair<int, Eigen::Matrix<double, 7, 1>>>> &image, const std_msgs::Header &header)
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::processImage(const ImageFeatures &image, const std_msgs::Header &header)
 {
     ROS_DEBUG("new image coming ------------------------------------------");
     ROS_DEBUG("Adding feature points %lu", image.size());
@@ -164,7 +188,7 @@ void Estimator::processImage(const map<int, vector<pair<int, Eigen::Matrix<doubl
     // 这里就是简单的把图像和预积分绑定在一起，这里预积分就是两帧之间的，滑窗中实际上是两个KF之间的
     // 实际上是准备用来初始化的相关数据
     all_image_frame.insert(make_pair(header.stamp.toSec(), imageframe));
-    tmp_pre_integration = new IntegrationBase{acc_0, gyr_0, Bas[frame_count], Bgs[frame_count]};  // 预积分重新复位，覆盖信息
+    tmp_pre_integration = new IntegrationBase{acc_0, gyr_0, Bas[frame_count], Bgs[frame_count], &imu_buffer};  // 预积分重新复位，覆盖信息
 
     // 没有外参初值
     // Step 2： 外参初始化
@@ -263,7 +287,8 @@ void Estimator::processImage(const map<int, vector<pair<int, Eigen::Matrix<doubl
  * @return true 
  * @return false 
  */
-bool Estimator::initialStructure()
+template <int WINDOW_SIZE>
+bool Estimator<WINDOW_SIZE>::initialStructure()
 {
     TicToc t_sfm;
     // Step 1 check imu observibility
@@ -379,22 +404,18 @@ bool Estimator::initialStructure()
         vector<cv::Point3f> pts_3_vector;
         vector<cv::Point2f> pts_2_vector;
         // 遍历这一帧对应的特征点
-        for (auto &id_pts : frame_it->second.points)
+        // 由于是单目，每个特征点只有一个观测
+        for (auto &i_p : frame_it->second.points)
         {
-            int feature_id = id_pts.first;
-            // 由于是单目，这里id_pts.second大小就是1
-            for (auto &i_p : id_pts.second)
+            it = sfm_tracked_points.find(i_p.feature_id);
+            if(it != sfm_tracked_points.end())  // 有对应的三角化出来的3d点
             {
-                it = sfm_tracked_points.find(feature_id);
-                if(it != sfm_tracked_points.end())  // 有对应的三角化出来的3d点
-                {
-                    Vector3d world_pts = it->second;    // 地图点的世界坐标
-                    cv::Point3f pts_3(world_pts(0), world_pts(1), world_pts(2));
-                    pts_3_vector.push_back(pts_3);
-                    Vector2d img_pts = i_p.second.head<2>();
-                    cv::Point2f pts_2(img_pts(0), img_pts(1));
-                    pts_2_vector.push_back(pts_2);
-                }
+                Vector3d world_pts = it->second;    // 地图点的世界坐标
+                cv::Point3f pts_3(world_pts(0), world_pts(1), world_pts(2));
+                pts_3_vector.push_back(pts_3);
+                Vector2d img_pts = i_p.xyz_uv_velocity.head<2>();
+                cv::Point2f pts_2(img_pts(0), img_pts(1));
+                pts_2_vector.push_back(pts_2);
             }
         }
         cv::Mat K = (cv::Mat_<double>(3, 3) << 1, 0, 0, 0, 1, 0, 0, 0, 1);     
@@ -436,12 +457,13 @@ bool Estimator::initialStructure()
 
 }
 
-bool Estimator::visualInitialAlign()
+template <int WINDOW_SIZE>
+bool Estimator<WINDOW_SIZE>::visualInitialAlign()
 {
     TicToc t_g;
     VectorXd x;
     //solve scale
-    bool result = VisualIMUAlignment(all_image_frame, Bgs, g, x);
+    bool result = VisualIMUAlignment(all_image_frame, Bgs, WINDOW_SIZE, g, x);
     if(!result)
     {
         ROS_DEBUG("solve g failed!");
@@ -533,7 +555,8 @@ bool Estimator::visualInitialAlign()
  * @return false 
  */
 
-bool Estimator::relativePose(Matrix3d &relative_R, Vector3d &relative_T, int &l)
+template <int WINDOW_SIZE>
+bool Estimator<WINDOW_SIZE>::relativePose(Matrix3d &relative_R, Vector3d &relative_T, int &l)
 {
     // find previous frame which contians enough correspondance and parallex with newest frame
     // 优先从最前面开始
@@ -569,7 +592,8 @@ bool Estimator::relativePose(Matrix3d &relative_R, Vector3d &relative_T, int &l)
     return false;
 }
 
-void Estimator::solveOdometry()
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::solveOdometry()
 {
     // 保证滑窗中帧数满了
     if (frame_count < WINDOW_SIZE)
@@ -589,31 +613,34 @@ void Estimator::solveOdometry()
  * @brief 由于ceres的参数块都是double数组，因此这里把参数块从eigen的表示转成double数组
  * 
  */
-void Estimator::vector2double()
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::vector2double()
 {
     // KF的位姿
     for (int i = 0; i <= WINDOW_SIZE; i++)
     {
-        para_Pose[i][0] = Ps[i].x();
-        para_Pose[i][1] = Ps[i].y();
-        para_Pose[i][2] = Ps[i].z();
+        double *pose = paraPose(i);
+        pose[0] = Ps[i].x();
+        pose[1] = Ps[i].y();
+        pose[2] = Ps[i].z();
         Quaterniond q{Rs[i]};
-        para_Pose[i][3] = q.x();
-        para_Pose[i][4] = q.y();
-        para_Pose[i][5] = q.z();
-        para_Pose[i][6] = q.w();
-
-        para_SpeedBias[i][0] = Vs[i].x();
-        para_SpeedBias[i][1] = Vs[i].y();
-        para_SpeedBias[i][2] = Vs[i].z();
-
-        para_SpeedBias[i][3] = Bas[i].x();
-        para_SpeedBias[i][4] = Bas[i].y();
-        para_SpeedBias[i][5] = Bas[i].z();
-
-        para_SpeedBias[i][6] = Bgs[i].x();
-        para_SpeedBias[i][7] = Bgs[i].y();
-        para_SpeedBias[i][8] = Bgs[i].z();
+        pose[3] = q.x();
+        pose[4] = q.y();
+        pose[5] = q.z();
+        pose[6] = q.w();
+
+        double *speed_bias = paraSpeedBias(i);
+        speed_bias[0] = Vs[i].x();
+        speed_bias[1] = Vs[i].y();
+        speed_bias[2] = Vs[i].z();
+
+        speed_bias[3] = Bas[i].x();
+        speed_bias[4] = Bas[i].y();
+        speed_bias[5] = Bas[i].z();
+
+        speed_bias[6] = Bgs[i].x();
+        speed_bias[7] = Bgs[i].y();
+        speed_bias[8] = Bgs[i].z();
     }
     // 外参
     for (int i = 0; i < NUM_OF_CAM; i++)
@@ -627,10 +654,13 @@ void Estimator::vector2double()
         para_Ex_Pose[i][5] = q.z();
         para_Ex_Pose[i][6] = q.w();
     }
-    // 特征点逆深度
-    VectorXd dep = f_manager.getDepthVector();
-    for (int i = 0; i < f_manager.getFeatureCount(); i++)
-        para_Feature[i][0] = dep(i);
+    // 特征点逆深度，每个地图点在para_Feature里的位置由updateProblem()分配
+    for (auto &it_per_id : f_manager.feature)
+    {
+        auto it = feature_blocks.find(it_per_id.feature_id);
+        if (it != feature_blocks.end())
+            para_Feature[it->second.para_index][0] = 1. / it_per_id.estimated_depth;
+    }
     // 传感器时间同步
     if (ESTIMATE_TD)
         para_Td[0][0] = td;
@@ -640,7 +670,8 @@ void Estimator::vector2double()
  * @brief double -> eigen 同时fix第一帧的yaw和平移，固定了四自由度的零空间
  * 
  */
-void Estimator::double2vector()
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::double2vector()
 {
     // 取出优化前的第一帧的位姿
     Vector3d origin_R0 = Utility::R2ypr(Rs[0]);
@@ -653,10 +684,11 @@ void Estimator::double2vector()
         failure_occur = 0;
     }
     // 优化后的第一帧的位姿
-    Vector3d origin_R00 = Utility::R2ypr(Quaterniond(para_Pose[0][6],
-                                                      para_Pose[0][3],
-                                                      para_Pose[0][4],
-                                                      para_Pose[0][5]).toRotationMatrix());
+    const double *pose_0 = paraPose(0);
+    Vector3d origin_R00 = Utility::R2ypr(Quaterniond(pose_0[6],
+                                                      pose_0[3],
+                                                      pose_0[4],
+                                                      pose_0[5]).toRotationMatrix());
     // yaw角差
     double y_diff = origin_R0.x() - origin_R00.x();
     //TODO
@@ -665,32 +697,34 @@ void Estimator::double2vector()
     if (abs(abs(origin_R0.y()) - 90) < 1.0 || abs(abs(origin_R00.y()) - 90) < 1.0)
     {
         ROS_DEBUG("euler singular point!");
-        rot_diff = Rs[0] * Quaterniond(para_Pose[0][6],
-                                       para_Pose[0][3],
-                                       para_Pose[0][4],
-                                       para_Pose[0][5]).toRotationMatrix().transpose();
+        rot_diff = Rs[0] * Quaterniond(pose_0[6],
+                                       pose_0[3],
+                                       pose_0[4],
+                                       pose_0[5]).toRotationMatrix().transpose();
     }
 
     for (int i = 0; i <= WINDOW_SIZE; i++)
     {
+        const double *pose = paraPose(i);
+        const double *speed_bias = paraSpeedBias(i);
         // 保持第1帧的yaw不变
-        Rs[i] = rot_diff * Quaterniond(para_Pose[i][6], para_Pose[i][3], para_Pose[i][4], para_Pose[i][5]).normalized().toRotationMatrix();
+        Rs[i] = rot_diff * Quaterniond(pose[6], pose[3], pose[4], pose[5]).normalized().toRotationMatrix();
         // 保持第1帧的位移不变
-        Ps[i] = rot_diff * Vector3d(para_Pose[i][0] - para_Pose[0][0],
-                                para_Pose[i][1] - para_Pose[0][1],
-                                para_Pose[i][2] - para_Pose[0][2]) + origin_P0;
+        Ps[i] = rot_diff * Vector3d(pose[0] - pose_0[0],
+                                pose[1] - pose_0[1],
+                                pose[2] - pose_0[2]) + origin_P0;
 
-        Vs[i] = rot_diff * Vector3d(para_SpeedBias[i][0],
-                                    para_SpeedBias[i][1],
-                                    para_SpeedBias[i][2]);
+        Vs[i] = rot_diff * Vector3d(speed_bias[0],
+                                    speed_bias[1],
+                                    speed_bias[2]);
 
-        Bas[i] = Vector3d(para_SpeedBias[i][3],
-                          para_SpeedBias[i][4],
-                          para_SpeedBias[i][5]);
+        Bas[i] = Vector3d(speed_bias[3],
+                          speed_bias[4],
+                          speed_bias[5]);
 
-        Bgs[i] = Vector3d(para_SpeedBias[i][6],
-                          para_SpeedBias[i][7],
-                          para_SpeedBias[i][8]);
+        Bgs[i] = Vector3d(speed_bias[6],
+                          speed_bias[7],
+                          speed_bias[8]);
     }
 
     for (int i = 0; i < NUM_OF_CAM; i++)
@@ -704,10 +738,14 @@ void Estimator::double2vector()
                              para_Ex_Pose[i][5]).toRotationMatrix();
     }
     // 重新设置各个特征点的逆深度
-    VectorXd dep = f_manager.getDepthVector();
-    for (int i = 0; i < f_manager.getFeatureCount(); i++)
-        dep(i) = para_Feature[i][0];
-    f_manager.setDepth(dep);
+    for (auto &it_per_id : f_manager.feature)
+    {
+        auto it = feature_blocks.find(it_per_id.feature_id);
+        if (it == feature_blocks.end())
+            continue;
+        it_per_id.estimated_depth = 1.0 / para_Feature[it->second.para_index][0];
+        it_per_id.solve_flag = it_per_id.estimated_depth < 0 ? 2 : 1;
+    }
     if (ESTIMATE_TD)
         td = para_Td[0][0];
 
@@ -717,9 +755,9 @@ void Estimator::double2vector()
         Matrix3d relo_r;
         Vector3d relo_t;
         relo_r = rot_diff * Quaterniond(relo_Pose[6], relo_Pose[3], relo_Pose[4], relo_Pose[5]).normalized().toRotationMatrix();
-        relo_t = rot_diff * Vector3d(relo_Pose[0] - para_Pose[0][0],
-                                     relo_Pose[1] - para_Pose[0][1],
-                                     relo_Pose[2] - para_Pose[0][2]) + origin_P0;
+        relo_t = rot_diff * Vector3d(relo_Pose[0] - pose_0[0],
+                                     relo_Pose[1] - pose_0[1],
+                                     relo_Pose[2] - pose_0[2]) + origin_P0;
         double drift_correct_yaw;
         drift_correct_yaw = Utility::R2ypr(prev_relo_r).x() - Utility::R2ypr(relo_r).x();
         drift_correct_r = Utility::ypr2R(Vector3d(drift_correct_yaw, 0, 0));
@@ -736,7 +774,8 @@ void Estimator::double2vector()
     }
 }
 
-bool Estimator::failureDetection()
+template <int WINDOW_SIZE>
+bool Estimator<WINDOW_SIZE>::failureDetection()
 {
     if (f_manager.last_track_num < 2)   // 地图点数目是否足够
     {
@@ -785,74 +824,178 @@ bool Estimator::failureDetection()
 }
 
 /**
- * @brief 进行非线性优化
+ * @brief 重建一个空的ceres problem，参数块地址和滑窗帧一一对应
  * 
  */
-void Estimator::optimization()
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::resetProblem()
 {
-    // 借助ceres进行非线性优化
-    ceres::Problem problem;
-    ceres::LossFunction *loss_function;
-    //loss_function = new ceres::HuberLoss(1.0);
-    loss_function = new ceres::CauchyLoss(1.0);   // 柯西核
-    // Step 1 仅仅定义待优化的参数块，类似g2o的顶点
-    // > 参数块 1： 滑窗中位姿包括位置和姿态，共11帧
+    if (problem != nullptr)
+        delete problem;
+    // 局部参数化和核函数是estimator自己的，所有参数块和残差块共用；残差块由problem负责释放
+    ceres::Problem::Options problem_options;
+    problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    problem_options.local_parameterization_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    problem_options.enable_fast_removal = true;
+    problem = new ceres::Problem(problem_options);
+
     for (int i = 0; i < WINDOW_SIZE + 1; i++)
     {
-        // 由于姿态不满足正常的加法，也就是李群上没有加法，因此需要自己定义他的加法
-        ceres::LocalParameterization *local_parameterization = new PoseLocalParameterization();   // virtual虚函数重载
-        problem.AddParameterBlock(para_Pose[i], SIZE_POSE, local_parameterization);   // ! P、Q  11x7的Values，一个滑窗内有10帧，现在优化的是11帧；para_Pose是double是数组，那么para_Pose[i]是指针
-        problem.AddParameterBlock(para_SpeedBias[i], SIZE_SPEEDBIAS);  // ! V、Bias  11x9的Values
+        para_slot[i] = i;
+        imu_residual[i] = nullptr;
+        imu_pose_i[i] = nullptr;
+        problem->AddParameterBlock(para_Pose[i], SIZE_POSE, &pose_local_parameterization);
+        problem->AddParameterBlock(para_SpeedBias[i], SIZE_SPEEDBIAS);
+    }
+    for (int i = 0; i < NUM_OF_CAM; i++)
+        problem->AddParameterBlock(para_Ex_Pose[i], SIZE_POSE, &pose_local_parameterization);
+    prior_residual = nullptr;
+
+    feature_blocks.clear();
+    if (para_Feature.empty())
+        para_Feature.resize(NUM_OF_F);
+    int num_feature = para_Feature.size();
+    free_feature_index.resize(num_feature);
+    for (int i = 0; i < num_feature; i++)
+        free_feature_index[i] = num_feature - 1 - i;
+}
+
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::removeFeatureResiduals(FeatureBlocks &blocks)
+{
+    if (blocks.residual)
+        problem->RemoveResidualBlock(blocks.residual);
+    blocks.residual = nullptr;
+    blocks.frames.clear();
+    blocks.anchor = nullptr;
+}
+
+/**
+ * @brief 滑窗前调用，删掉和即将移出的帧（para_Pose第slot行）相连的imu和重投影残差
+ * 
+ * 先验残差在边缘化时已经替换过了，不在这里处理
+ */
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::removeFrameBlocks(int slot)
+{
+    double *pose = para_Pose[slot];
+    for (int i = 0; i <= WINDOW_SIZE; i++)
+    {
+        if (imu_residual[i] && (i == slot || imu_pose_i[i] == pose))
+        {
+            problem->RemoveResidualBlock(imu_residual[i]);
+            imu_residual[i] = nullptr;
+            imu_pose_i[i] = nullptr;
+        }
+    }
+    for (auto &it : feature_blocks)
+    {
+        FeatureBlocks &blocks = it.second;
+        // 起始帧被移出时逆深度要换到新的起始帧上，观测帧被移出时少一个观测，残差块都要重建
+        if (blocks.anchor == pose || std::find(blocks.frames.begin(), blocks.frames.end(), pose) != blocks.frames.end())
+            removeFeatureResiduals(blocks);
+    }
+}
+
+/**
+ * @brief 用新的边缘化结果替换problem里的先验残差
+ * 
+ */
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::setPrior(MarginalizationInfo *marginalization_info, const vector<double *> &parameter_blocks)
+{
+    // 特征值阈值把所有方向都去掉了（rank为0），新的先验不含任何信息，ceres也不接受0维的残差块，不用它
+    if (marginalization_info->linearized_residuals.size() == 0)
+    {
+        ROS_WARN("marginalization prior has rank 0, skip it");
+        delete marginalization_info;
+        // 上一次的先验不连被边缘化的参数块时原样保留；
+        // 连着的话它的参数块要被移出滑窗，只能丢掉，舒尔补是单调的，合起来的秩为0说明它对留下的状态也没有信息
+        bool keep_last = last_marginalization_info != nullptr;
+        for (double *block : last_marginalization_parameter_blocks)
+            if (std::find(parameter_blocks.begin(), parameter_blocks.end(), block) == parameter_blocks.end())
+                keep_last = false;
+        if (keep_last)
+            return;
+        marginalization_info = nullptr;
+    }
+    vector<double *> prior_blocks = marginalization_info ? parameter_blocks : vector<double *>();
+    if (prior_residual)
+    {
+        problem->RemoveResidualBlock(prior_residual);
+        prior_residual = nullptr;
     }
-    // > 参数块 2： 相机imu间的外参
+    if (last_marginalization_info)
+        delete last_marginalization_info;
+    last_marginalization_info = marginalization_info;   // 本次边缘化的所有信息
+    last_marginalization_parameter_blocks = prior_blocks;   // 代表该次边缘化对某些参数块形成约束，这些参数块在滑窗之后的地址
+}
+
+/**
+ * @brief 把problem补齐到当前滑窗：只添加还不存在的残差，删掉已经失效的地图点
+ * 
+ */
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::updateProblem()
+{
+    // > 参数块：外参是否固定可能在运行中改变（外参标定完成），Td第一次用到时再加
     for (int i = 0; i < NUM_OF_CAM; i++)
     {
-        ceres::LocalParameterization *local_parameterization = new PoseLocalParameterization();
-        problem.AddParameterBlock(para_Ex_Pose[i], SIZE_POSE, local_parameterization);   // ! P、Q  1x7
         if (!ESTIMATE_EXTRINSIC)
         {
             ROS_DEBUG("fix extinsic param");
             // 如果不需要优化外参就设置为fix
-            problem.SetParameterBlockConstant(para_Ex_Pose[i]);
+            problem->SetParameterBlockConstant(para_Ex_Pose[i]);
         }
         else
+        {
             ROS_DEBUG("estimate extinsic param");
+            problem->SetParameterBlockVariable(para_Ex_Pose[i]);
+        }
     }
-    // >参数块3：传感器延时Td
-    if (ESTIMATE_TD)
-    {
-        problem.AddParameterBlock(para_Td[0], 1);  // ! Td  1x1
-        //problem.SetParameterBlockConstant(para_Td[0]);
-    }
-    // 实际上还有地图点，其实平凡的参数块不需要调用AddParameterBlock，增加残差块接口时会自动绑定
-    TicToc t_whole, t_prepare;
-    // ! eigen -> double，参数块都是Eigen格式的，但是在优化过程中使用的是double类型的数组
-    vector2double();  // ! 这里直接将顶点Values直接赋值了，因为AddParameterBlock是指针传递
+    if (ESTIMATE_TD && !problem->HasParameterBlock(para_Td[0]))
+        problem->AddParameterBlock(para_Td[0], 1);  // ! Td  1x1
 
-    // Step 2 通过残差约束来添加残差块，类似g2o的边
-    // > 约束1：上一次的边缘化结果作为这一次的先验
-    if (last_marginalization_info)
+    // > 约束1：上一次的边缘化结果作为这一次的先验，边缘化之后才会变
+    if (last_marginalization_info && !prior_residual)
     {
         // construct new marginlization_factor
         MarginalizationFactor *marginalization_factor = new MarginalizationFactor(last_marginalization_info);
-        problem.AddResidualBlock(marginalization_factor, NULL,
-                                 last_marginalization_parameter_blocks);
+        prior_residual = problem->AddResidualBlock(marginalization_factor, NULL,
+                                                   last_marginalization_parameter_blocks);
     }
 
-    //  > 约束2：imu预积分的约束相邻两帧的PVQ和Bias
+    //  > 约束2：imu预积分的约束相邻两帧的PVQ和Bias，按后一帧的行号检查是否已经加过
     for (int i = 0; i < WINDOW_SIZE; i++)
     {
         int j = i + 1;
+        int slot = para_slot[j];
+        // 次新帧被移出后预积分会合并，前一帧也可能变了
+        if (imu_residual[slot] && imu_pose_i[slot] != paraPose(i))
+        {
+            problem->RemoveResidualBlock(imu_residual[slot]);
+            imu_residual[slot] = nullptr;
+        }
         // 时间过长这个约束就不可信了，就不添加此次约束
         if (pre_integrations[j]->sum_dt > 10.0)
+        {
+            if (imu_residual[slot])
+                problem->RemoveResidualBlock(imu_residual[slot]);
+            imu_residual[slot] = nullptr;
+            continue;
+        }
+        pre_integrations[j]->updateSqrtInfo();  // ceres多线程求值前把信息矩阵缓存好
+        if (imu_residual[slot])
             continue;
         IMUFactor* imu_factor = new IMUFactor(pre_integrations[j]);
-        problem.AddResidualBlock(imu_factor, NULL, para_Pose[i], para_SpeedBias[i], para_Pose[j], para_SpeedBias[j]);  // ceres::CostFunction的重载是解析求导的关键
+        imu_residual[slot] = problem->AddResidualBlock(imu_factor, NULL, paraPose(i), paraSpeedBias(i), paraPose(j), paraSpeedBias(j));  // ceres::CostFunction的重载是解析求导的关键
+        imu_pose_i[slot] = paraPose(i);
     }
 
     //  > 约束3：视觉重投影的约束两个共视帧的PQ、外参和逆深度
-    int f_m_cnt = 0;
-    int feature_index = -1;  // 自设feature索引
+    int f_m_cnt = 0, f_m_new = 0;
+    for (auto &it : feature_blocks)
+        it.second.alive = false;
     // 遍历每一个特征点
     for (auto &it_per_id : f_manager.feature)
     {
@@ -860,67 +1003,203 @@ void Estimator::optimization()
         // 进行特征点有效性的检查，主要检查至少被滑窗内的两帧看到
         if (!(it_per_id.used_num >= 2 && it_per_id.start_frame < WINDOW_SIZE - 2))
             continue;
- 
-        ++feature_index;
+
+        auto it = feature_blocks.find(it_per_id.feature_id);
+        if (it == feature_blocks.end())
+        {
+            if (free_feature_index.empty())
+            {
+                // 逆深度数组扩充一段，已经在problem里的参数块地址不变
+                int num_feature = para_Feature.size();
+                para_Feature.resize(num_feature + NUM_OF_F);
+                for (int i = num_feature + NUM_OF_F - 1; i >= num_feature; i--)
+                    free_feature_index.push_back(i);
+                ROS_DEBUG("grow inverse depth blocks to %d", num_feature + NUM_OF_F);
+            }
+            FeatureBlocks blocks;
+            blocks.para_index = free_feature_index.back();
+            blocks.anchor = nullptr;
+            blocks.residual = nullptr;
+            free_feature_index.pop_back();
+            problem->AddParameterBlock(paraFeature(blocks.para_index), SIZE_FEATURE);
+            it = feature_blocks.emplace(it_per_id.feature_id, blocks).first;
+        }
+        FeatureBlocks &blocks = it->second;
+        blocks.alive = true;
+        double *para_feature = paraFeature(blocks.para_index);
+
         // 第一个观测到这个特征点的帧idx，imu_i 没有任何关于imu的含义只是索引而已 
         int imu_i = it_per_id.start_frame, imu_j = imu_i - 1;
-        // 特征点在第一个帧下的归一化相机系坐标
-        Vector3d pts_i = it_per_id.feature_per_frame[0].point;
-        // ! 遍历看到这个特征点的所有KF
+        // 其他观测帧的位姿参数块，和已有残差块连接的完全一样就不用重建
+        vector<double *> frames;
+        for (int k = 1; k < (int)it_per_id.feature_per_frame.size(); k++)
+            frames.push_back(paraPose(imu_i + k));
+        f_m_cnt += frames.size();
+        if (blocks.residual && blocks.anchor == paraPose(imu_i) && blocks.frames == frames)
+            continue;
+        removeFeatureResiduals(blocks);
+        blocks.anchor = paraPose(imu_i);
+        blocks.frames = frames;
+
+        // ! 一个地图点的所有观测放进一个残差块，约束起始帧、其他观测帧的位姿，加上外参和特征点逆深度
+        // 核函数在因子里按观测单独作用，这里不再给ceres
+        const FeaturePerFrame &first = it_per_id.feature_per_frame[0];
+        ProjectionGroupFactor *f = new ProjectionGroupFactor(first.point, first.velocity, first.cur_td, first.uv.y(), ESTIMATE_TD, loss_function);
+        vector<double *> parameter_blocks{blocks.anchor, para_Ex_Pose[0], para_feature};
+        if (ESTIMATE_TD)
+            parameter_blocks.push_back(para_Td[0]);
+        // 遍历看到这个特征点的其他KF
         for (auto &it_per_frame : it_per_id.feature_per_frame)
         {
             imu_j++;
             if (imu_i == imu_j) // 自己跟自己不能形成重投影
-            {
                 continue;
-            }
-            // 取出另一帧的归一化相机坐标
-            Vector3d pts_j = it_per_frame.point;
-            // 带有时间延时的是另一种形式
-            if (ESTIMATE_TD)
-            {
-                    ProjectionTdFactor *f_td = new ProjectionTdFactor(pts_i, pts_j, it_per_id.feature_per_frame[0].velocity, it_per_frame.velocity,
-                                                                     it_per_id.feature_per_frame[0].cur_td, it_per_frame.cur_td,
-                                                                     it_per_id.feature_per_frame[0].uv.y(), it_per_frame.uv.y());
-                    problem.AddResidualBlock(f_td, loss_function, para_Pose[imu_i], para_Pose[imu_j], para_Ex_Pose[0], para_Feature[feature_index], para_Td[0]);
-                    /*
-                    double **para = new double *[5];
-                    para[0] = para_Pose[imu_i];
-                    para[1] = para_Pose[imu_j];
-                    para[2] = para_Ex_Pose[0];
-                    para[3] = para_Feature[feature_index];
-                    para[4] = para_Td[0];
-                    f_td->check(para);
-                    */
-            }
-            else
+            f->addObservation(it_per_frame.point, it_per_frame.velocity, it_per_frame.cur_td, it_per_frame.uv.y());
+            parameter_blocks.push_back(paraPose(imu_j));
+        }
+        blocks.residual = problem->AddResidualBlock(f, NULL, parameter_blocks);
+        f_m_new++;
+    }
+    // 已经不在滑窗里（或者不再满足条件）的地图点整个移出problem，逆深度的位置回收
+    for (auto it = feature_blocks.begin(); it != feature_blocks.end();)
+    {
+        if (it->second.alive)
+        {
+            ++it;
+            continue;
+        }
+        // 删参数块时相连的残差块一起删掉
+        problem->RemoveParameterBlock(paraFeature(it->second.para_index));
+        free_feature_index.push_back(it->second.para_index);
+        it = feature_blocks.erase(it);
+    }
+
+    ROS_DEBUG("visual measurement count: %d, rebuilt feature blocks: %d", f_m_cnt, f_m_new);
+}
+
+/**
+ * @brief 求解problem，用ceres或者滑窗专用的LM（window_solver）
+ * 
+ * window_solver为2时两个从同一个初值各解一次，打印代价、耗时和结果的差异，最后保留ceres的结果
+ * 
+ * @param[in] max_time 最大求解时间(s)
+ */
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::solveProblem(double max_time)
+{
+    WindowSolver::Summary window_summary;
+    bool window_solved = false;
+    vector<double *> parameter_blocks;
+    vector<double> initial_state, window_state;
+    if (WINDOW_SOLVER != 0)
+    {
+        // 逆深度先消去
+        vector<double *> scalar_blocks;
+        for (auto &it : feature_blocks)
+            scalar_blocks.push_back(paraFeature(it.second.para_index));
+        if (WINDOW_SOLVER == 2)
+        {
+            problem->GetParameterBlocks(&parameter_blocks);
+            for (double *x : parameter_blocks)
+                initial_state.insert(initial_state.end(), x, x + problem->ParameterBlockSize(x));
+        }
+        window_solved = window_solver.solve(problem, scalar_blocks, NUM_ITERATIONS, max_time, &window_summary);
+        if (!window_solved)
+            ROS_WARN("window solver does not support this problem, fall back to ceres");
+        else if (WINDOW_SOLVER == 1)
+        {
+            ROS_DEBUG("Iterations : %d", window_summary.iterations);
+            ROS_DEBUG("solver costs: %f", window_summary.time);
+            return;
+        }
+        // 对比模式：留下结果，恢复初值给ceres
+        if (WINDOW_SOLVER == 2)
+        {
+            const double *data = initial_state.data();
+            for (double *x : parameter_blocks)
             {
-                ProjectionFactor *f = new ProjectionFactor(pts_i, pts_j);   // 构造函数就是同一个特征点在不同帧的观测
-                // 约束的变量是该特征点的第一个观测帧以及其他一个观测帧的位姿，加上外参和特征点逆深度
-                problem.AddResidualBlock(f, loss_function, para_Pose[imu_i], para_Pose[imu_j], para_Ex_Pose[0], para_Feature[feature_index]);
+                int size = problem->ParameterBlockSize(x);
+                window_state.insert(window_state.end(), x, x + size);
+                std::copy(data, data + size, x);
+                data += size;
             }
-            f_m_cnt++;
         }
     }
 
-    ROS_DEBUG("visual measurement count: %d", f_m_cnt);
+    ceres::Solver::Options options;
+
+    options.linear_solver_type = ceres::DENSE_SCHUR;
+    //options.num_threads = 2;
+    options.trust_region_strategy_type = ceres::DOGLEG;
+    options.max_num_iterations = NUM_ITERATIONS;
+    //options.use_explicit_schur_complement = true;
+    //options.minimizer_progress_to_stdout = true;
+    //options.use_nonmonotonic_steps = true;
+    options.max_solver_time_in_seconds = max_time;
+    TicToc t_solver;
+    ceres::Solver::Summary summary;
+    ceres::Solve(options, problem, &summary);  // ceres优化求解
+    double t_ceres = t_solver.toc();
+    //cout << summary.BriefReport() << endl;
+    ROS_DEBUG("Iterations : %d", static_cast<int>(summary.iterations.size()));
+    ROS_DEBUG("solver costs: %f", t_ceres);
+
+    if (WINDOW_SOLVER == 2 && window_solved)
+    {
+        // 位置单独统计，其他状态量纲不同只看最大差
+        double max_diff = 0, max_position_diff = 0;
+        const double *data = window_state.data();
+        for (double *x : parameter_blocks)
+        {
+            int size = problem->ParameterBlockSize(x);
+            for (int k = 0; k < size; k++)
+                max_diff = std::max(max_diff, std::abs(x[k] - data[k]));
+            if (size == SIZE_POSE)
+                max_position_diff = std::max(max_position_diff, (Eigen::Map<const Vector3d>(x) - Eigen::Map<const Vector3d>(data)).norm());
+            data += size;
+        }
+        ROS_INFO("solver compare: ceres cost %f -> %f, %d iterations, %f ms; window solver cost %f -> %f, %d iterations, %f ms; max position diff %f, max state diff %f",
+                 summary.initial_cost, summary.final_cost, static_cast<int>(summary.iterations.size()), t_ceres,
+                 window_summary.initial_cost, window_summary.final_cost, window_summary.iterations, window_summary.time,
+                 max_position_diff, max_diff);
+        ofstream fout(SOLVER_COMPARE_PATH, ios::app);
+        fout.setf(ios::fixed, ios::floatfield);
+        fout.precision(0);
+        fout << Headers[WINDOW_SIZE].stamp.toSec() * 1e9 << ",";
+        fout.precision(6);
+        fout << summary.initial_cost << "," << summary.final_cost << "," << summary.iterations.size() << "," << t_ceres << ","
+             << window_summary.initial_cost << "," << window_summary.final_cost << "," << window_summary.iterations << "," << window_summary.time << ","
+             << max_position_diff << "," << max_diff << endl;
+    }
+}
+
+/**
+ * @brief 进行非线性优化
+ * 
+ * problem跨帧保留，每帧只补上新的残差，被移出帧的残差在slideWindow()里删掉
+ */
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::optimization()
+{
+    // Step 1 补齐参数块和残差块，类似g2o的顶点和边
+    TicToc t_whole, t_prepare;
+    updateProblem();
+    // ! eigen -> double，参数块都是Eigen格式的，但是在优化过程中使用的是double类型的数组
+    vector2double();  // ! 这里直接将顶点Values直接赋值了，因为AddParameterBlock是指针传递
     ROS_DEBUG("prepare for ceres: %f", t_prepare.toc());
 
-    //  > 约束4：回环检测相关的约束
+    //  > 约束4：回环检测相关的约束，只在这一次优化里用
     if(relocalization_info)
     {
         //printf("set relocalization factor! \n");
-        ceres::LocalParameterization *local_parameterization = new PoseLocalParameterization();
-        problem.AddParameterBlock(relo_Pose, SIZE_POSE, local_parameterization);    // 需要优化的回环帧位姿
+        problem->AddParameterBlock(relo_Pose, SIZE_POSE, &pose_local_parameterization);    // 需要优化的回环帧位姿
         int retrive_feature_index = 0;
-        int feature_index = -1;
         // 遍历现有地图点
         for (auto &it_per_id : f_manager.feature)
         {
-            it_per_id.used_num = it_per_id.feature_per_frame.size();
-            if (!(it_per_id.used_num >= 2 && it_per_id.start_frame < WINDOW_SIZE - 2))
+            auto it = feature_blocks.find(it_per_id.feature_id);
+            if (it == feature_blocks.end() || !it->second.alive)
                 continue;
-            ++feature_index;
             int start = it_per_id.start_frame;
             if(start <= relo_frame_local_index)   // 这个地图点能被对应的当前帧看到
             {   
@@ -937,40 +1216,30 @@ void Estimator::optimization()
                     Vector3d pts_i = it_per_id.feature_per_frame[0].point;
                     
                     ProjectionFactor *f = new ProjectionFactor(pts_i, pts_j);
-                    problem.AddResidualBlock(f, loss_function, para_Pose[start], relo_Pose, para_Ex_Pose[0], para_Feature[feature_index]);
+                    problem->AddResidualBlock(f, loss_function, paraPose(start), relo_Pose, para_Ex_Pose[0], paraFeature(it->second.para_index));
                     retrive_feature_index++;
                 }     
             }
         }
 
     }
-    // Step 3 ceres优化求解
-    ceres::Solver::Options options;
-
-    options.linear_solver_type = ceres::DENSE_SCHUR;
-    //options.num_threads = 2;
-    options.trust_region_strategy_type = ceres::DOGLEG;
-    options.max_num_iterations = NUM_ITERATIONS;
-    //options.use_explicit_schur_complement = true;
-    //options.minimizer_progress_to_stdout = true;
-    //options.use_nonmonotonic_steps = true;
+    // Step 3 优化求解
     if (marginalization_flag == MARGIN_OLD)
         // 下面的边缘化老的操作比较多，因此给他优化时间就少一些
-        options.max_solver_time_in_seconds = SOLVER_TIME * 4.0 / 5.0;
+        solveProblem(SOLVER_TIME * 4.0 / 5.0);
     else
-        options.max_solver_time_in_seconds = SOLVER_TIME;
-    TicToc t_solver;
-    ceres::Solver::Summary summary;
-    ceres::Solve(options, &problem, &summary);  // ceres优化求解
-    //cout << summary.BriefReport() << endl;
-    ROS_DEBUG("Iterations : %d", static_cast<int>(summary.iterations.size()));
-    ROS_DEBUG("solver costs: %f", t_solver.toc());
+        solveProblem(SOLVER_TIME);
+    // 回环约束不留在problem里，删参数块时相连的残差块一起删掉
+    if (problem->HasParameterBlock(relo_Pose))
+        problem->RemoveParameterBlock(relo_Pose);
     // 把优化后double -> eigen
     double2vector();
 
     // Step 4 边缘化
     // 科普一下舒尔补
     TicToc t_whole_marginalization;
+    t_pre_marginalization = 0;
+    t_marginalization = 0;
     if (marginalization_flag == MARGIN_OLD)
     {
         // 一个用来边缘化操作的对象
@@ -990,14 +1259,14 @@ void Estimator::optimization()
             for (int i = 0; i < static_cast<int>(last_marginalization_parameter_blocks.size()); i++)
             {
                 // 涉及到的待边缘化的上一次边缘化留下来的当前参数块只有位姿和速度零偏
-                if (last_marginalization_parameter_blocks[i] == para_Pose[0] ||
-                    last_marginalization_parameter_blocks[i] == para_SpeedBias[0])
+                if (last_marginalization_parameter_blocks[i] == paraPose(0) ||
+                    last_marginalization_parameter_blocks[i] == paraSpeedBias(0))
                     drop_set.push_back(i);
             }
             // 处理方式和其他残差块相同
             // construct new marginlization_factor
-            MarginalizationFactor *marginalization_factor = new MarginalizationFactor(last_marginalization_info);
-            ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(marginalization_factor, NULL,
+            MarginalizationFactor *marginalization_factor = marginalization_info->arena.create<MarginalizationFactor>(last_marginalization_info);
+            ResidualBlockInfo *residual_block_info = marginalization_info->arena.create<ResidualBlockInfo>(marginalization_factor, nullptr,
                                                                            last_marginalization_parameter_blocks,
                                                                            drop_set);
 
@@ -1009,9 +1278,9 @@ void Estimator::optimization()
             if (pre_integrations[1]->sum_dt < 10.0)  // 超过10置信度比较低
             {
                 // 跟构建ceres约束问题一样，这里也需要得到残差和雅克比
-                IMUFactor* imu_factor = new IMUFactor(pre_integrations[1]);
-                ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(imu_factor, NULL,
-                                                                           vector<double *>{para_Pose[0], para_SpeedBias[0], para_Pose[1], para_SpeedBias[1]},
+                IMUFactor* imu_factor = marginalization_info->arena.create<IMUFactor>(pre_integrations[1]);
+                ResidualBlockInfo *residual_block_info = marginalization_info->arena.create<ResidualBlockInfo>(imu_factor, nullptr,
+                                                                           vector<double *>{paraPose(0), paraSpeedBias(0), paraPose(1), paraSpeedBias(1)},
                                                                            vector<int>{0, 1});  // 这里就是第0和1个参数块是需要被边缘化的
                 marginalization_info->addResidualBlockInfo(residual_block_info);
             }
@@ -1019,68 +1288,57 @@ void Estimator::optimization()
         // 遍历视觉重投影的约束
         // ! 重投影约束，第0帧看到的所有重投影
         {
-            int feature_index = -1;
             for (auto &it_per_id : f_manager.feature)
             {
-                it_per_id.used_num = it_per_id.feature_per_frame.size();
-                if (!(it_per_id.used_num >= 2 && it_per_id.start_frame < WINDOW_SIZE - 2))
+                auto it = feature_blocks.find(it_per_id.feature_id);
+                if (it == feature_blocks.end() || !it->second.alive)
                     continue;
-
-                ++feature_index;
+                double *para_feature = paraFeature(it->second.para_index);
 
                 int imu_i = it_per_id.start_frame, imu_j = imu_i - 1;
                 // 只找能被第0帧看到的特征点
                 if (imu_i != 0)
                     continue;
 
-                Vector3d pts_i = it_per_id.feature_per_frame[0].point;
+                // 和优化时一样，这个地图点的所有观测是一个残差块，第0帧和地图点被margin
+                const FeaturePerFrame &first = it_per_id.feature_per_frame[0];
+                ProjectionGroupFactor *f = marginalization_info->arena.create<ProjectionGroupFactor>(first.point, first.velocity, first.cur_td, first.uv.y(),
+                                                                                                    ESTIMATE_TD, loss_function);
+                vector<double *> parameter_blocks{paraPose(imu_i), para_Ex_Pose[0], para_feature};
+                if (ESTIMATE_TD)
+                    parameter_blocks.push_back(para_Td[0]);
                 // 遍历看到这个特征点的所有KF，通过这个特征点，建立和第0帧的约束
                 for (auto &it_per_frame : it_per_id.feature_per_frame)
                 {
                     imu_j++;
                     if (imu_i == imu_j)
                         continue;
-
-                    Vector3d pts_j = it_per_frame.point;
-                    // 根据是否约束延时确定残差阵
-                    if (ESTIMATE_TD)
-                    {
-                        ProjectionTdFactor *f_td = new ProjectionTdFactor(pts_i, pts_j, it_per_id.feature_per_frame[0].velocity, it_per_frame.velocity,
-                                                                          it_per_id.feature_per_frame[0].cur_td, it_per_frame.cur_td,
-                                                                          it_per_id.feature_per_frame[0].uv.y(), it_per_frame.uv.y());
-                        ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(f_td, loss_function,
-                                                                                        vector<double *>{para_Pose[imu_i], para_Pose[imu_j], para_Ex_Pose[0], para_Feature[feature_index], para_Td[0]},
-                                                                                        vector<int>{0, 3});
-                        marginalization_info->addResidualBlockInfo(residual_block_info);
-                    }
-                    else
-                    {
-                        ProjectionFactor *f = new ProjectionFactor(pts_i, pts_j);
-                        ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(f, loss_function,
-                                                                                       vector<double *>{para_Pose[imu_i], para_Pose[imu_j], para_Ex_Pose[0], para_Feature[feature_index]},
-                                                                                       vector<int>{0, 3});  // 这里第0帧和地图点被margin
-                        marginalization_info->addResidualBlockInfo(residual_block_info);
-                    }
+                    f->addObservation(it_per_frame.point, it_per_frame.velocity, it_per_frame.cur_td, it_per_frame.uv.y());
+                    parameter_blocks.push_back(paraPose(imu_j));
                 }
+                ResidualBlockInfo *residual_block_info = marginalization_info->arena.create<ResidualBlockInfo>(f, nullptr, parameter_blocks,
+                                                                                                              vector<int>{0, 2});
+                marginalization_info->addResidualBlockInfo(residual_block_info);
             }
         }
         // 所有的残差块都收集好了
         TicToc t_pre_margin;
         // 进行预处理
         marginalization_info->preMarginalize();
-        ROS_DEBUG("pre marginalization %f ms", t_pre_margin.toc());
+        t_pre_marginalization = t_pre_margin.toc();
+        ROS_DEBUG("pre marginalization %f ms", t_pre_marginalization);
         
         TicToc t_margin;
         // 边缘化操作
         marginalization_info->marginalize();
-        ROS_DEBUG("marginalization %f ms", t_margin.toc());
-        // 即将滑窗，因此记录新地址对应的老地址
+        t_marginalization = t_margin.toc();
+        ROS_DEBUG("marginalization %f ms", t_marginalization);
+        // 参数块地址跟着帧走，滑窗之后留下来的参数块地址不变
         std::unordered_map<long, double *> addr_shift;
         for (int i = 1; i <= WINDOW_SIZE; i++)
         {
-            // 位姿和速度都要滑窗移动
-            addr_shift[reinterpret_cast<long>(para_Pose[i])] = para_Pose[i - 1];
-            addr_shift[reinterpret_cast<long>(para_SpeedBias[i])] = para_SpeedBias[i - 1];
+            addr_shift[reinterpret_cast<long>(paraPose(i))] = paraPose(i);
+            addr_shift[reinterpret_cast<long>(paraSpeedBias(i))] = paraSpeedBias(i);
         }
         // 外参和时间延时不变
         for (int i = 0; i < NUM_OF_CAM; i++)
@@ -1091,11 +1349,7 @@ void Estimator::optimization()
         }
         // parameter_blocks实际上就是addr_shift的索引的集合及搬进去的新地址
         vector<double *> parameter_blocks = marginalization_info->getParameterBlocks(addr_shift);
-
-        if (last_marginalization_info)
-            delete last_marginalization_info;
-        last_marginalization_info = marginalization_info;   // 本次边缘化的所有信息
-        last_marginalization_parameter_blocks = parameter_blocks;   // 代表该次边缘化对某些参数块形成约束，这些参数块在滑窗之后的地址
+        setPrior(marginalization_info, parameter_blocks);
         
     }
     else    // 边缘化倒数第二帧
@@ -1103,7 +1357,7 @@ void Estimator::optimization()
         // 要求有上一次边缘化的结果同时，即将被margin掉的在上一次边缘化后的约束中
         // 预积分结果合并，因此只有位姿margin掉
         if (last_marginalization_info &&
-            std::count(std::begin(last_marginalization_parameter_blocks), std::end(last_marginalization_parameter_blocks), para_Pose[WINDOW_SIZE - 1]))
+            std::count(std::begin(last_marginalization_parameter_blocks), std::end(last_marginalization_parameter_blocks), paraPose(WINDOW_SIZE - 1)))
         {
 
             MarginalizationInfo *marginalization_info = new MarginalizationInfo();
@@ -1114,15 +1368,15 @@ void Estimator::optimization()
                 for (int i = 0; i < static_cast<int>(last_marginalization_parameter_blocks.size()); i++)
                 {
                     // 速度零偏只会margin第1个，不可能出现倒数第二个
-                    ROS_ASSERT(last_marginalization_parameter_blocks[i] != para_SpeedBias[WINDOW_SIZE - 1]);
+                    ROS_ASSERT(last_marginalization_parameter_blocks[i] != paraSpeedBias(WINDOW_SIZE - 1));
                     // 这种case只会margin掉倒数第二个位姿
-                    if (last_marginalization_parameter_blocks[i] == para_Pose[WINDOW_SIZE - 1])
+                    if (last_marginalization_parameter_blocks[i] == paraPose(WINDOW_SIZE - 1))
                         drop_set.push_back(i);
                 }
                 // construct new marginlization_factor
                 // 这里只会更新一下margin factor
-                MarginalizationFactor *marginalization_factor = new MarginalizationFactor(last_marginalization_info);
-                ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(marginalization_factor, NULL,
+                MarginalizationFactor *marginalization_factor = marginalization_info->arena.create<MarginalizationFactor>(last_marginalization_info);
+                ResidualBlockInfo *residual_block_info = marginalization_info->arena.create<ResidualBlockInfo>(marginalization_factor, nullptr,
                                                                                last_marginalization_parameter_blocks,
                                                                                drop_set);
 
@@ -1132,28 +1386,23 @@ void Estimator::optimization()
             TicToc t_pre_margin;
             ROS_DEBUG("begin marginalization");
             marginalization_info->preMarginalize();
-            ROS_DEBUG("end pre marginalization, %f ms", t_pre_margin.toc());
+            t_pre_marginalization = t_pre_margin.toc();
+            ROS_DEBUG("end pre marginalization, %f ms", t_pre_marginalization);
 
             TicToc t_margin;
             ROS_DEBUG("begin marginalization");
             marginalization_info->marginalize();
-            ROS_DEBUG("end marginalization, %f ms", t_margin.toc());
+            t_marginalization = t_margin.toc();
+            ROS_DEBUG("end marginalization, %f ms", t_marginalization);
             
+            // 最新帧成为次新帧时参数块地址也跟着走，留下来的参数块地址都不变
             std::unordered_map<long, double *> addr_shift;
             for (int i = 0; i <= WINDOW_SIZE; i++)
             {
                 if (i == WINDOW_SIZE - 1)
                     continue;
-                else if (i == WINDOW_SIZE)  // 滑窗，最新帧成为次新帧
-                {
-                    addr_shift[reinterpret_cast<long>(para_Pose[i])] = para_Pose[i - 1];
-                    addr_shift[reinterpret_cast<long>(para_SpeedBias[i])] = para_SpeedBias[i - 1];
-                }
-                else    // 其他不变
-                {
-                    addr_shift[reinterpret_cast<long>(para_Pose[i])] = para_Pose[i];
-                    addr_shift[reinterpret_cast<long>(para_SpeedBias[i])] = para_SpeedBias[i];
-                }
+                addr_shift[reinterpret_cast<long>(paraPose(i))] = paraPose(i);
+                addr_shift[reinterpret_cast<long>(paraSpeedBias(i))] = paraSpeedBias(i);
             }
             for (int i = 0; i < NUM_OF_CAM; i++)
                 addr_shift[reinterpret_cast<long>(para_Ex_Pose[i])] = para_Ex_Pose[i];
@@ -1163,10 +1412,7 @@ void Estimator::optimization()
             }
             
             vector<double *> parameter_blocks = marginalization_info->getParameterBlocks(addr_shift);
-            if (last_marginalization_info)
-                delete last_marginalization_info;
-            last_marginalization_info = marginalization_info;
-            last_marginalization_parameter_blocks = parameter_blocks;
+            setPrior(marginalization_info, parameter_blocks);
             
         }
     }
@@ -1176,7 +1422,8 @@ void Estimator::optimization()
 }
 
 // 滑动窗口 
-void Estimator::slideWindow()
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::slideWindow()
 {
     TicToc t_margin;
     // 根据边缘化种类的不同，进行滑窗的方式也不同
@@ -1188,6 +1435,12 @@ void Estimator::slideWindow()
         // 必须是填满了滑窗才可以
         if (frame_count == WINDOW_SIZE)
         {
+            // 最老帧的参数块挪到最后给新帧用，其他帧的参数块和残差都不动
+            removeFrameBlocks(para_slot[0]);
+            int slot_0 = para_slot[0];
+            for (int i = 0; i < WINDOW_SIZE; i++)
+                para_slot[i] = para_slot[i + 1];
+            para_slot[WINDOW_SIZE] = slot_0;
             // ! 一帧一帧交换过去，把第0帧放到了最后
             for (int i = 0; i < WINDOW_SIZE; i++)
             {
@@ -1195,10 +1448,6 @@ void Estimator::slideWindow()
 
                 std::swap(pre_integrations[i], pre_integrations[i + 1]);
 
-                dt_buf[i].swap(dt_buf[i + 1]);
-                linear_acceleration_buf[i].swap(linear_acceleration_buf[i + 1]);
-                angular_velocity_buf[i].swap(angular_velocity_buf[i + 1]);
-
                 Headers[i] = Headers[i + 1];
                 Ps[i].swap(Ps[i + 1]);
                 Vs[i].swap(Vs[i + 1]);
@@ -1214,11 +1463,7 @@ void Estimator::slideWindow()
             Bgs[WINDOW_SIZE] = Bgs[WINDOW_SIZE - 1];
             // 预积分量就得置零
             delete pre_integrations[WINDOW_SIZE];  // ! delete，否则内存溢出
-            pre_integrations[WINDOW_SIZE] = new IntegrationBase{acc_0, gyr_0, Bas[WINDOW_SIZE], Bgs[WINDOW_SIZE]};
-            // buffer清空，等待新的数据来填
-            dt_buf[WINDOW_SIZE].clear();
-            linear_acceleration_buf[WINDOW_SIZE].clear();
-            angular_velocity_buf[WINDOW_SIZE].clear();
+            pre_integrations[WINDOW_SIZE] = new IntegrationBase{acc_0, gyr_0, Bas[WINDOW_SIZE], Bgs[WINDOW_SIZE], &imu_buffer};
             // 清空all_image_frame最老帧之前的状态
             if (true || solver_flag == INITIAL)
             {
@@ -1246,19 +1491,11 @@ void Estimator::slideWindow()
     {
         if (frame_count == WINDOW_SIZE)
         {
-            // 将最后两个预积分观测合并成一个
-            for (unsigned int i = 0; i < dt_buf[frame_count].size(); i++)
-            {
-                double tmp_dt = dt_buf[frame_count][i];
-                Vector3d tmp_linear_acceleration = linear_acceleration_buf[frame_count][i];
-                Vector3d tmp_angular_velocity = angular_velocity_buf[frame_count][i];
-
-                pre_integrations[frame_count - 1]->push_back(tmp_dt, tmp_linear_acceleration, tmp_angular_velocity);
-
-                dt_buf[frame_count - 1].push_back(tmp_dt);
-                linear_acceleration_buf[frame_count - 1].push_back(tmp_linear_acceleration);
-                angular_velocity_buf[frame_count - 1].push_back(tmp_angular_velocity);
-            }
+            // 次新帧的参数块给下一帧用，最新帧的参数块和残差都不动
+            removeFrameBlocks(para_slot[WINDOW_SIZE - 1]);
+            std::swap(para_slot[WINDOW_SIZE - 1], para_slot[WINDOW_SIZE]);
+            // 将最后两个预积分观测合并成一个，两段区间在imu_buffer里是首尾相接的，次新帧的区间直接延长到最新帧的末尾
+            pre_integrations[frame_count - 1]->extend(pre_integrations[frame_count]->end_index);
             // 简单的滑窗交换
             Headers[frame_count - 1] = Headers[frame_count];
             Ps[frame_count - 1] = Ps[frame_count];
@@ -1268,27 +1505,42 @@ void Estimator::slideWindow()
             Bgs[frame_count - 1] = Bgs[frame_count];
             // reset最新预积分量
             delete pre_integrations[WINDOW_SIZE];
-            pre_integrations[WINDOW_SIZE] = new IntegrationBase{acc_0, gyr_0, Bas[WINDOW_SIZE], Bgs[WINDOW_SIZE]};
-            // clear相关buffer
-            dt_buf[WINDOW_SIZE].clear();
-            linear_acceleration_buf[WINDOW_SIZE].clear();
-            angular_velocity_buf[WINDOW_SIZE].clear();
+            pre_integrations[WINDOW_SIZE] = new IntegrationBase{acc_0, gyr_0, Bas[WINDOW_SIZE], Bgs[WINDOW_SIZE], &imu_buffer};
 
             slideWindowNew();
         }
     }
+    releaseImuSamples();
+}
+
+// 滑窗、all_image_frame和tmp_pre_integration里最老的预积分之前的imu采样都用不到了
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::releaseImuSamples()
+{
+    long oldest = imu_buffer.end();
+    for (int i = 0; i <= WINDOW_SIZE; i++)
+        if (pre_integrations[i])
+            oldest = min(oldest, pre_integrations[i]->begin_index);
+    for (auto &it : all_image_frame)
+        if (it.second.pre_integration)
+            oldest = min(oldest, it.second.pre_integration->begin_index);
+    if (tmp_pre_integration)
+        oldest = min(oldest, tmp_pre_integration->begin_index);
+    imu_buffer.release(oldest);
 }
 
 // real marginalization is removed in solve_ceres()
 // 对被移除的倒数第二帧的地图点进行处理
-void Estimator::slideWindowNew()
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::slideWindowNew()
 {
     sum_of_front++;
     f_manager.removeFront(frame_count);
 }
 // real marginalization is removed in solve_ceres()
 // 由于地图点是绑定在第一个看见它的位姿上的，因此需要对被移除的帧看见的地图点进行解绑，以及每个地图点的首个观测帧id减1
-void Estimator::slideWindowOld()
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::slideWindowOld()
 {
     sum_of_back++;
 
@@ -1318,7 +1570,8 @@ void Estimator::slideWindowOld()
  * @param[in] _relo_t 
  * @param[in] _relo_r 
  */
-void Estimator::setReloFrame(double _frame_stamp, int _frame_index, vector<Vector3d> &_match_points, Vector3d _relo_t, Matrix3d _relo_r)
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::setReloFrame(double _frame_stamp, int _frame_index, vector<Vector3d> &_match_points, Vector3d _relo_t, Matrix3d _relo_r)
 {
     relo_frame_stamp = _frame_stamp;
     relo_frame_index = _frame_index;
@@ -1334,8 +1587,41 @@ void Estimator::setReloFrame(double _frame_stamp, int _frame_index, vector<Vecto
             relo_frame_local_index = i; // 对应滑窗中的第i帧
             relocalization_info = 1;    // 这是一个有效的回环信息
             for (int j = 0; j < SIZE_POSE; j++)
-                relo_Pose[j] = para_Pose[i][j]; // 借助VIO优化回环帧位姿，初值先设为当前帧位姿
+                relo_Pose[j] = paraPose(i)[j]; // 借助VIO优化回环帧位姿，初值先设为当前帧位姿
         }
     }
 }
 
+
+template <int WINDOW_SIZE>
+void Estimator<WINDOW_SIZE>::getLatestState(Vector3d &P, Matrix3d &R, Vector3d &V, Vector3d &Ba, Vector3d &Bg) const
+{
+    P = Ps[WINDOW_SIZE];
+    R = Rs[WINDOW_SIZE];
+    V = Vs[WINDOW_SIZE];
+    Ba = Bas[WINDOW_SIZE];
+    Bg = Bgs[WINDOW_SIZE];
+}
+
+// 预先编译的滑窗大小，改这里要同时改feature_manager.cpp、visualization.cpp和estimator_node.cpp
+template class Estimator<5>;
+template class Estimator<10>;
+template class Estimator<15>;
+template class Estimator<20>;
+
+EstimatorBase *createEstimator(int window_size)
+{
+    switch (window_size)
+    {
+    case 5:
+        return new Estimator<5>();
+    case 10:
+        return new Estimator<10>();
+    case 15:
+        return new Estimator<15>();
+    case 20:
+        return new Estimator<20>();
+    default:
+        return nullptr;
+    }
+}
@@ -16,27 +16,90 @@
 #include "factor/pose_local_parameterization.h"
 #include "factor/projection_factor.h"
 #include "factor/projection_td_factor.h"
+#include "factor/projection_group_factor.h"
 #include "factor/marginalization_factor.h"
+#include "window_solver.h"
 
 #include <unordered_map>
 #include <queue>
+#include <deque>
+#include <array>
 #include <opencv2/core/eigen.hpp>
 
+// 常驻ceres problem里一个地图点的重投影残差
+struct FeatureBlocks
+{
+    int para_index;                             // 逆深度在para_Feature里的位置，地图点留在problem里期间不变
+    double *anchor;                             // 起始帧位姿参数块，起始帧换了残差要重建
+    vector<double *> frames;                    // 残差块连接的其他观测帧位姿参数块，观测帧变了残差要重建
+    ceres::ResidualBlockId residual;            // 这个地图点所有观测放在一个残差块里
+    bool alive;
+};
 
-class Estimator
+/**
+ * @brief 估计器里和滑窗大小无关的接口，节点只通过它使用估计器
+ *
+ * 具体的Estimator<WINDOW_SIZE>由createEstimator()按配置的window_size选定，
+ * 需要访问滑窗数组的地方（发布结果）按window_size转成对应的实例
+ */
+class EstimatorBase
 {
   public:
+    enum SolverFlag
+    {
+        INITIAL,
+        NON_LINEAR
+    };
+
+    enum MarginalizationFlag
+    {
+        MARGIN_OLD = 0,
+        MARGIN_SECOND_NEW = 1
+    };
+
+    EstimatorBase(int _window_size) : window_size(_window_size) {}
+    virtual ~EstimatorBase() {}
+
+    virtual void setParameter() = 0;
+    virtual void clearState() = 0;
+    virtual void processIMU(double t, const Vector3d &linear_acceleration, const Vector3d &angular_velocity, int count = 1) = 0;
+    virtual void processImage(const ImageFeatures &image, const std_msgs::Header &header) = 0;
+    virtual void setReloFrame(double _frame_stamp, int _frame_index, vector<Vector3d> &_match_points, Vector3d _relo_t, Matrix3d _relo_r) = 0;
+    // 滑窗最新一帧的状态
+    virtual void getLatestState(Vector3d &P, Matrix3d &R, Vector3d &V, Vector3d &Ba, Vector3d &Bg) const = 0;
+
+    const int window_size;
+    SolverFlag solver_flag;
+    MarginalizationFlag  marginalization_flag;
+    Vector3d g;
+    double td;
+    Vector3d acc_0, gyr_0;
+};
+
+/**
+ * @brief 滑窗估计器，滑窗大小是模板参数，滑窗里的数组都是定长的，按帧的循环次数编译期已知
+ *
+ * 预先实例化的滑窗大小见estimator.cpp末尾
+ */
+template <int WINDOW_SIZE>
+class Estimator : public EstimatorBase
+{
+  public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
     Estimator();
+    virtual ~Estimator();
 
-    void setParameter();
+    virtual void setParameter();
 
     // interface
-    void processIMU(double t, const Vector3d &linear_acceleration, const Vector3d &angular_velocity);
-    void processImage(const map<int, vector<pair<int, Eigen::Matrix<double, 7, 1>>>> &image, const std_msgs::Header &header);
-    void setReloFrame(double _frame_stamp, int _frame_index, vector<Vector3d> &_match_points, Vector3d _relo_t, Matrix3d _relo_r);
+    virtual void processIMU(double t, const Vector3d &linear_acceleration, const Vector3d &angular_velocity, int count = 1);
+    virtual void processImage(const ImageFeatures &image, const std_msgs::Header &header);
+    virtual void setReloFrame(double _frame_stamp, int _frame_index, vector<Vector3d> &_match_points, Vector3d _relo_t, Matrix3d _relo_r);
+    virtual void getLatestState(Vector3d &P, Matrix3d &R, Vector3d &V, Vector3d &Ba, Vector3d &Bg) const;
 
     // internal
-    void clearState();
+    virtual void clearState();
     bool initialStructure();
     bool visualInitialAlign();
     bool relativePose(Matrix3d &relative_R, Vector3d &relative_T, int &l);
@@ -44,27 +107,23 @@ class Estimator
     void solveOdometry();
     void slideWindowNew();
     void slideWindowOld();
+    void releaseImuSamples();
     void optimization();
     void vector2double();
     void double2vector();
     bool failureDetection();
+    void resetProblem();
+    void updateProblem();
+    void removeFrameBlocks(int slot);
+    void removeFeatureResiduals(FeatureBlocks &blocks);
+    void setPrior(MarginalizationInfo *marginalization_info, const vector<double *> &parameter_blocks);
+    void solveProblem(double max_time);
+
+    // 滑窗第i帧的参数块，地址跟着帧走，滑窗时不用搬数据
+    double *paraPose(int i) { return para_Pose[para_slot[i]]; }
+    double *paraSpeedBias(int i) { return para_SpeedBias[para_slot[i]]; }
+    double *paraFeature(int index) { return para_Feature[index].data(); }
 
-
-    enum SolverFlag
-    {
-        INITIAL,
-        NON_LINEAR
-    };
-
-    enum MarginalizationFlag
-    {
-        MARGIN_OLD = 0,
-        MARGIN_SECOND_NEW = 1
-    };
-
-    SolverFlag solver_flag;
-    MarginalizationFlag  marginalization_flag;
-    Vector3d g;
     MatrixXd Ap[2], backup_A;
     VectorXd bp[2], backup_b;
 
@@ -76,23 +135,18 @@ class Estimator
     Matrix3d Rs[(WINDOW_SIZE + 1)];
     Vector3d Bas[(WINDOW_SIZE + 1)];
     Vector3d Bgs[(WINDOW_SIZE + 1)];
-    double td;
 
     Matrix3d back_R0, last_R, last_R0;
     Vector3d back_P0, last_P, last_P0;
     std_msgs::Header Headers[(WINDOW_SIZE + 1)];
 
+    ImuBuffer imu_buffer;   // 所有imu采样只存这一份，预积分只记序号区间
     IntegrationBase *pre_integrations[(WINDOW_SIZE + 1)];  // 指针数组
-    Vector3d acc_0, gyr_0;
-
-    vector<double> dt_buf[(WINDOW_SIZE + 1)];
-    vector<Vector3d> linear_acceleration_buf[(WINDOW_SIZE + 1)];
-    vector<Vector3d> angular_velocity_buf[(WINDOW_SIZE + 1)];
 
     int frame_count;
     int sum_of_outlier, sum_of_back, sum_of_front, sum_of_invalid;
 
-    FeatureManager f_manager;
+    FeatureManager<WINDOW_SIZE> f_manager;
     MotionEstimator m_estimator;
     InitialEXRotation initial_ex_rotation;
 
@@ -108,14 +162,29 @@ class Estimator
 
     double para_Pose[WINDOW_SIZE + 1][SIZE_POSE];
     double para_SpeedBias[WINDOW_SIZE + 1][SIZE_SPEEDBIAS];
-    double para_Feature[NUM_OF_F][SIZE_FEATURE];
+    deque<array<double, SIZE_FEATURE>> para_Feature;  // 逆深度，不够时在尾部扩充，已有元素的地址不变，ceres里的指针一直有效
     double para_Ex_Pose[NUM_OF_CAM][SIZE_POSE];
     double para_Retrive_Pose[SIZE_POSE];
     double para_Td[1][1];
     double para_Tr[1][1];
+    int para_slot[WINDOW_SIZE + 1];  // 滑窗第i帧在para_Pose/para_SpeedBias里的行号
+
+    // 跨帧复用的ceres problem：滑窗时只删掉被移出帧相关的残差，新的残差在下一次优化时补上
+    ceres::Problem *problem;
+    ceres::LossFunction *loss_function;
+    PoseLocalParameterization pose_local_parameterization;
+    WindowSolver window_solver;     // window_solver不为0时使用，缓冲区跨帧复用
+    ceres::ResidualBlockId imu_residual[WINDOW_SIZE + 1];  // 按后一帧的行号存
+    double *imu_pose_i[WINDOW_SIZE + 1];                   // 对应imu残差前一帧的位姿参数块
+    ceres::ResidualBlockId prior_residual;
+    unordered_map<int, FeatureBlocks> feature_blocks;      // 特征点id -> 残差
+    vector<int> free_feature_index;
 
     int loop_window_index;
 
+    // 最近一帧边缘化各阶段的耗时(ms)，这一帧没有边缘化时为0
+    double t_pre_marginalization, t_marginalization;
+
     MarginalizationInfo *last_marginalization_info;
     vector<double *> last_marginalization_parameter_blocks;
 
@@ -137,3 +206,6 @@ class Estimator
     Quaterniond relo_relative_q;
     double relo_relative_yaw;
 };
+
+// 按window_size创建对应的估计器，只支持预先实例化的大小，其他返回nullptr
+EstimatorBase *createEstimator(int window_size);
@@ -4,21 +4,26 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <memory>
 #include <ros/ros.h>
 #include <cv_bridge/cv_bridge.h>
 #include <opencv2/opencv.hpp>
+#include <feature_tracker/FeatureFrame.h>
 
 #include "estimator.h"
 #include "parameters.h"
 #include "utility/visualization.h"
+#include "factor/imu_preaverager.h"
 
 
-Estimator estimator;
+std::unique_ptr<EstimatorBase> estimator;   // 按配置的window_size在setupNode()里创建
 
 std::condition_variable con; // 锁条件
+bool shutdown_process = false;  // 节点/nodelet退出时置位，由m_buf保护
+std::thread measurement_process;
 double current_time = -1;
 queue<sensor_msgs::ImuConstPtr> imu_buf;
-queue<sensor_msgs::PointCloudConstPtr> feature_buf;
+queue<feature_tracker::FeatureFrameConstPtr> feature_buf;
 queue<sensor_msgs::PointCloudConstPtr> relo_buf;
 int sum_of_wait = 0;
 
@@ -27,6 +32,8 @@ std::mutex m_state;
 std::mutex i_buf;
 std::mutex m_estimator;
 
+ros::Subscriber sub_imu, sub_image, sub_restart, sub_relo_points;
+
 double latest_time;
 Eigen::Vector3d tmp_P;
 Eigen::Quaterniond tmp_Q;
@@ -69,7 +76,7 @@ void predict(const sensor_msgs::ImuConstPtr &imu_msg)
 
     // ! 连续两帧imu之间采取中值积分的方式来更新PVQ(先Q后PV)
     // 转到该连续图像帧内的第一帧所在坐标系下
-    Eigen::Vector3d un_acc_0 = tmp_Q * (acc_0 - tmp_Ba) - estimator.g;
+    Eigen::Vector3d un_acc_0 = tmp_Q * (acc_0 - tmp_Ba) - estimator->g;
     // 中值陀螺仪的结果
     Eigen::Vector3d un_gyr = 0.5 * (gyr_0 + angular_velocity) - tmp_Bg;
 
@@ -77,7 +84,7 @@ void predict(const sensor_msgs::ImuConstPtr &imu_msg)
     tmp_Q = tmp_Q * Utility::deltaQ(un_gyr * dt);
 
     // 转到该连续图像帧内的第一帧所在坐标系下
-    Eigen::Vector3d un_acc_1 = tmp_Q * (linear_acceleration - tmp_Ba) - estimator.g;
+    Eigen::Vector3d un_acc_1 = tmp_Q * (linear_acceleration - tmp_Ba) - estimator->g;
     // 加速度中值积分的值
     Eigen::Vector3d un_acc = 0.5 * (un_acc_0 + un_acc_1);
 
@@ -94,13 +101,11 @@ void update()
 {
     TicToc t_predict;
     latest_time = current_time;
-    tmp_P = estimator.Ps[WINDOW_SIZE];
-    tmp_Q = estimator.Rs[WINDOW_SIZE];
-    tmp_V = estimator.Vs[WINDOW_SIZE];
-    tmp_Ba = estimator.Bas[WINDOW_SIZE];
-    tmp_Bg = estimator.Bgs[WINDOW_SIZE];
-    acc_0 = estimator.acc_0;   // 此时的acc_0是滑窗的最后一个
-    gyr_0 = estimator.gyr_0;
+    Matrix3d tmp_R;
+    estimator->getLatestState(tmp_P, tmp_R, tmp_V, tmp_Ba, tmp_Bg);
+    tmp_Q = tmp_R;
+    acc_0 = estimator->acc_0;   // 此时的acc_0是滑窗的最后一个
+    gyr_0 = estimator->gyr_0;
 
     queue<sensor_msgs::ImuConstPtr> tmp_imu_buf = imu_buf;  // 遗留的imu的buffer，因为下面需要pop，所以copy了一份
     for (sensor_msgs::ImuConstPtr tmp_imu_msg; !tmp_imu_buf.empty(); tmp_imu_buf.pop())
@@ -109,10 +114,10 @@ void update()
 }
 
 // 获得匹配好的图像imu组，imu覆盖图像帧
-std::vector<std::pair<std::vector<sensor_msgs::ImuConstPtr>, sensor_msgs::PointCloudConstPtr>>
+std::vector<std::pair<std::vector<sensor_msgs::ImuConstPtr>, feature_tracker::FeatureFrameConstPtr>>
 getMeasurements()
 {
-    std::vector<std::pair<std::vector<sensor_msgs::ImuConstPtr>, sensor_msgs::PointCloudConstPtr>> measurements;
+    std::vector<std::pair<std::vector<sensor_msgs::ImuConstPtr>, feature_tracker::FeatureFrameConstPtr>> measurements;
 
     while (true)
     {
@@ -122,7 +127,7 @@ getMeasurements()
         // imu     *******
         // image                 *****
         // ! 有个！取反操作，时间越小说明越早
-        if (!(imu_buf.back()->header.stamp.toSec() > feature_buf.front()->header.stamp.toSec() + estimator.td))
+        if (!(imu_buf.back()->header.stamp.toSec() > feature_buf.front()->header.stamp.toSec() + estimator->td))
         {
             //ROS_WARN("wait for imu, only should happen at the beginning");
             sum_of_wait++;
@@ -132,7 +137,7 @@ getMeasurements()
         // imu               ******
         // image    *****
         // 这种只能扔掉一些image帧
-        if (!(imu_buf.front()->header.stamp.toSec() < feature_buf.front()->header.stamp.toSec() + estimator.td))
+        if (!(imu_buf.front()->header.stamp.toSec() < feature_buf.front()->header.stamp.toSec() + estimator->td))
         {
             ROS_WARN("throw img, only should happen at the beginning");
             feature_buf.pop();
@@ -142,7 +147,7 @@ getMeasurements()
         // ! 这边注意，用过的feature和imu直接pop了
         // 此时就保证了图像前一定有imu数据
         // 一般第一帧不会严格对齐，但是后面就都会对齐，当然第一帧也不会用到
-        sensor_msgs::PointCloudConstPtr img_msg = feature_buf.front();
+        feature_tracker::FeatureFrameConstPtr img_msg = feature_buf.front();
         feature_buf.pop();  // 用了就丢了
         
         // 把该帧图像之前的Imu全都存起来，组合方式如下：
@@ -150,7 +155,7 @@ getMeasurements()
         // 图像          *
         //  ! 我们要明确一点，最开始存储的那一串imu其实没啥用，因为它不构成图像的帧间约束，它没得约束
         std::vector<sensor_msgs::ImuConstPtr> IMUs;
-        while (imu_buf.front()->header.stamp.toSec() < img_msg->header.stamp.toSec() + estimator.td)  // imu覆盖feature
+        while (imu_buf.front()->header.stamp.toSec() < img_msg->header.stamp.toSec() + estimator->td)  // imu覆盖feature
         {
             IMUs.emplace_back(imu_buf.front());
             imu_buf.pop();
@@ -196,7 +201,7 @@ void imu_callback(const sensor_msgs::ImuConstPtr &imu_msg)
         header.frame_id = "world";
 
         // 只有初始化完成后才发送当前结果
-        if (estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR)
+        if (estimator->solver_flag == EstimatorBase::SolverFlag::NON_LINEAR)
             pubLatestOdometry(tmp_P, tmp_Q, tmp_V, header);   // rviz发布了此次predict()的位姿
     }
 }
@@ -206,7 +211,7 @@ void imu_callback(const sensor_msgs::ImuConstPtr &imu_msg)
  * 
  * @param[in] feature_msg 
  */
-void feature_callback(const sensor_msgs::PointCloudConstPtr &feature_msg)
+void feature_callback(const feature_tracker::FeatureFrameConstPtr &feature_msg)
 {
     if (!init_feature)
     {
@@ -220,6 +225,21 @@ void feature_callback(const sensor_msgs::PointCloudConstPtr &feature_msg)
     con.notify_one();   // 通知另一个线程可以干活了
 }
 
+ImuPreaverager imu_averager;    // 高频imu分段预平均，imu_average_rate为0时不启用
+
+// 原始imu采样送进估计器，开了预平均的话攒满一段才送
+void processRawImu(double dt, const Vector3d &acc, const Vector3d &gyr)
+{
+    if (!imu_averager.enabled())
+    {
+        estimator->processIMU(dt, acc, gyr);
+        return;
+    }
+    ImuPreaverager::Sample sample;
+    if (imu_averager.push(dt, acc, gyr, sample))
+        estimator->processIMU(sample.dt, sample.acc, sample.gyr, sample.count);
+}
+
 /**
  * @brief 光流跟踪失败将vins估计器复位
  * 
@@ -238,8 +258,9 @@ void restart_callback(const std_msgs::BoolConstPtr &restart_msg)
             imu_buf.pop();
         m_buf.unlock();
         m_estimator.lock();
-        estimator.clearState();
-        estimator.setParameter();
+        estimator->clearState();
+        estimator->setParameter();
+        imu_averager.reset();
         m_estimator.unlock();
         current_time = -1;
         last_imu_t = 0;
@@ -255,19 +276,84 @@ void relocalization_callback(const sensor_msgs::PointCloudConstPtr &points_msg)
     m_buf.unlock();
 }
 
+/**
+ * @brief 前端消息直接转成估计器的输入，按特征点id排序，和原来用map时的遍历顺序一致
+ * 
+ * @param[in] img_msg 前端的特征点消息
+ * @param[out] image 估计器的输入，每帧复用同一块内存
+ */
+void featureMsgToImage(const feature_tracker::FeatureFrameConstPtr &img_msg, ImageFeatures &image)
+{
+    int n = img_msg->id.size();
+    ROS_ASSERT((int)img_msg->camera_id.size() == n && (int)img_msg->un_pts.size() == 2 * n &&
+               (int)img_msg->pts.size() == 2 * n && (int)img_msg->velocity.size() == 2 * n);
+    image.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        FeatureObservation &obs = image[i];
+        obs.feature_id = img_msg->id[i];
+        obs.camera_id = img_msg->camera_id[i];
+        // 去畸变后归一化坐标，像素坐标，速度
+        obs.xyz_uv_velocity << img_msg->un_pts[2 * i], img_msg->un_pts[2 * i + 1], 1,
+                               img_msg->pts[2 * i], img_msg->pts[2 * i + 1],
+                               img_msg->velocity[2 * i], img_msg->velocity[2 * i + 1];
+    }
+    std::sort(image.begin(), image.end(), [](const FeatureObservation &a, const FeatureObservation &b)
+              { return a.feature_id < b.feature_id || (a.feature_id == b.feature_id && a.camera_id < b.camera_id); });
+}
+
+// 一些打印以及topic的发送，滑窗大小是编译期常量
+template <int WINDOW_SIZE>
+void publishResults(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header, double whole_t, bool relocalized)
+{
+    printStatistics(estimator, whole_t);
+    pubMarginalizationTime(estimator);
+    pubOdometry(estimator, header);
+    pubKeyPoses(estimator, header);
+    pubCameraPose(estimator, header);
+    pubPointCloud(estimator, header);
+    pubTF(estimator, header);
+    pubKeyframe(estimator);
+    if (relocalized)
+        pubRelocalization(estimator);
+}
+
+// 按估计器实际的滑窗大小转成对应的实例再发布
+void publishResults(const EstimatorBase &estimator, const std_msgs::Header &header, double whole_t, bool relocalized)
+{
+    switch (estimator.window_size)
+    {
+    case 5:
+        publishResults<5>(static_cast<const Estimator<5> &>(estimator), header, whole_t, relocalized);
+        break;
+    case 10:
+        publishResults<10>(static_cast<const Estimator<10> &>(estimator), header, whole_t, relocalized);
+        break;
+    case 15:
+        publishResults<15>(static_cast<const Estimator<15> &>(estimator), header, whole_t, relocalized);
+        break;
+    case 20:
+        publishResults<20>(static_cast<const Estimator<20> &>(estimator), header, whole_t, relocalized);
+        break;
+    }
+}
+
 // thread: visual-inertial odometry
 void process()
 {
-    while (true)    // 这个线程是会一直循环下去
+    ImageFeatures image;    // 前端一帧的特征点，放在循环外每帧复用内存
+    while (true)    // 一直循环到shutdownNode()
     {
-        std::vector<std::pair<std::vector<sensor_msgs::ImuConstPtr>, sensor_msgs::PointCloudConstPtr>> measurements;
+        std::vector<std::pair<std::vector<sensor_msgs::ImuConstPtr>, feature_tracker::FeatureFrameConstPtr>> measurements;
         std::unique_lock<std::mutex> lk(m_buf);
 
         // Step 1 等待Imu和图像对齐的数据
         con.wait(lk, [&]
                  {
-            return (measurements = getMeasurements()).size() != 0;
+            return shutdown_process || (measurements = getMeasurements()).size() != 0;
                  });   // 后面是一个启动标志
+        if (shutdown_process)
+            break;
         lk.unlock();    // 数据buffer的锁解锁，回调可以继续塞数据了
 
         m_estimator.lock(); // 进行后端求解，不能和复位重启冲突
@@ -280,7 +366,7 @@ void process()
             for (auto &imu_msg : measurement.first)
             {
                 double t = imu_msg->header.stamp.toSec();
-                double img_t = img_msg->header.stamp.toSec() + estimator.td;  // 加了一个延时
+                double img_t = img_msg->header.stamp.toSec() + estimator->td;  // 加了一个延时
                 if (t <= img_t)
                 { 
                     if (current_time < 0)
@@ -295,7 +381,7 @@ void process()
                     ry = imu_msg->angular_velocity.y;
                     rz = imu_msg->angular_velocity.z;
                     // 时间差和imu数据送进去
-                    estimator.processIMU(dt, Vector3d(dx, dy, dz), Vector3d(rx, ry, rz));
+                    processRawImu(dt, Vector3d(dx, dy, dz), Vector3d(rx, ry, rz));
                     //printf("imu: dt:%f a: %f %f %f w: %f %f %f\n",dt, dx, dy, dz, rx, ry, rz);
 
                 }
@@ -315,10 +401,14 @@ void process()
                     rx = w1 * rx + w2 * imu_msg->angular_velocity.x;
                     ry = w1 * ry + w2 * imu_msg->angular_velocity.y;
                     rz = w1 * rz + w2 * imu_msg->angular_velocity.z;
-                    estimator.processIMU(dt_1, Vector3d(dx, dy, dz), Vector3d(rx, ry, rz));
+                    processRawImu(dt_1, Vector3d(dx, dy, dz), Vector3d(rx, ry, rz));
                     //printf("dimu: dt:%f a: %f %f %f w: %f %f %f\n",dt_1, dx, dy, dz, rx, ry, rz);
                 }
             }
+            // 图像时刻把没攒满的一段交出去
+            ImuPreaverager::Sample sample;
+            if (imu_averager.enabled() && imu_averager.flush(sample))
+                estimator->processIMU(sample.dt, sample.acc, sample.gyr, sample.count);
             
             // set relocalization frame
             // 回环相关部分
@@ -346,66 +436,49 @@ void process()
                 Matrix3d relo_r = relo_q.toRotationMatrix();
                 int frame_index;
                 frame_index = relo_msg->channels[0].values[7];
-                estimator.setReloFrame(frame_stamp, frame_index, match_points, relo_t, relo_r);
+                estimator->setReloFrame(frame_stamp, frame_index, match_points, relo_t, relo_r);
             }
 
             ROS_DEBUG("processing vision data with stamp %f \n", img_msg->header.stamp.toSec());
 
             TicToc t_s;
-            // 特征点id->特征点信息
-            map<int, vector<pair<int, Eigen::Matrix<double, 7, 1>>>> image;
-            for (unsigned int i = 0; i < img_msg->points.size(); i++)
-            {
-                int v = img_msg->channels[0].values[i] + 0.5;
-                int feature_id = v / NUM_OF_CAM;
-                int camera_id = v % NUM_OF_CAM;
-                double x = img_msg->points[i].x;    // 去畸变后归一滑像素坐标
-                double y = img_msg->points[i].y;
-                double z = img_msg->points[i].z;
-                double p_u = img_msg->channels[1].values[i];    // 特征点像素坐标
-                double p_v = img_msg->channels[2].values[i];
-                double velocity_x = img_msg->channels[3].values[i]; // 特征点速度
-                double velocity_y = img_msg->channels[4].values[i];
-                ROS_ASSERT(z == 1); // 检查是不是归一化
-                Eigen::Matrix<double, 7, 1> xyz_uv_velocity;
-                xyz_uv_velocity << x, y, z, p_u, p_v, velocity_x, velocity_y;
-                image[feature_id].emplace_back(camera_id,  xyz_uv_velocity);
-            }
-            estimator.processImage(image, img_msg->header);
+            featureMsgToImage(img_msg, image);
+            estimator->processImage(image, img_msg->header);
 
             // 一些打印以及topic的发送
             double whole_t = t_s.toc();
-            printStatistics(estimator, whole_t);
             std_msgs::Header header = img_msg->header;
             header.frame_id = "world";
-
-            pubOdometry(estimator, header);
-            pubKeyPoses(estimator, header);
-            pubCameraPose(estimator, header);
-            pubPointCloud(estimator, header);
-            pubTF(estimator, header);
-            pubKeyframe(estimator);
-            if (relo_msg != NULL)
-                pubRelocalization(estimator);
+            publishResults(*estimator, header, whole_t, relo_msg != NULL);
             //ROS_ERROR("end: %f, at %f", img_msg->header.stamp.toSec(), ros::Time::now().toSec());
         }
         m_estimator.unlock();
         m_buf.lock();
         m_state.lock();
-        if (estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR)
+        if (estimator->solver_flag == EstimatorBase::SolverFlag::NON_LINEAR)
             update();
         m_state.unlock();
         m_buf.unlock();
     }
 }
 
-int main(int argc, char **argv)
+/**
+ * @brief 读参数，注册publisher和subscriber，启动后端线程，节点和nodelet共用
+ * 
+ * @param[in] n 节点的私有句柄
+ */
+void setupNode(ros::NodeHandle &n)
 {
-    ros::init(argc, argv, "vins_estimator");
-    ros::NodeHandle n("~");
-    ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Info);  // 设置ros日志等级，screen输出等级不低于info
     readParameters(n);
-    estimator.setParameter();
+    estimator.reset(createEstimator(SLIDING_WINDOW_SIZE));
+    if (!estimator)
+    {
+        ROS_ERROR("window_size %d is not prebuilt (5, 10, 15, 20), use 10", SLIDING_WINDOW_SIZE);
+        SLIDING_WINDOW_SIZE = 10;
+        estimator.reset(createEstimator(SLIDING_WINDOW_SIZE));
+    }
+    estimator->setParameter();
+    imu_averager.setRate(IMU_AVERAGE_RATE);
 #ifdef EIGEN_DONT_PARALLELIZE
     ROS_DEBUG("EIGEN_DONT_PARALLELIZE");
 #endif
@@ -414,17 +487,47 @@ int main(int argc, char **argv)
     // 注册一些publisher
     registerPub(n);
     // 接受imu消息存buf，并发布里程计
-    ros::Subscriber sub_imu = n.subscribe(IMU_TOPIC, 2000, imu_callback, ros::TransportHints().tcpNoDelay());
+    sub_imu = n.subscribe(IMU_TOPIC, 2000, imu_callback, ros::TransportHints().tcpNoDelay());
     // 接受前端视觉光流结果存buf
-    ros::Subscriber sub_image = n.subscribe("/feature_tracker/feature", 2000, feature_callback);
+    sub_image = n.subscribe("/feature_tracker/feature", 2000, feature_callback);
     // 接受前端重启命令
-    ros::Subscriber sub_restart = n.subscribe("/feature_tracker/restart", 2000, restart_callback);
+    sub_restart = n.subscribe("/feature_tracker/restart", 2000, restart_callback);
     // 回环检测的fast relocalization响应
-    ros::Subscriber sub_relo_points = n.subscribe("/pose_graph/match_points", 2000, relocalization_callback);
+    sub_relo_points = n.subscribe("/pose_graph/match_points", 2000, relocalization_callback);
 
     // ! 核心处理线程，其实是一个imu数据和图片预处理
-    std::thread measurement_process{process};
+    shutdown_process = false;
+    measurement_process = std::thread(process);
+}
+
+/**
+ * @brief 停掉订阅并等后端线程处理完手上的一批数据后退出，nodelet卸载时必须在析构前调用
+ */
+void shutdownNode()
+{
+    sub_imu.shutdown();
+    sub_image.shutdown();
+    sub_restart.shutdown();
+    sub_relo_points.shutdown();
+    {
+        std::lock_guard<std::mutex> lk(m_buf);
+        shutdown_process = true;
+    }
+    con.notify_one();
+    if (measurement_process.joinable())
+        measurement_process.join();
+}
+
+#ifndef BUILD_NODELET
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, "vins_estimator");
+    ros::NodeHandle n("~");
+    ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Info);  // 设置ros日志等级，screen输出等级不低于info
+    setupNode(n);
     ros::spin();
+    shutdownNode();
 
     return 0;
 }
+#endif
@@ -0,0 +1,27 @@
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+void setupNode(ros::NodeHandle &n);
+void shutdownNode();
+
+namespace vins_estimator
+{
+// 和vins_estimator节点是同一份代码，后端线程在setupNode里启动
+class EstimatorNodelet : public nodelet::Nodelet
+{
+  public:
+    // 后端线程用的是这个库里的全局状态，卸载前要等它退出
+    virtual ~EstimatorNodelet()
+    {
+        shutdownNode();
+    }
+
+  private:
+    virtual void onInit()
+    {
+        setupNode(getPrivateNodeHandle());
+    }
+};
+}
+
+PLUGINLIB_EXPORT_CLASS(vins_estimator::EstimatorNodelet, nodelet::Nodelet)
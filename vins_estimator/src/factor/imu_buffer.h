@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cassert>
+#include <vector>
+#include <eigen3/Eigen/Dense>
+
+/**
+ * @brief 估计器里所有imu采样只存这一份，按全局递增的序号索引
+ *
+ * 预积分只记自己用到的序号区间[begin, end)，repropagate、滑窗时合并两段预积分都只是操作序号；
+ * 底层是容量为2的幂的环形数组，满了就翻倍，最老的采样在没有预积分再引用之后用release()丢掉
+ */
+class ImuBuffer
+{
+  public:
+    struct Sample
+    {
+        double dt;
+        Eigen::Vector3d acc, gyr;
+        int count;  // 预平均时这个采样由几个原始采样间隔合成，没有预平均是1
+    };
+
+    ImuBuffer() : head(0), tail(0), samples(256) {}
+
+    // 追加一个采样，返回它的序号
+    long push(double dt, const Eigen::Vector3d &acc, const Eigen::Vector3d &gyr, int count = 1)
+    {
+        if (tail - head == (long)samples.size())
+            grow();
+        Sample &s = samples[tail & mask()];
+        s.dt = dt;
+        s.acc = acc;
+        s.gyr = gyr;
+        s.count = count;
+        return tail++;
+    }
+
+    const Sample &at(long index) const
+    {
+        assert(index >= head && index < tail);
+        return samples[index & mask()];
+    }
+
+    // 最老的还在的采样序号和下一个要写入的序号
+    long begin() const
+    {
+        return head;
+    }
+
+    long end() const
+    {
+        return tail;
+    }
+
+    // 序号小于index的采样不再需要
+    void release(long index)
+    {
+        if (index > tail)
+            index = tail;
+        if (index > head)
+            head = index;
+    }
+
+    void clear()
+    {
+        head = tail = 0;
+    }
+
+  private:
+    long mask() const
+    {
+        return (long)samples.size() - 1;
+    }
+
+    void grow()
+    {
+        std::vector<Sample> larger(samples.size() * 2);
+        long larger_mask = (long)larger.size() - 1;
+        for (long i = head; i < tail; i++)
+            larger[i & larger_mask] = samples[i & mask()];
+        samples.swap(larger);
+    }
+
+    long head, tail;
+    std::vector<Sample> samples;
+};
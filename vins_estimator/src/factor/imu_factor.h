@@ -73,7 +73,9 @@ class IMUFactor : public ceres::SizedCostFunction<15, 7, 9, 7, 9>    // imu预
         residual = pre_integration->evaluate(Pi, Qi, Vi, Bai, Bgi,
                                             Pj, Qj, Vj, Baj, Bgj);
         // ! 因为ceres没有g2o设置信息矩阵的接口，因此置信度直接乘在残差上，这里通过LLT分解，相当于将信息矩阵开根号
-        Eigen::Matrix<double, 15, 15> sqrt_info = Eigen::LLT<Eigen::Matrix<double, 15, 15>>(pre_integration->covariance.inverse()).matrixL().transpose();
+        // 预积分结束后只算一次，缓存在IntegrationBase里
+        Eigen::Matrix<double, 15, 15> sqrt_info_scratch;
+        const Eigen::Matrix<double, 15, 15> &sqrt_info = pre_integration->sqrtInfo(sqrt_info_scratch);
         //sqrt_info.setIdentity();
         // 这就是带有信息矩阵的残差
         residual = sqrt_info * residual;   // 应为eT * P * e，如果没有P则证明完全置信，先将P进行LLT分解得，eT * L * LT * e，则新的残差为LT * e
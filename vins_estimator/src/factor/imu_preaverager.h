@@ -0,0 +1,104 @@
+#pragma once
+
+#include <eigen3/Eigen/Dense>
+
+/**
+ * @brief 高频imu的预平均：原始采样按固定时长分段，每段积出带圆锥/划桨补偿的角增量和速度增量，
+ * 再换算成这一段的等效常值角速度和加速度交给预积分
+ *
+ * 预积分和repropagate都只处理压缩后的采样，1kHz的imu按200Hz分段，中值积分的步数和缓存都降到1/5；
+ * 等效采样在段内按常值积分，count记下合成了几个原始采样，预积分按它缩小每一步的噪声（见IntegrationBase::propagate），
+ * 所以acc_n/gyr_n还是按原始imu给
+ */
+class ImuPreaverager
+{
+  public:
+    struct Sample
+    {
+        double dt;
+        Eigen::Vector3d acc, gyr;
+        int count;  // 这一段包含的原始采样间隔数
+    };
+
+    ImuPreaverager() : interval(0)
+    {
+        reset();
+    }
+
+    // rate <= 0时不分段，原始采样直接交给预积分
+    void setRate(double rate)
+    {
+        interval = rate > 0 ? 1.0 / rate : 0;
+    }
+
+    bool enabled() const
+    {
+        return interval > 0;
+    }
+
+    void reset()
+    {
+        first = true;
+        clearInterval();
+    }
+
+    /**
+     * @brief 输入一个原始采样，dt是和上一个采样的时间差，这一段攒满时返回true，结果在out里
+     */
+    bool push(double dt, const Eigen::Vector3d &acc, const Eigen::Vector3d &gyr, Sample &out)
+    {
+        if (first)
+        {
+            last_acc = acc;
+            last_gyr = gyr;
+            first = false;
+        }
+        // 相邻两个采样之间按梯形积分
+        Eigen::Vector3d alpha = 0.5 * (last_gyr + gyr) * dt;
+        Eigen::Vector3d v = 0.5 * (last_acc + acc) * dt;
+        // 划桨：这一步的速度增量转到这一段起点的机体系下再累加
+        dv += v + (dtheta + 0.5 * alpha).cross(v);
+        // 圆锥：转动不对易带来的二阶项
+        dtheta += alpha + 0.5 * dtheta.cross(alpha);
+        t += dt;
+        n++;
+        last_acc = acc;
+        last_gyr = gyr;
+        // 离段尾不到半个采样就交出去，避免dt累加的舍入误差多拖一个采样
+        if (t + 0.5 * dt < interval)
+            return false;
+        return flush(out);
+    }
+
+    /**
+     * @brief 把没攒满的一段也交出去，图像时刻调用，保证预积分区间正好停在图像时刻
+     */
+    bool flush(Sample &out)
+    {
+        if (t <= 0)
+            return false;
+        out.dt = t;
+        out.count = n;
+        out.gyr = dtheta / t;
+        // 预积分用段首和段尾姿态的平均去转加速度，相当于段中点的姿态，这里把速度增量从段首转到段中点
+        out.acc = (dv - 0.5 * dtheta.cross(dv)) / t;
+        clearInterval();
+        return true;
+    }
+
+  private:
+    void clearInterval()
+    {
+        t = 0;
+        n = 0;
+        dtheta.setZero();
+        dv.setZero();
+    }
+
+    double interval;
+    bool first;
+    double t;   // 当前段已经积了多长时间
+    int n;      // 当前段已经积了几个原始采样间隔
+    Eigen::Vector3d dtheta, dv;
+    Eigen::Vector3d last_acc, last_gyr;
+};
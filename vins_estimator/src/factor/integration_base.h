@@ -2,6 +2,7 @@
 
 #include "../utility/utility.h"
 #include "../parameters.h"
+#include "imu_buffer.h"
 
 #include <ceres/ceres.h>
 using namespace Eigen;
@@ -10,6 +11,29 @@ using namespace Eigen;
 // ! 前向积分-中值积分；协方差和雅克比更新
 class IntegrationBase
 {
+    // 中值积分一步的状态转移矩阵F，只存非零且不是单位阵的块（行块/列块按O_P、O_R、O_V、O_BA、O_BG排）：
+    //     | I  F01 I*dt F03 F04   |
+    //     | 0  F11 0    0   -I*dt |
+    // F = | 0  F21 I    F23 F24   |
+    //     | 0  0   0    I   0     |
+    //     | 0  0   0    0   I     |
+    struct StepTransition
+    {
+        Eigen::Matrix3d F01, F03, F04, F11, F21, F23, F24;
+        double dt;
+
+        // out = F * M，out不能和M是同一个矩阵
+        void leftMultiply(const Eigen::Matrix<double, 15, 15> &M, Eigen::Matrix<double, 15, 15> &out) const
+        {
+            out.middleRows<3>(0) = M.middleRows<3>(0) + F01 * M.middleRows<3>(3) + dt * M.middleRows<3>(6) +
+                                   F03 * M.middleRows<3>(9) + F04 * M.middleRows<3>(12);
+            out.middleRows<3>(3) = F11 * M.middleRows<3>(3) - dt * M.middleRows<3>(12);
+            out.middleRows<3>(6) = F21 * M.middleRows<3>(3) + M.middleRows<3>(6) +
+                                   F23 * M.middleRows<3>(9) + F24 * M.middleRows<3>(12);
+            out.bottomRows<6>() = M.bottomRows<6>();
+        }
+    };
+
   public:
     IntegrationBase() = delete;
 
@@ -18,12 +42,15 @@ class IntegrationBase
     // 雅克比赋值单位阵，15X15，其实只需要维护delta_p(alpha)(3)、delta_v(beta)(3)、delta_q(gamma)(3)(旋转向量形式)对两个零偏(6)的雅克比(导数)，但是这里直接维护15X15，一开始谁也与谁无关，所以初始化为单位阵
     // 协方差初始化为零矩阵，delta_p和delta_v初始化为0，delta_q初始化为单位四元数
     // 噪声noise 18X18，通过yaml来初始化，关于上一时刻加速度计(3)、陀螺仪噪声(3)，下一时刻加速度计(3)、陀螺仪噪声(3)，两个零偏噪声(6)(随机游走)
+    // imu采样不拷贝，只记在_buffer里的序号区间，从_buffer当前的末尾开始
     IntegrationBase(const Eigen::Vector3d &_acc_0, const Eigen::Vector3d &_gyr_0,
-                    const Eigen::Vector3d &_linearized_ba, const Eigen::Vector3d &_linearized_bg)
-        : acc_0{_acc_0}, gyr_0{_gyr_0}, linearized_acc{_acc_0}, linearized_gyr{_gyr_0},
+                    const Eigen::Vector3d &_linearized_ba, const Eigen::Vector3d &_linearized_bg,
+                    const ImuBuffer *_buffer)
+        : buffer{_buffer}, begin_index{_buffer->end()}, end_index{_buffer->end()},
+          acc_0{_acc_0}, gyr_0{_gyr_0}, linearized_acc{_acc_0}, linearized_gyr{_gyr_0},
           linearized_ba{_linearized_ba}, linearized_bg{_linearized_bg},
             jacobian{Eigen::Matrix<double, 15, 15>::Identity()}, covariance{Eigen::Matrix<double, 15, 15>::Zero()},
-          sum_dt{0.0}, delta_p{Eigen::Vector3d::Zero()}, delta_q{Eigen::Quaterniond::Identity()}, delta_v{Eigen::Vector3d::Zero()}
+          sqrt_info_valid{false}, noise_scale{1.0}, sum_dt{0.0}, delta_p{Eigen::Vector3d::Zero()}, delta_q{Eigen::Quaterniond::Identity()}, delta_v{Eigen::Vector3d::Zero()}
 
     {
         noise = Eigen::Matrix<double, 18, 18>::Zero();
@@ -35,14 +62,15 @@ class IntegrationBase
         noise.block<3, 3>(15, 15) =  (GYR_W * GYR_W) * Eigen::Matrix3d::Identity();
     }
 
-    //  ! 来一帧新的imu数据，存储时间、加速度计读数、陀螺仪读数，并且同时已经完成了Imu的预积分工作
-    void push_back(double dt, const Eigen::Vector3d &acc, const Eigen::Vector3d &gyr)
+    //  ! 把buffer里序号在end之前、还没积过的imu数据积进来，区间往后延长
+    // 序号区间留着，方便后续repropagate，重新传播发生在vio初始化当中
+    void extend(long end)
     {
-        // 相关时间差和传感器数据保留，方便后续repropagate，重新传播发生在vio初始化当中
-        dt_buf.push_back(dt);
-        acc_buf.push_back(acc);
-        gyr_buf.push_back(gyr);
-        propagate(dt, acc, gyr);   // ! 最基本的一次预积分
+        for (; end_index < end; end_index++)
+        {
+            const ImuBuffer::Sample &s = buffer->at(end_index);
+            propagate(s.dt, s.acc, s.gyr, s.count);   // ! 最基本的一次预积分
+        }
     }
 
     /**
@@ -65,9 +93,12 @@ class IntegrationBase
         linearized_bg = _linearized_bg;
         jacobian.setIdentity();
         covariance.setZero();
-        // 用之前存下来的imu值重新预积分
-        for (int i = 0; i < static_cast<int>(dt_buf.size()); i++)
-            propagate(dt_buf[i], acc_buf[i], gyr_buf[i]);
+        // 用区间里的imu值重新预积分
+        for (long i = begin_index; i < end_index; i++)
+        {
+            const ImuBuffer::Sample &s = buffer->at(i);
+            propagate(s.dt, s.acc, s.gyr, s.count);
+        }
     }
 
     // ! main
@@ -114,51 +145,72 @@ class IntegrationBase
                 a_1_x(2), 0, -a_1_x(0),
                 -a_1_x(1), a_1_x(0), 0;
 
-            // F矩阵的填充
-            MatrixXd F = MatrixXd::Zero(15, 15);
-            F.block<3, 3>(0, 0) = Matrix3d::Identity();
-            F.block<3, 3>(0, 3) = -0.25 * delta_q.toRotationMatrix() * R_a_0_x * _dt * _dt + 
-                                  -0.25 * result_delta_q.toRotationMatrix() * R_a_1_x * (Matrix3d::Identity() - R_w_x * _dt) * _dt * _dt;
-            F.block<3, 3>(0, 6) = MatrixXd::Identity(3,3) * _dt;
-            F.block<3, 3>(0, 9) = -0.25 * (delta_q.toRotationMatrix() + result_delta_q.toRotationMatrix()) * _dt * _dt;
-            F.block<3, 3>(0, 12) = -0.25 * result_delta_q.toRotationMatrix() * R_a_1_x * _dt * _dt * -_dt;
-            F.block<3, 3>(3, 3) = Matrix3d::Identity() - R_w_x * _dt;
-            F.block<3, 3>(3, 12) = -1.0 * MatrixXd::Identity(3,3) * _dt;
-            F.block<3, 3>(6, 3) = -0.5 * delta_q.toRotationMatrix() * R_a_0_x * _dt + 
-                                  -0.5 * result_delta_q.toRotationMatrix() * R_a_1_x * (Matrix3d::Identity() - R_w_x * _dt) * _dt;
-            F.block<3, 3>(6, 6) = Matrix3d::Identity();
-            F.block<3, 3>(6, 9) = -0.5 * (delta_q.toRotationMatrix() + result_delta_q.toRotationMatrix()) * _dt;
-            F.block<3, 3>(6, 12) = -0.5 * result_delta_q.toRotationMatrix() * R_a_1_x * _dt * -_dt;
-            F.block<3, 3>(9, 9) = Matrix3d::Identity();
-            F.block<3, 3>(12, 12) = Matrix3d::Identity();
+            // F矩阵的填充，只存非零且不是单位阵的3x3块
+            Matrix3d R0 = delta_q.toRotationMatrix(), R1 = result_delta_q.toRotationMatrix();
+            Matrix3d R_w_dt = Matrix3d::Identity() - R_w_x * _dt;
+            StepTransition F;
+            F.dt = _dt;
+            F.F01 = -0.25 * R0 * R_a_0_x * _dt * _dt + -0.25 * R1 * R_a_1_x * R_w_dt * _dt * _dt;
+            F.F03 = -0.25 * (R0 + R1) * _dt * _dt;
+            F.F04 = -0.25 * R1 * R_a_1_x * _dt * _dt * -_dt;
+            F.F11 = R_w_dt;
+            F.F21 = -0.5 * R0 * R_a_0_x * _dt + -0.5 * R1 * R_a_1_x * R_w_dt * _dt;
+            F.F23 = -0.5 * (R0 + R1) * _dt;
+            F.F24 = -0.5 * R1 * R_a_1_x * _dt * -_dt;
             //cout<<"A"<<endl<<A<<endl;
 
-            // V矩阵的填充，与之前的推导相差个负号，但是对白噪声来讲毫无影响
-            MatrixXd V = MatrixXd::Zero(15,18);
-            V.block<3, 3>(0, 0) =  0.25 * delta_q.toRotationMatrix() * _dt * _dt;
-            V.block<3, 3>(0, 3) =  0.25 * -result_delta_q.toRotationMatrix() * R_a_1_x  * _dt * _dt * 0.5 * _dt;
-            V.block<3, 3>(0, 6) =  0.25 * result_delta_q.toRotationMatrix() * _dt * _dt;
-            V.block<3, 3>(0, 9) =  V.block<3, 3>(0, 3);
-            V.block<3, 3>(3, 3) =  0.5 * MatrixXd::Identity(3,3) * _dt;
-            V.block<3, 3>(3, 9) =  0.5 * MatrixXd::Identity(3,3) * _dt;
-            V.block<3, 3>(6, 0) =  0.5 * delta_q.toRotationMatrix() * _dt;
-            V.block<3, 3>(6, 3) =  0.5 * -result_delta_q.toRotationMatrix() * R_a_1_x  * _dt * 0.5 * _dt;
-            V.block<3, 3>(6, 6) =  0.5 * result_delta_q.toRotationMatrix() * _dt;
-            V.block<3, 3>(6, 9) =  V.block<3, 3>(6, 3);
-            V.block<3, 3>(9, 12) = MatrixXd::Identity(3,3) * _dt;
-            V.block<3, 3>(12, 15) = MatrixXd::Identity(3,3) * _dt;
+            // V矩阵的非零块，与之前的推导相差个负号，但是对白噪声来讲毫无影响
+            // V的第3行块是0.5 * dt * I（对应两个陀螺仪噪声），第9、12行块是dt * I（零偏随机游走）
+            Matrix3d V00 = 0.25 * R0 * _dt * _dt;
+            Matrix3d V01 = 0.25 * -R1 * R_a_1_x * _dt * _dt * 0.5 * _dt;   // 也是V03
+            Matrix3d V02 = 0.25 * R1 * _dt * _dt;
+            Matrix3d V20 = 0.5 * R0 * _dt;
+            Matrix3d V21 = 0.5 * -R1 * R_a_1_x * _dt * 0.5 * _dt;   // 也是V23
+            Matrix3d V22 = 0.5 * R1 * _dt;
 
             // Step 3 更新雅克比和协方差
-            //step_jacobian = F;
-            //step_V = V;
-            jacobian = F * jacobian;  // 用于bias更新后的补偿
-            covariance = F * covariance * F.transpose() + V * noise * V.transpose();   // 基于高斯分布的协方差更新
+            // jacobian = F * jacobian，covariance = F * covariance * F^T + V * noise * V^T
+            Eigen::Matrix<double, 15, 15> FP, FPt;
+            F.leftMultiply(jacobian, FP);
+            jacobian = FP;  // 用于bias更新后的补偿
+            F.leftMultiply(covariance, FP);
+            FPt = FP.transpose();
+            F.leftMultiply(FPt, covariance);    // F * (F * P)^T = F * P * F^T
+
+            // noise每个3x3块都是标量乘单位阵，V * noise * V^T直接按块展开
+            // 每一步加的噪声都和dt^2成正比，N个原始采样平均成一个时只加N步噪声的总和，即乘1/N，见propagate()
+            double na0 = noise_scale * noise(0, 0), ng0 = noise_scale * noise(3, 3);
+            double na1 = noise_scale * noise(6, 6), ng1 = noise_scale * noise(9, 9);
+            double ng = ng0 + ng1;
+            Matrix3d Q_pv = na0 * V00 * V20.transpose() + ng * V01 * V21.transpose() + na1 * V02 * V22.transpose();
+            Matrix3d Q_pq = ng * 0.5 * _dt * V01;
+            Matrix3d Q_qv = ng * 0.5 * _dt * V21.transpose();
+            covariance.block<3, 3>(0, 0) += na0 * V00 * V00.transpose() + ng * V01 * V01.transpose() + na1 * V02 * V02.transpose();
+            covariance.block<3, 3>(0, 3) += Q_pq;
+            covariance.block<3, 3>(3, 0) += Q_pq.transpose();
+            covariance.block<3, 3>(0, 6) += Q_pv;
+            covariance.block<3, 3>(6, 0) += Q_pv.transpose();
+            covariance.block<3, 3>(3, 3) += ng * 0.25 * _dt * _dt * Matrix3d::Identity();
+            covariance.block<3, 3>(3, 6) += Q_qv;
+            covariance.block<3, 3>(6, 3) += Q_qv.transpose();
+            covariance.block<3, 3>(6, 6) += na0 * V20 * V20.transpose() + ng * V21 * V21.transpose() + na1 * V22 * V22.transpose();
+            covariance.block<3, 3>(9, 9) += noise_scale * noise(12, 12) * _dt * _dt * Matrix3d::Identity();
+            covariance.block<3, 3>(12, 12) += noise_scale * noise(15, 15) * _dt * _dt * Matrix3d::Identity();
         }
 
     }
 
-    void propagate(double _dt, const Eigen::Vector3d &_acc_1, const Eigen::Vector3d &_gyr_1)
+    // count是这个采样合成的原始采样数，acc_n/gyr_n等噪声参数按原始采样给出
+    void propagate(double _dt, const Eigen::Vector3d &_acc_1, const Eigen::Vector3d &_gyr_1, int count = 1)
     {
+        sqrt_info_valid = false;    // 协方差要变了
+        noise_scale = 1.0 / count;
+        // 预平均后的采样代表整段的平均值，段内按常值积分，不和上一个采样取中值
+        if (IMU_AVERAGE_RATE > 0)
+        {
+            acc_0 = _acc_1;
+            gyr_0 = _gyr_1;
+        }
         dt = _dt;
         acc_1 = _acc_1;
         gyr_1 = _gyr_1;
@@ -191,6 +243,28 @@ class IntegrationBase
      
     }
 
+    /**
+     * @brief 预积分结束后缓存信息矩阵的平方根，ceres每次迭代不用再对15x15的协方差求逆和LLT
+     * 
+     * 只在估计器线程里、优化开始前调用；新的imu数据或者repropagate会让缓存失效
+     */
+    void updateSqrtInfo()
+    {
+        if (sqrt_info_valid)
+            return;
+        sqrt_info = Eigen::LLT<Eigen::Matrix<double, 15, 15>>(covariance.inverse()).matrixL().transpose();
+        sqrt_info_valid = true;
+    }
+
+    // 缓存失效时现算一份放在scratch里，不改成员，ceres多线程调Evaluate时也是安全的
+    const Eigen::Matrix<double, 15, 15> &sqrtInfo(Eigen::Matrix<double, 15, 15> &scratch) const
+    {
+        if (sqrt_info_valid)
+            return sqrt_info;
+        scratch = Eigen::LLT<Eigen::Matrix<double, 15, 15>>(covariance.inverse()).matrixL().transpose();
+        return scratch;
+    }
+
     // ! imu计算和给定相邻帧状态量的残差，作为帧间约束；这里将残差和ESKF联系起来了？
     // ! 这里所有的入参是imu和视觉重投影的整体优化值，如果系统最优应该是与单纯的imu预积分值接近，即前后两者残差为0
     Eigen::Matrix<double, 15, 1> evaluate(const Eigen::Vector3d &Pi, const Eigen::Quaterniond &Qi, const Eigen::Vector3d &Vi, const Eigen::Vector3d &Bai, const Eigen::Vector3d &Bgi,
@@ -221,6 +295,9 @@ class IntegrationBase
         return residuals;
     }
 
+    const ImuBuffer *buffer;
+    long begin_index, end_index;    // 用到的imu采样在buffer里的序号区间[begin_index, end_index)
+
     double dt;
     Eigen::Vector3d acc_0, gyr_0;
     Eigen::Vector3d acc_1, gyr_1;
@@ -229,19 +306,18 @@ class IntegrationBase
     Eigen::Vector3d linearized_ba, linearized_bg;
 
     Eigen::Matrix<double, 15, 15> jacobian, covariance;
+    Eigen::Matrix<double, 15, 15> sqrt_info;    // 信息矩阵的LLT分解，updateSqrtInfo()里算
+    bool sqrt_info_valid;
     Eigen::Matrix<double, 15, 15> step_jacobian;
     Eigen::Matrix<double, 15, 18> step_V;
     Eigen::Matrix<double, 18, 18> noise;
+    double noise_scale;     // 当前这一步的噪声缩放，propagate()里按采样的count设置
 
     double sum_dt;
     Eigen::Vector3d delta_p;
     Eigen::Quaterniond delta_q;
     Eigen::Vector3d delta_v;
 
-    std::vector<double> dt_buf;
-    std::vector<Eigen::Vector3d> acc_buf;
-    std::vector<Eigen::Vector3d> gyr_buf;
-
 };
 
 //     void eulerIntegration(double _dt, const Eigen::Vector3d &_acc_0, const Eigen::Vector3d &_gyr_0,
@@ -1,25 +1,41 @@
 #include "marginalization_factor.h"
 
+WorkerPool &estimatorPool()
+{
+    static WorkerPool pool(NUM_THREADS - 1);
+    return pool;
+}
+
 /**
- * @brief 待边缘化的各个残差块计算残差和雅克比矩阵，同时处理核函数的case
+ * @brief 从arena里给残差和雅克比分配内存，Evaluate()里不再申请内存
  * 
+ * @param[in] arena 
  */
-void ResidualBlockInfo::Evaluate()
+void ResidualBlockInfo::allocate(FrameArena &arena)
 {
-    residuals.resize(cost_function->num_residuals());   // 确定残差的维数
+    int num_residuals = cost_function->num_residuals();   // 确定残差的维数
+    new (&residuals) Eigen::Map<Eigen::VectorXd>(arena.allocateArray<double>(num_residuals), num_residuals);
 
-    std::vector<int> block_sizes = cost_function->parameter_block_sizes();  // 确定相关的参数块数目
-    raw_jacobians = new double *[block_sizes.size()];   // ceres接口都是double数组，因此这里给雅克比准备数组，这里相当于new了一个二维数组
-    jacobians.resize(block_sizes.size());
+    const std::vector<int> &block_sizes = cost_function->parameter_block_sizes();  // 确定相关的参数块数目
+    raw_jacobians = arena.allocateArray<double *>(block_sizes.size());   // ceres接口都是double数组，因此这里给雅克比准备数组，相当于一个二维数组
+    jacobians = static_cast<JacobianMap *>(arena.allocate(sizeof(JacobianMap) * block_sizes.size()));
+    row_begin = arena.allocateArray<int>(block_sizes.size());
+    row_end = arena.allocateArray<int>(block_sizes.size());
 
     // 这里就是把jacobians每个matrix地址赋给raw_jacobians，然后把raw_jacobians传递给ceres的接口，这样计算结果直接放进了这个matrix
     for (int i = 0; i < static_cast<int>(block_sizes.size()); i++)
     {
-        jacobians[i].resize(cost_function->num_residuals(), block_sizes[i]);    // 雅克比矩阵大小 残差×变量
-        raw_jacobians[i] = jacobians[i].data();
-        //dim += block_sizes[i] == 7 ? 6 : block_sizes[i];
+        raw_jacobians[i] = arena.allocateArray<double>(num_residuals * block_sizes[i]);
+        new (&jacobians[i]) JacobianMap(raw_jacobians[i], num_residuals, block_sizes[i]);    // 雅克比矩阵大小 残差×变量
     }
+}
 
+/**
+ * @brief 待边缘化的各个残差块计算残差和雅克比矩阵，同时处理核函数的case
+ * 
+ */
+void ResidualBlockInfo::Evaluate()
+{
     // 调用各自重载的接口计算残差和雅克比，为什么说各自？因为在ResidualBlockInfo的构造函数里第一个入参是cost_function，会有一个Evaluate()的重载
     cost_function->Evaluate(parameter_blocks.data(), residuals.data(), raw_jacobians);  // 这里实际上结果放在了jacobians，因为前面是指针传递
 
@@ -73,24 +89,26 @@ void ResidualBlockInfo::Evaluate()
 
         residuals *= residual_scaling_;
     }
+
+    // 去掉雅克比首尾的全零行，构造H时只乘两个参数块非零行的交集
+    for (int i = 0; i < static_cast<int>(parameter_blocks.size()); i++)
+    {
+        int r0 = 0, r1 = jacobians[i].rows();
+        while (r0 < r1 && jacobians[i].row(r0).isZero(0))
+            r0++;
+        while (r1 > r0 && jacobians[i].row(r1 - 1).isZero(0))
+            r1--;
+        row_begin[i] = r0;
+        row_end[i] = r1;
+    }
 }
 
 MarginalizationInfo::~MarginalizationInfo()
 {
     //ROS_WARN("release marginlizationinfo");
-    
-    for (auto it = parameter_block_data.begin(); it != parameter_block_data.end(); ++it)
-        delete[] it->second;
-
-    for (int i = 0; i < (int)factors.size(); i++)
-    {
-
-        delete[] factors[i]->raw_jacobians;  // 因为raw_jacobians在Evaluate()里new了
-        
-        delete factors[i]->cost_function;
-
-        delete factors[i];
-    }
+    // 因子、ResidualBlockInfo、雅克比和参数块备份都在arena里，整块释放
+    ROS_DEBUG("release marginalization arena %lu bytes", arena.bytes());
+    arena.clear();
 }
 
 /**
@@ -101,9 +119,10 @@ MarginalizationInfo::~MarginalizationInfo()
 void MarginalizationInfo::addResidualBlockInfo(ResidualBlockInfo *residual_block_info)
 {
     factors.emplace_back(residual_block_info);  // 残差块收集起来
+    residual_block_info->allocate(arena);
 
     std::vector<double *> &parameter_blocks = residual_block_info->parameter_blocks;    // 这个是和该约束相关的参数块
-    std::vector<int> parameter_block_sizes = residual_block_info->cost_function->parameter_block_sizes();   // 各个参数块的大小
+    const std::vector<int> &parameter_block_sizes = residual_block_info->cost_function->parameter_block_sizes();   // 各个参数块的大小
 
     for (int i = 0; i < static_cast<int>(residual_block_info->parameter_blocks.size()); i++)
     {
@@ -127,11 +146,20 @@ void MarginalizationInfo::addResidualBlockInfo(ResidualBlockInfo *residual_block
  */
 void MarginalizationInfo::preMarginalize()
 {
-    for (auto it : factors)
+    // 各个残差块只写自己的残差和雅克比（内存在addResidualBlockInfo里分好了），并行算和串行结果完全一样
+    const int chunk = 16;
+    int num_factors = factors.size();
+    estimatorPool().run((num_factors + chunk - 1) / chunk, [&](int c)
     {
-        it->Evaluate(); // 调用这个接口计算各个残差块的残差和雅克比矩阵
+        int end = std::min(num_factors, (c + 1) * chunk);
+        for (int i = c * chunk; i < end; i++)
+            factors[i]->Evaluate(); // 调用这个接口计算各个残差块的残差和雅克比矩阵
+    });
 
-        std::vector<int> block_sizes = it->cost_function->parameter_block_sizes();  // 得到每个残差块的参数块大小
+    // 备份参数块要往arena和map里写，串行做
+    for (auto it : factors)
+    {
+        const std::vector<int> &block_sizes = it->cost_function->parameter_block_sizes();  // 得到每个残差块的参数块大小
         for (int i = 0; i < static_cast<int>(block_sizes.size()); i++)
         {
             long addr = reinterpret_cast<long>(it->parameter_blocks[i]);    // 得到该参数块的地址
@@ -139,7 +167,7 @@ void MarginalizationInfo::preMarginalize()
             // 把各个参数块都备份起来，使用map避免重复参数块，之所以备份，是为了后面的状态保留
             if (parameter_block_data.find(addr) == parameter_block_data.end())
             {
-                double *data = new double[size];
+                double *data = arena.allocateArray<double>(size);
                 // 深拷贝
                 memcpy(data, it->parameter_blocks[i], sizeof(double) * size);
                 parameter_block_data[addr] = data;  // 地址->参数块实际内容的地址
@@ -158,53 +186,286 @@ int MarginalizationInfo::globalSize(int size) const
     return size == 6 ? 7 : size;
 }
 
+// 雅克比里某个参数块对应的列，行优先存放；只有一列时Eigen要求用列优先，跨步就是整行的长度
+template <int S>
+struct JacobianCols
+{
+    typedef Eigen::Matrix<double, Eigen::Dynamic, S, S == 1 ? Eigen::ColMajor : Eigen::RowMajor> Matrix;
+    typedef Eigen::Map<const Matrix, 0, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>> Map;
+
+    static Map map(const double *data, int rows, int stride)
+    {
+        if (S == 1)
+            return Map(data, rows, 1, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>(rows * stride, stride));
+        return Map(data, rows, S, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>(stride, 1));
+    }
+};
+
+// Hessian块，行优先连续存放
+template <int R, int C>
+using HessianBlock = Eigen::Map<Eigen::Matrix<double, R, C, (C == 1 && R != 1) ? Eigen::ColMajor : Eigen::RowMajor>>;
+
+// h += Ji^T * Jj，参数块大小固定时展开成定长矩阵乘
+template <int SI, int SJ>
+static void addJtJFixed(const double *ji, int stride_i, const double *jj, int stride_j, int rows, double *h)
+{
+    HessianBlock<SI, SJ>(h).noalias() += JacobianCols<SI>::map(ji, rows, stride_i).transpose() * JacobianCols<SJ>::map(jj, rows, stride_j);
+}
+
+static void addJtJDynamic(const double *ji, int stride_i, int size_i, const double *jj, int stride_j, int size_j, int rows, double *h)
+{
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMajorMatrix;
+    Eigen::Map<const RowMajorMatrix, 0, Eigen::OuterStride<>> Ji(ji, rows, size_i, Eigen::OuterStride<>(stride_i));
+    Eigen::Map<const RowMajorMatrix, 0, Eigen::OuterStride<>> Jj(jj, rows, size_j, Eigen::OuterStride<>(stride_j));
+    Eigen::Map<RowMajorMatrix>(h, size_i, size_j).noalias() += Ji.transpose() * Jj;
+}
+
+template <int SI>
+static void addJtJRow(const double *ji, int stride_i, const double *jj, int stride_j, int size_j, int rows, double *h)
+{
+    switch (size_j)
+    {
+    case 1:
+        addJtJFixed<SI, 1>(ji, stride_i, jj, stride_j, rows, h);
+        break;
+    case 6:
+        addJtJFixed<SI, 6>(ji, stride_i, jj, stride_j, rows, h);
+        break;
+    case 9:
+        addJtJFixed<SI, 9>(ji, stride_i, jj, stride_j, rows, h);
+        break;
+    default:
+        addJtJDynamic(ji, stride_i, SI, jj, stride_j, size_j, rows, h);
+    }
+}
+
+// 参数块只有逆深度(1)、位姿(6)、速度零偏(9)、td(1)几种，其他大小走动态版本
+static void addJtJ(const double *ji, int stride_i, int size_i, const double *jj, int stride_j, int size_j, int rows, double *h)
+{
+    switch (size_i)
+    {
+    case 1:
+        addJtJRow<1>(ji, stride_i, jj, stride_j, size_j, rows, h);
+        break;
+    case 6:
+        addJtJRow<6>(ji, stride_i, jj, stride_j, size_j, rows, h);
+        break;
+    case 9:
+        addJtJRow<9>(ji, stride_i, jj, stride_j, size_j, rows, h);
+        break;
+    default:
+        addJtJDynamic(ji, stride_i, size_i, jj, stride_j, size_j, rows, h);
+    }
+}
+
 /**
- * @brief 分线程构造Ax = b
+ * @brief 按参数块分块构造H和b
  * 
- * @param[in] threadsstruct 
- * @return void* 
+ * 参数块按在H里的位置编号，每一行块只存右上部分（列块号>=行块号），由一个任务独占计算，不需要加锁也不需要每个线程一份H；
+ * 结构（每行有哪些列块）先串行算好，块的内存从arena里一次分配
  */
-void* ThreadsConstructA(void* threadsstruct)
+void MarginalizationInfo::buildHessian(BlockHessian &H)
 {
-    ThreadsStruct* p = ((ThreadsStruct*)threadsstruct);
-    // 遍历这么多分配过来的任务
-    for (auto it : p->sub_factors)
+    // 参数块编号
+    int num_blocks = parameter_block_idx.size();
+    std::vector<std::pair<int, long>> order;
+    order.reserve(num_blocks);
+    for (const auto &it : parameter_block_idx)
+        order.emplace_back(it.second, it.first);
+    std::sort(order.begin(), order.end());
+    std::unordered_map<long, int> block_id;
+    H.num_blocks = num_blocks;
+    H.block_idx = arena.allocateArray<int>(num_blocks);
+    H.block_size = arena.allocateArray<int>(num_blocks);
+    for (int k = 0; k < num_blocks; k++)
+    {
+        block_id[order[k].second] = k;
+        H.block_idx[k] = order[k].first;
+        H.block_size[k] = localSize(parameter_block_size[order[k].second]);
+    }
+
+    // 每个残差块里各个参数块的编号，以及每一行块涉及的(残差块, 参数块序号)
+    int num_factors = factors.size();
+    std::vector<int *> factor_blocks(num_factors);
+    std::vector<std::vector<std::pair<int, int>>> row_terms(num_blocks);
+    for (int f = 0; f < num_factors; f++)
     {
-        // 遍历参数块
-        for (int i = 0; i < static_cast<int>(it->parameter_blocks.size()); i++)
+        int num_params = factors[f]->parameter_blocks.size();
+        factor_blocks[f] = arena.allocateArray<int>(num_params);
+        for (int p = 0; p < num_params; p++)
         {
-            int idx_i = p->parameter_block_idx[reinterpret_cast<long>(it->parameter_blocks[i])]; // 在大矩阵中的id，也就是落座的位置
-            int size_i = p->parameter_block_size[reinterpret_cast<long>(it->parameter_blocks[i])];
-            // 确保是local size
-            if (size_i == 7)
-                size_i = 6;
-            // 之前pre margin 已经算好了各个残差和雅克比，这里取出来
-            Eigen::MatrixXd jacobian_i = it->jacobians[i].leftCols(size_i);
-            // 和本身以及其他雅克比块构造H矩阵
-            // i: 当前参数块， j: 另一个参数块
-            for (int j = i; j < static_cast<int>(it->parameter_blocks.size()); j++)
+            int k = block_id[reinterpret_cast<long>(factors[f]->parameter_blocks[p])];
+            factor_blocks[f][p] = k;
+            row_terms[k].emplace_back(f, p);
+        }
+    }
+
+    // 每一行块的列块，排好序，块在这一行的data里依次存放
+    H.rows = arena.allocateArray<BlockHessian::Row>(num_blocks);
+    std::vector<int> cols;
+    for (int k = 0; k < num_blocks; k++)
+    {
+        cols.clear();
+        for (const auto &term : row_terms[k])
+        {
+            int num_params = factors[term.first]->parameter_blocks.size();
+            for (int q = 0; q < num_params; q++)
+                if (factor_blocks[term.first][q] >= k)
+                    cols.push_back(factor_blocks[term.first][q]);
+        }
+        std::sort(cols.begin(), cols.end());
+        cols.erase(std::unique(cols.begin(), cols.end()), cols.end());
+
+        BlockHessian::Row &row = H.rows[k];
+        row.num_cols = cols.size();
+        row.cols = arena.allocateArray<int>(row.num_cols);
+        row.offsets = arena.allocateArray<int>(row.num_cols);
+        int size = 0;
+        for (int c = 0; c < row.num_cols; c++)
+        {
+            row.cols[c] = cols[c];
+            row.offsets[c] = size;
+            size += H.block_size[k] * H.block_size[cols[c]];
+        }
+        row.data = arena.allocateArray<double>(size);
+        std::fill(row.data, row.data + size, 0.0);
+    }
+    int pos = 0;
+    for (int k = 0; k < num_blocks; k++)
+        pos += H.block_size[k];
+    H.b.setZero(pos);
+
+    // 按行块并行累加，每个任务只写自己那一行和b的对应段
+    estimatorPool().run(num_blocks, [&](int k)
+    {
+        BlockHessian::Row &row = H.rows[k];
+        int size_k = H.block_size[k];
+        for (const auto &term : row_terms[k])
+        {
+            const ResidualBlockInfo *it = factors[term.first];
+            const std::vector<int> &block_sizes = it->cost_function->parameter_block_sizes();
+            int p = term.second;
+            for (int q = 0; q < static_cast<int>(block_sizes.size()); q++)
             {
-                int idx_j = p->parameter_block_idx[reinterpret_cast<long>(it->parameter_blocks[j])];    // 在大矩阵中的id，也就是落座的位置
-                int size_j = p->parameter_block_size[reinterpret_cast<long>(it->parameter_blocks[j])];
-                if (size_j == 7)
-                    size_j = 6;
-                Eigen::MatrixXd jacobian_j = it->jacobians[j].leftCols(size_j);
-                // 两个雅克比都取出来了
-                if (i == j) // 如果是自己，一块田地
-                    p->A.block(idx_i, idx_j, size_i, size_j) += jacobian_i.transpose() * jacobian_j;
-                else    // 和别人，由于对称，两块田地
-                {
-                    p->A.block(idx_i, idx_j, size_i, size_j) += jacobian_i.transpose() * jacobian_j;
-                    // 第一块田地转置一下
-                    p->A.block(idx_j, idx_i, size_j, size_i) = p->A.block(idx_i, idx_j, size_i, size_j).transpose();
-                }
+                int j = factor_blocks[term.first][q];
+                if (j < k)
+                    continue;
+                int r0 = std::max(it->row_begin[p], it->row_begin[q]);
+                int r1 = std::min(it->row_end[p], it->row_end[q]);
+                if (r1 <= r0)
+                    continue;
+                int c = std::lower_bound(row.cols, row.cols + row.num_cols, j) - row.cols;
+                addJtJ(it->raw_jacobians[p] + r0 * block_sizes[p], block_sizes[p], size_k, it->raw_jacobians[q] + r0 * block_sizes[q], block_sizes[q], H.block_size[j],
+                       r1 - r0, row.data + row.offsets[c]);
             }
             // 然后构建g矩阵
             // ? : 为什么不是-JTb
-            p->b.segment(idx_i, size_i) += jacobian_i.transpose() * it->residuals;
+            H.b.segment(H.block_idx[k], size_k) += it->jacobians[p].leftCols(size_k).transpose() * it->residuals;
+        }
+    });
+}
+
+// 从第first_block个参数块开始的右下角部分转成稠密矩阵
+void MarginalizationInfo::BlockHessian::toDense(Eigen::MatrixXd &A, int first_block) const
+{
+    int offset = first_block < num_blocks ? block_idx[first_block] : b.size();
+    int size = b.size() - offset;
+    A.setZero(size, size);
+    for (int k = first_block; k < num_blocks; k++)
+    {
+        const Row &row = rows[k];
+        int idx_k = block_idx[k] - offset;
+        for (int c = 0; c < row.num_cols; c++)
+        {
+            int j = row.cols[c];
+            int idx_j = block_idx[j] - offset;
+            Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> block(row.data + row.offsets[c], block_size[k], block_size[j]);
+            A.block(idx_k, idx_j, block_size[k], block_size[j]) = block;
+            // 对称的另一半
+            if (j != k)
+                A.block(idx_j, idx_k, block_size[j], block_size[k]) = block.transpose();
         }
     }
-    return threadsstruct;
+}
+
+/**
+ * @brief 利用结构做舒尔补：先用对角元消去逆深度，剩下的位姿/速度零偏块很小，用LDLT消去
+ * 
+ * 逆深度排在H的最前面（前num_scalar个参数块），彼此之间没有约束，每个只和几个位姿、外参、td相连；
+ * 不满足这个结构时返回false，走稠密的特征值分解
+ * 
+ * @param[in] H 
+ * @param[in] num_scalar 待边缘化的逆深度个数
+ * @param[out] A 舒尔补之后剩余参数块的H
+ * @param[out] b 
+ * @return true 
+ * @return false 
+ */
+bool MarginalizationInfo::schurStructured(const BlockHessian &H, int num_scalar, Eigen::MatrixXd &A, Eigen::VectorXd &b) const
+{
+    // 列块升序，cols[0]是对角块；下一个列块还是逆深度说明两个逆深度之间有约束
+    for (int k = 0; k < num_scalar; k++)
+        if (H.rows[k].num_cols > 1 && H.rows[k].cols[1] < num_scalar)
+            return false;
+
+    int np = m - num_scalar;    // 剩下要边缘化的位姿、速度零偏
+    Eigen::MatrixXd Hpr;
+    H.toDense(Hpr, num_scalar);
+    Eigen::VectorXd bpr = H.b.tail(np + n);
+    // 逐个消去逆深度，每个逆深度只更新它连接的那几个块
+    for (int k = 0; k < num_scalar; k++)
+    {
+        const BlockHessian::Row &row = H.rows[k];
+        double d = row.data[0];
+        // 和特征值分解取逆一样，太小的当成0
+        if (d <= eps)
+            continue;
+        double inv_d = 1.0 / d;
+        for (int ci = 1; ci < row.num_cols; ci++)
+        {
+            int i = row.cols[ci];
+            int idx_i = H.block_idx[i] - num_scalar, size_i = H.block_size[i];
+            Eigen::Map<const Eigen::RowVectorXd> h_i(row.data + row.offsets[ci], size_i);
+            bpr.segment(idx_i, size_i) -= h_i.transpose() * (inv_d * H.b(k));
+            for (int cj = 1; cj < row.num_cols; cj++)
+            {
+                int j = row.cols[cj];
+                int idx_j = H.block_idx[j] - num_scalar, size_j = H.block_size[j];
+                Eigen::Map<const Eigen::RowVectorXd> h_j(row.data + row.offsets[cj], size_j);
+                Hpr.block(idx_i, idx_j, size_i, size_j).noalias() -= (inv_d * h_i.transpose()) * h_j;
+            }
+        }
+    }
+
+    if (np == 0)
+    {
+        A = Hpr;
+        b = bpr;
+        return true;
+    }
+    // 再消去位姿、速度零偏，一般只有十几维
+    Eigen::MatrixXd Hpp = 0.5 * (Hpr.topLeftCorner(np, np) + Hpr.topLeftCorner(np, np).transpose());
+    Eigen::MatrixXd Hpr_r = Hpr.topRightCorner(np, n);
+    Eigen::MatrixXd X;
+    Eigen::VectorXd y;
+    Eigen::LDLT<Eigen::MatrixXd> ldlt(Hpp);
+    if (ldlt.info() == Eigen::Success && ldlt.vectorD().minCoeff() > eps)
+    {
+        X = ldlt.solve(Hpr_r);
+        y = ldlt.solve(bpr.head(np));
+    }
+    else
+    {
+        // 退化时和原来一样，用特征值分解求伪逆
+        ROS_DEBUG("marginalization LDLT degenerate, use eigen decomposition");
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> saes(Hpp);
+        Eigen::MatrixXd Hpp_inv = saes.eigenvectors() * Eigen::VectorXd((saes.eigenvalues().array() > eps).select(saes.eigenvalues().array().inverse(), 0)).asDiagonal() * saes.eigenvectors().transpose();
+        X = Hpp_inv * Hpr_r;
+        y = Hpp_inv * bpr.head(np);
+    }
+    A = Hpr.bottomRightCorner(n, n) - Hpr_r.transpose() * X;    // ! 舒尔补得到新的H * deltax = g
+    b = bpr.tail(n) - Hpr_r.transpose() * y;
+    return true;
 }
 
 /**
@@ -217,10 +478,22 @@ void MarginalizationInfo::marginalize()
 {
     int pos = 0;
     // parameter_block_idx key是各个待边缘化参数块地址 value预设都是0
+    // 逆深度这种1维的排在最前面，舒尔补时可以直接用对角元消掉
+    for (auto &it : parameter_block_idx)
+    {
+        if (localSize(parameter_block_size[it.first]) != 1)
+            continue;
+        it.second = pos;
+        pos++;
+    }
+    int num_scalar = pos;
     for (auto &it : parameter_block_idx)
     {
+        int size = localSize(parameter_block_size[it.first]);   // 因为要进行求导，因此大小时local size，具体一点就是使用李代数
+        if (size == 1)
+            continue;
         it.second = pos;    // 这就是在所有参数中排序的idx，待边缘化的排在前面
-        pos += localSize(parameter_block_size[it.first]);   // 因为要进行求导，因此大小时local size，具体一点就是使用李代数
+        pos += size;
     }
 
     m = pos;    // 总共待边缘化的参数块总大小（不是个数）
@@ -238,114 +511,54 @@ void MarginalizationInfo::marginalize()
 
     //ROS_DEBUG("marginalization, pos: %d, m: %d, n: %d, size: %d", pos, m, n, (int)parameter_block_idx.size());
 
+    //  ! 往A矩阵和b矩阵中填东西，按参数块分块，常驻线程池并行累加
     TicToc t_summing;
-    Eigen::MatrixXd A(pos, pos);    // Ax = b预设大小
-    Eigen::VectorXd b(pos);
-    A.setZero();
-    b.setZero();
-    /*
-    for (auto it : factors)
-    {
-        for (int i = 0; i < static_cast<int>(it->parameter_blocks.size()); i++)
-        {
-            int idx_i = parameter_block_idx[reinterpret_cast<long>(it->parameter_blocks[i])];
-            int size_i = localSize(parameter_block_size[reinterpret_cast<long>(it->parameter_blocks[i])]);
-            Eigen::MatrixXd jacobian_i = it->jacobians[i].leftCols(size_i);
-            for (int j = i; j < static_cast<int>(it->parameter_blocks.size()); j++)
-            {
-                int idx_j = parameter_block_idx[reinterpret_cast<long>(it->parameter_blocks[j])];
-                int size_j = localSize(parameter_block_size[reinterpret_cast<long>(it->parameter_blocks[j])]);
-                Eigen::MatrixXd jacobian_j = it->jacobians[j].leftCols(size_j);
-                if (i == j)
-                    A.block(idx_i, idx_j, size_i, size_j) += jacobian_i.transpose() * jacobian_j;
-                else
-                {
-                    A.block(idx_i, idx_j, size_i, size_j) += jacobian_i.transpose() * jacobian_j;
-                    A.block(idx_j, idx_i, size_j, size_i) = A.block(idx_i, idx_j, size_i, size_j).transpose();
-                }
-            }
-            b.segment(idx_i, size_i) += jacobian_i.transpose() * it->residuals;
-        }
-    }
-    ROS_INFO("summing up costs %f ms", t_summing.toc());
-    */
-    //multi thread
-
-    //  ! 往A矩阵和b矩阵中填东西，利用多线程(5)加速
-    TicToc t_thread_summing;
-    pthread_t tids[NUM_THREADS];
-    ThreadsStruct threadsstruct[NUM_THREADS];
-    int i = 0;
-    for (auto it : factors)
-    {
-        threadsstruct[i].sub_factors.push_back(it); // 每个线程均匀分配任务
-        i++;
-        i = i % NUM_THREADS;
-    }
-    // 每个线程构造一个A矩阵和b矩阵，最后大家加起来
-    for (int i = 0; i < NUM_THREADS; i++)
-    {
-        TicToc zero_matrix;
-        // 所以A矩阵和b矩阵大小一样，预设都是0
-        threadsstruct[i].A = Eigen::MatrixXd::Zero(pos,pos);
-        threadsstruct[i].b = Eigen::VectorXd::Zero(pos);
-        // 多线程访问会带来冲突，因此每个线程备份一下要查询的map
-        threadsstruct[i].parameter_block_size = parameter_block_size;   // 大小
-        threadsstruct[i].parameter_block_idx = parameter_block_idx; // 索引
-        // 产生若干线程
-        int ret = pthread_create( &tids[i], NULL, ThreadsConstructA ,(void*)&(threadsstruct[i]));
-        if (ret != 0)
-        {
-            ROS_WARN("pthread_create error");
-            ROS_BREAK();
-        }
-    }
-    for( int i = NUM_THREADS - 1; i >= 0; i--)  
-    {
-        // 等待各个线程完成各自的任务
-        pthread_join( tids[i], NULL );
-        // 把各个子模块拼起来，就是最终的Hx = g的矩阵了 
-        A += threadsstruct[i].A;
-        b += threadsstruct[i].b;
-    }
-    //ROS_DEBUG("thread summing up costs %f ms", t_thread_summing.toc());
-    //ROS_INFO("A diff %f , b diff %f ", (A - tmp_A).sum(), (b - tmp_b).sum());
-
+    BlockHessian H;
+    buildHessian(H);
+    ROS_DEBUG("marginalization hessian %d blocks, summing up costs %f ms", H.num_blocks, t_summing.toc());
 
     // ! 进行舒尔补
-    // Amm矩阵的构建是为了保证其正定性
-    Eigen::MatrixXd Amm = 0.5 * (A.block(0, 0, m, m) + A.block(0, 0, m, m).transpose());
-    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> saes(Amm);   // 特征值分解
-
-    //ROS_ASSERT_MSG(saes.eigenvalues().minCoeff() >= -1e-4, "min eigenvalue %f", saes.eigenvalues().minCoeff());
-    // 一个逆矩阵的特征值是原矩阵的倒数，特征向量相同　select类似c++中 ? :运算符
-    // 利用特征值取逆来构造其逆矩阵
-    Eigen::MatrixXd Amm_inv = saes.eigenvectors() * Eigen::VectorXd((saes.eigenvalues().array() > eps).select(saes.eigenvalues().array().inverse(), 0)).asDiagonal() * saes.eigenvectors().transpose();
-    //printf("error1: %f\n", (Amm * Amm_inv - Eigen::MatrixXd::Identity(m, m)).sum());
-
-    Eigen::VectorXd bmm = b.segment(0, m);  // 带边缘化的大小
-    Eigen::MatrixXd Amr = A.block(0, m, m, n);  // 对应的四块矩阵
-    Eigen::MatrixXd Arm = A.block(m, 0, n, m);
-    Eigen::MatrixXd Arr = A.block(m, m, n, n);
-    Eigen::VectorXd brr = b.segment(m, n); // 剩下的参数
-    A = Arr - Arm * Amm_inv * Amr;    // ! 舒尔补得到新的H * deltax = g
-    b = brr - Arm * Amm_inv * bmm;
+    TicToc t_schur;
+    Eigen::MatrixXd A;
+    Eigen::VectorXd b;
+    if (!schurStructured(H, num_scalar, A, b))
+    {
+        ROS_DEBUG("marginalization structure not exploitable, use dense schur complement");
+        H.toDense(A);
+        b = H.b;
+        // Amm矩阵的构建是为了保证其正定性
+        Eigen::MatrixXd Amm = 0.5 * (A.block(0, 0, m, m) + A.block(0, 0, m, m).transpose());
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> saes(Amm);   // 特征值分解
+
+        // 一个逆矩阵的特征值是原矩阵的倒数，特征向量相同　select类似c++中 ? :运算符
+        // 利用特征值取逆来构造其逆矩阵
+        Eigen::MatrixXd Amm_inv = saes.eigenvectors() * Eigen::VectorXd((saes.eigenvalues().array() > eps).select(saes.eigenvalues().array().inverse(), 0)).asDiagonal() * saes.eigenvectors().transpose();
+
+        Eigen::VectorXd bmm = b.segment(0, m);  // 带边缘化的大小
+        Eigen::MatrixXd Amr = A.block(0, m, m, n);  // 对应的四块矩阵
+        Eigen::MatrixXd Arm = A.block(m, 0, n, m);
+        Eigen::MatrixXd Arr = A.block(m, m, n, n);
+        Eigen::VectorXd brr = b.segment(m, n); // 剩下的参数
+        A = Arr - Arm * Amm_inv * Amr;    // ! 舒尔补得到新的H * deltax = g
+        b = brr - Arm * Amm_inv * bmm;
+    }
+    ROS_DEBUG("marginalization schur complement (%d inverse depths) costs %f ms", num_scalar, t_schur.toc());
 
     // 这个地方根据Ax = b => JT*J = - JT * e
     // 对A做特征值分解 A = V * S * VT,其中Ｓ是特征值构成的对角矩阵
     // 所以J = S^(1/2) * VT , 这样JT * J = (S^(1/2) * VT)T * S^(1/2) * VT = V * S^(1/2)T *  S^(1/2) * VT = V * S * VT(对角矩阵的转置等于其本身)
     // e = -(JT)-1 * b = - (S^-(1/2) * V^-1) * b = - (S^-(1/2) * VT) * b
     Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> saes2(A);
-    // 对A矩阵取逆
-    Eigen::VectorXd S = Eigen::VectorXd((saes2.eigenvalues().array() > eps).select(saes2.eigenvalues().array(), 0));
-    Eigen::VectorXd S_inv = Eigen::VectorXd((saes2.eigenvalues().array() > eps).select(saes2.eigenvalues().array().inverse(), 0));
-
+    // 特征值升序排列，只保留大于eps的方向，零空间方向对残差和雅克比的贡献都是0，直接去掉，先验的残差维数降到rank
+    int rank = (saes2.eigenvalues().array() > eps).count();
+    Eigen::VectorXd S = saes2.eigenvalues().tail(rank);
     Eigen::VectorXd S_sqrt = S.cwiseSqrt(); // 这个求得就是 S^(1/2)，不过这里是向量还不是矩阵
-    Eigen::VectorXd S_inv_sqrt = S_inv.cwiseSqrt();
+    Eigen::VectorXd S_inv_sqrt = S.cwiseInverse().cwiseSqrt();
     // 边缘化为了实现对剩下参数块的约束，为了便于一起优化，就抽象成了残差和雅克比的形式，这样也形成了一种残差约束
     // ! 把之前的边缘化部分视为先验的意思就是，要把边缘化部分融入到jacobian和残差约束中，下面相当于通过舒尔补得到新的H * deltax = g反向得到加入先验的jacobian和残差，此时的jacobian是此刻固定边缘化部分的线性值
-    linearized_jacobians = S_sqrt.asDiagonal() * saes2.eigenvectors().transpose();  
-    linearized_residuals = S_inv_sqrt.asDiagonal() * saes2.eigenvectors().transpose() * b;
+    linearized_jacobians = S_sqrt.asDiagonal() * saes2.eigenvectors().rightCols(rank).transpose();  // rank x n
+    linearized_residuals = S_inv_sqrt.asDiagonal() * (saes2.eigenvectors().rightCols(rank).transpose() * b);
+    ROS_DEBUG("marginalization prior rank %d / %d", rank, n);
     //std::cout << A << std::endl
     //          << std::endl;
     //std::cout << linearized_jacobians << std::endl;
@@ -373,6 +586,17 @@ std::vector<double *> MarginalizationInfo::getParameterBlocks(std::unordered_map
     // 留下来的边缘化后的参数块总大小
     sum_block_size = std::accumulate(std::begin(keep_block_size), std::end(keep_block_size), 0);
 
+    // 先验雅克比按参数块切开，每块rank x local size紧凑行优先存放，Evaluate里直接按定长块用
+    int rank = linearized_jacobians.rows();
+    keep_block_jacobian.clear();
+    for (int i = 0; i < static_cast<int>(keep_block_size.size()); i++)
+    {
+        int local_size = localSize(keep_block_size[i]);
+        double *jacobian = arena.allocateArray<double>(rank * local_size);
+        JacobianMap(jacobian, rank, local_size) = linearized_jacobians.middleCols(keep_block_idx[i] - m, local_size);
+        keep_block_jacobian.push_back(jacobian);
+    }
+
     return keep_block_addr;
 }
 /**
@@ -390,7 +614,7 @@ MarginalizationFactor::MarginalizationFactor(MarginalizationInfo* _marginalizati
         cnt += it;
     }
     //printf("residual size: %d, %d\n", cnt, n);
-    set_num_residuals(marginalization_info->n); // 残差维数就是所有剩余状态量的维数和，这里是local size
+    set_num_residuals(marginalization_info->linearized_residuals.size()); // 残差维数是先验信息矩阵的秩，最多是剩余状态量local size的和
 };
 
 /**
@@ -404,55 +628,49 @@ MarginalizationFactor::MarginalizationFactor(MarginalizationInfo* _marginalizati
  */
 bool MarginalizationFactor::Evaluate(double const *const *parameters, double *residuals, double **jacobians) const
 {
-    //printf("internal addr,%d, %d\n", (int)parameter_block_sizes().size(), num_residuals());
-    //for (int i = 0; i < static_cast<int>(keep_block_size.size()); i++)
-    //{
-    //    //printf("unsigned %x\n", reinterpret_cast<unsigned long>(parameters[i]));
-    //    //printf("signed %x\n", reinterpret_cast<long>(parameters[i]));
-    //printf("jacobian %x\n", reinterpret_cast<long>(jacobians));
-    //printf("residual %x\n", reinterpret_cast<long>(residuals));
-    //}
-    int n = marginalization_info->n;    // ! 上一次边缘化保留的残差块的local size的和,也就是残差维数
-    int m = marginalization_info->m;    // ! 上次边缘化的被margin的残差块总和
-    Eigen::VectorXd dx(n);  // 用来存储残差
-    // 遍历所有的剩下的有约束的残差块
-    for (int i = 0; i < static_cast<int>(marginalization_info->keep_block_size.size()); i++)
-    {
-        int size = marginalization_info->keep_block_size[i];
-        int idx = marginalization_info->keep_block_idx[i] - m;  // idx起点统一到0
-        Eigen::VectorXd x = Eigen::Map<const Eigen::VectorXd>(parameters[i], size); // 当前参数块的值
-        Eigen::VectorXd x0 = Eigen::Map<const Eigen::VectorXd>(marginalization_info->keep_block_data[i], size); // 当时参数块的值
-        if (size != 7)
-            dx.segment(idx, size) = x - x0; // 不需要local param的直接做差
-        else    // 代表位姿的param
-        {
-            dx.segment<3>(idx + 0) = x.head<3>() - x0.head<3>();    // 位移直接做差
-            // 旋转就是李代数做差
-            dx.segment<3>(idx + 3) = 2.0 * Utility::positify(Eigen::Quaterniond(x0(6), x0(3), x0(4), x0(5)).inverse() * Eigen::Quaterniond(x(6), x(3), x(4), x(5))).vec();
-            // 确保实部大于0
-            if (!((Eigen::Quaterniond(x0(6), x0(3), x0(4), x0(5)).inverse() * Eigen::Quaterniond(x(6), x(3), x(4), x(5))).w() >= 0))
-            {
-                dx.segment<3>(idx + 3) = 2.0 * -Utility::positify(Eigen::Quaterniond(x0(6), x0(3), x0(4), x0(5)).inverse() * Eigen::Quaterniond(x(6), x(3), x(4), x(5))).vec();
-            }
-        }
-    }
+    const MarginalizationInfo *info = marginalization_info;
+    int rank = info->linearized_residuals.size();
     // ! 更新残差：边缘化后的先验误差 e = e0 + J * dx每次舒尔补只是得到了在固定边缘化部分时的jacobian J和残差e0，下一时刻再重新构建H * deltax = b，也就是更新H和b，因为H和b与e和J有关
     // ! 根据FEJ．雅克比保持不变，但是残差随着优化会变化，因此下面不更新J，只更新残差
     // 关于FEJ：https://www.zhihu.com/question/52869487
     // 可以参考https://blog.csdn.net/weixin_41394379/article/details/89975386
-    Eigen::Map<Eigen::VectorXd>(residuals, n) = marginalization_info->linearized_residuals + marginalization_info->linearized_jacobians * dx;
+    // J * dx按参数块累加，不拼完整的dx，也不碰整块的稠密雅克比
+    Eigen::Map<Eigen::VectorXd> residual(residuals, rank);
+    residual = info->linearized_residuals;
+    for (int i = 0; i < static_cast<int>(info->keep_block_size.size()); i++)
+    {
+        int size = info->keep_block_size[i];
+        const double *x = parameters[i];    // 当前参数块的值
+        const double *x0 = info->keep_block_data[i];   // 当时参数块的值
+        const double *J = info->keep_block_jacobian[i];
+        if (size == 7)  // 代表位姿的param
+        {
+            Eigen::Matrix<double, 6, 1> dx;
+            dx.head<3>() = Eigen::Map<const Eigen::Vector3d>(x) - Eigen::Map<const Eigen::Vector3d>(x0);    // 位移直接做差
+            // 旋转就是李代数做差，四元数只乘一次，确保实部大于0
+            Eigen::Quaterniond dq = Eigen::Quaterniond(x0[6], x0[3], x0[4], x0[5]).conjugate() * Eigen::Quaterniond(x[6], x[3], x[4], x[5]);
+            dx.tail<3>() = dq.w() >= 0 ? 2.0 * dq.vec() : -2.0 * dq.vec();
+            residual.noalias() += JacobianCols<6>::map(J, rank, 6) * dx;
+        }
+        else if (size == 9) // 速度零偏
+            residual.noalias() += JacobianCols<9>::map(J, rank, 9) * (Eigen::Map<const Eigen::Matrix<double, 9, 1>>(x) - Eigen::Map<const Eigen::Matrix<double, 9, 1>>(x0));
+        else if (size == 1) // td
+            residual += Eigen::Map<const Eigen::VectorXd>(J, rank) * (x[0] - x0[0]);
+        else    // 不需要local param的直接做差
+            residual.noalias() += JacobianMap(const_cast<double *>(J), rank, size) * (Eigen::Map<const Eigen::VectorXd>(x, size) - Eigen::Map<const Eigen::VectorXd>(x0, size));
+    }
     if (jacobians)
     {
-
-        for (int i = 0; i < static_cast<int>(marginalization_info->keep_block_size.size()); i++)
+        // 只填ceres要的块，固定的参数块对应的指针是空的
+        for (int i = 0; i < static_cast<int>(info->keep_block_size.size()); i++)
         {
             if (jacobians[i])
             {
-                int size = marginalization_info->keep_block_size[i], local_size = marginalization_info->localSize(size);
-                int idx = marginalization_info->keep_block_idx[i] - m;
-                Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> jacobian(jacobians[i], n, size);
-                jacobian.setZero();
-                jacobian.leftCols(local_size) = marginalization_info->linearized_jacobians.middleCols(idx, local_size);
+                int size = info->keep_block_size[i], local_size = info->localSize(size);
+                JacobianMap jacobian(jacobians[i], rank, size);
+                if (local_size != size)
+                    jacobian.col(size - 1).setZero();
+                jacobian.leftCols(local_size) = JacobianMap(const_cast<double *>(info->keep_block_jacobian[i]), rank, local_size);
             }
         }
     }
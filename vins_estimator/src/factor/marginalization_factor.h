@@ -3,21 +3,31 @@
 #include <ros/ros.h>
 #include <ros/console.h>
 #include <cstdlib>
-#include <pthread.h>
+#include <algorithm>
 #include <ceres/ceres.h>
 #include <unordered_map>
+#include <feature_tracker/worker_pool.h>
 
 #include "../utility/utility.h"
 #include "../utility/tic_toc.h"
+#include "../utility/frame_arena.h"
 
 const int NUM_THREADS = 4;
 
+// 后端的常驻线程池，和调用线程一起共NUM_THREADS个；边缘化和三角化都在估计器线程里先后调用，共用这一个
+// 任务按段切，一个任务算一段，避免每个元素都抢一次锁
+WorkerPool &estimatorPool();
+
+typedef Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> JacobianMap;
+
 struct ResidualBlockInfo
 {
     // 构造函数需要，cost function（约束），loss function：残差的计算方式，相关联的参数块，待边缘化的参数块的索引
     ResidualBlockInfo(ceres::CostFunction *_cost_function, ceres::LossFunction *_loss_function, std::vector<double *> _parameter_blocks, std::vector<int> _drop_set)
-        : cost_function(_cost_function), loss_function(_loss_function), parameter_blocks(_parameter_blocks), drop_set(_drop_set) {}
+        : cost_function(_cost_function), loss_function(_loss_function), parameter_blocks(_parameter_blocks), drop_set(_drop_set),
+          raw_jacobians(nullptr), jacobians(nullptr), residuals(nullptr, 0), row_begin(nullptr), row_end(nullptr) {}
 
+    void allocate(FrameArena &arena);
     void Evaluate();
 
     ceres::CostFunction *cost_function;
@@ -25,9 +35,12 @@ struct ResidualBlockInfo
     std::vector<double *> parameter_blocks;
     std::vector<int> drop_set;
 
+    // 残差和雅克比的内存都在MarginalizationInfo的arena里
     double **raw_jacobians;
-    std::vector<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> jacobians;
-    Eigen::VectorXd residuals;
+    JacobianMap *jacobians;
+    Eigen::Map<Eigen::VectorXd> residuals;
+    // 每个参数块的雅克比里非零行的范围[row_begin, row_end)，多观测的残差块里每一帧位姿只占两行
+    int *row_begin, *row_end;
 
     int localSize(int size)   // 保证是6维
     {
@@ -35,15 +48,6 @@ struct ResidualBlockInfo
     }
 };
 
-struct ThreadsStruct
-{
-    std::vector<ResidualBlockInfo *> sub_factors;
-    Eigen::MatrixXd A;
-    Eigen::VectorXd b;
-    std::unordered_map<long, int> parameter_block_size; //global size
-    std::unordered_map<long, int> parameter_block_idx; //local size
-};
-
 class MarginalizationInfo
 {
   public:
@@ -55,6 +59,29 @@ class MarginalizationInfo
     void marginalize();
     std::vector<double *> getParameterBlocks(std::unordered_map<long, double *> &addr_shift);
 
+    // 分块存储的H，参数块按在H里的位置排序，每一行块只存列块号>=行块号的部分
+    struct BlockHessian
+    {
+        struct Row
+        {
+            int num_cols;
+            int *cols;      // 列块号，升序
+            int *offsets;   // 每个块在data里的起点，块内行优先
+            double *data;
+        };
+        int num_blocks;
+        int *block_idx;     // 每个参数块在H里的起始位置
+        int *block_size;    // local size
+        Row *rows;
+        Eigen::VectorXd b;
+
+        void toDense(Eigen::MatrixXd &A, int first_block = 0) const;
+    };
+    void buildHessian(BlockHessian &H);
+    bool schurStructured(const BlockHessian &H, int num_scalar, Eigen::MatrixXd &A, Eigen::VectorXd &b) const;
+
+    // 这一次边缘化用到的因子、ResidualBlockInfo、雅克比和参数块备份都从这里分配，MarginalizationInfo被替换时整块释放
+    FrameArena arena;
     std::vector<ResidualBlockInfo *> factors;
     int m, n;
     std::unordered_map<long, int> parameter_block_size; //global size   // 地址->global size
@@ -65,8 +92,9 @@ class MarginalizationInfo
     std::vector<int> keep_block_size; //global size
     std::vector<int> keep_block_idx;  //local size
     std::vector<double *> keep_block_data;
+    std::vector<double *> keep_block_jacobian;  // 每个留下的参数块对应的rank x local size雅克比，行优先，在arena里
 
-    Eigen::MatrixXd linearized_jacobians;
+    Eigen::MatrixXd linearized_jacobians;   // rank x n，零空间方向已经去掉
     Eigen::VectorXd linearized_residuals;
     const double eps = 1e-8;
 
@@ -17,5 +17,4 @@ class ProjectionFactor : public ceres::SizedCostFunction<2, 7, 7, 7, 1>   // 重
     Eigen::Vector3d pts_i, pts_j;  // 在共视帧中的两个归一化相机坐标
     Eigen::Matrix<double, 2, 3> tangent_base;
     static Eigen::Matrix2d sqrt_info;   // 协方差
-    static double sum_t;
 };
@@ -0,0 +1,186 @@
+#include "projection_group_factor.h"
+
+Eigen::Matrix2d ProjectionGroupFactor::sqrt_info;
+
+ProjectionGroupFactor::ProjectionGroupFactor(const Eigen::Vector3d &_pts_i, const Eigen::Vector2d &_velocity_i,
+                                             const double _td_i, const double _row_i, bool _with_td, ceres::LossFunction *_loss_function)
+    : pts_i(_pts_i), td_i(_td_i), with_td(_with_td), loss_function(_loss_function)
+{
+    velocity_i << _velocity_i.x(), _velocity_i.y(), 0;
+    row_i = _row_i - ROW / 2;
+
+    std::vector<int> *sizes = mutable_parameter_block_sizes();
+    sizes->push_back(7);    // 起始帧位姿
+    sizes->push_back(7);    // 外参
+    sizes->push_back(1);    // 逆深度
+    if (with_td)
+        sizes->push_back(1);
+    first_pose = sizes->size();
+    set_num_residuals(0);
+}
+
+void ProjectionGroupFactor::addObservation(const Eigen::Vector3d &_pts_j, const Eigen::Vector2d &_velocity_j, const double _td_j, const double _row_j)
+{
+    Observation obs;
+    obs.pts_j = _pts_j;
+    obs.velocity_j << _velocity_j.x(), _velocity_j.y(), 0;
+    obs.td_j = _td_j;
+    obs.row_j = _row_j - ROW / 2;
+#ifdef UNIT_SPHERE_ERROR
+    Eigen::Vector3d b1, b2;
+    Eigen::Vector3d a = obs.pts_j.normalized();
+    Eigen::Vector3d tmp(0, 0, 1);
+    if(a == tmp)
+        tmp << 1, 0, 0;
+    b1 = (tmp - a * (a.transpose() * tmp)).normalized();
+    b2 = a.cross(b1);
+    obs.tangent_base.block<1, 3>(0, 0) = b1.transpose();
+    obs.tangent_base.block<1, 3>(1, 0) = b2.transpose();
+#endif
+    observations.push_back(obs);
+    mutable_parameter_block_sizes()->push_back(7);
+    set_num_residuals(2 * observations.size());
+}
+
+bool ProjectionGroupFactor::Evaluate(double const *const *parameters, double *residuals, double **jacobians) const
+{
+    typedef Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, 7, Eigen::RowMajor>> PoseJacobian;
+    int num_rows = num_residuals();
+
+    Eigen::Vector3d Pi(parameters[0][0], parameters[0][1], parameters[0][2]);
+    Eigen::Quaterniond Qi(parameters[0][6], parameters[0][3], parameters[0][4], parameters[0][5]);
+
+    Eigen::Vector3d tic(parameters[1][0], parameters[1][1], parameters[1][2]);
+    Eigen::Quaterniond qic(parameters[1][6], parameters[1][3], parameters[1][4], parameters[1][5]);
+
+    double inv_dep_i = parameters[2][0];
+    double td = with_td ? parameters[3][0] : 0;
+
+    // > 只和起始帧有关的部分，所有观测共用
+    Eigen::Matrix3d Ri = Qi.toRotationMatrix();
+    Eigen::Matrix3d ric = qic.toRotationMatrix();
+    Eigen::Vector3d pts_i_td = pts_i;
+    if (with_td)
+        pts_i_td -= (td - td_i + TR / ROW * row_i) * velocity_i;
+    Eigen::Vector3d pts_camera_i = pts_i_td / inv_dep_i;
+    Eigen::Vector3d pts_imu_i = ric * pts_camera_i + tic;
+    Eigen::Vector3d pts_w = Ri * pts_imu_i + Pi;
+    Eigen::Matrix3d Ri_ric = Ri * ric;
+    Eigen::Matrix3d Ri_skew_i = Ri * -Utility::skewSymmetric(pts_imu_i);
+    Eigen::Vector3d Ri_tic_Pi = Ri * tic + Pi;
+
+    if (jacobians)
+    {
+        // 观测帧位姿只和自己的两行有关，其余行先清零
+        for (int k = first_pose; k < first_pose + numObservations(); k++)
+            if (jacobians[k])
+                PoseJacobian(jacobians[k], num_rows, 7).setZero();
+    }
+
+    for (int k = 0; k < numObservations(); k++)
+    {
+        const Observation &obs = observations[k];
+        const double *pose_j = parameters[first_pose + k];
+        Eigen::Vector3d Pj(pose_j[0], pose_j[1], pose_j[2]);
+        Eigen::Matrix3d Rj = Eigen::Quaterniond(pose_j[6], pose_j[3], pose_j[4], pose_j[5]).toRotationMatrix();
+
+        Eigen::Vector3d pts_j_td = obs.pts_j;
+        if (with_td)
+            pts_j_td -= (td - obs.td_j + TR / ROW * obs.row_j) * obs.velocity_j;
+        Eigen::Vector3d pts_imu_j = Rj.transpose() * (pts_w - Pj);
+        Eigen::Vector3d pts_camera_j = ric.transpose() * (pts_imu_j - tic);
+
+        Eigen::Vector2d residual;
+#ifdef UNIT_SPHERE_ERROR
+        residual = obs.tangent_base * (pts_camera_j.normalized() - pts_j_td.normalized());
+#else
+        double dep_j = pts_camera_j.z();
+        residual = (pts_camera_j / dep_j).head<2>() - pts_j_td.head<2>();
+#endif
+        residual = sqrt_info * residual;
+
+        // 核函数和ceres的Corrector、ResidualBlockInfo::Evaluate一样做Triggs修正：
+        // r' = residual_scaling * r，J' = sqrt(rho') * (I - alpha / s * r * r^T) * J，柯西核rho'' < 0，退化成都乘sqrt(rho')
+        Eigen::Matrix2d robust = Eigen::Matrix2d::Identity();
+        if (loss_function)
+        {
+            double sq_norm = residual.squaredNorm(), rho[3];
+            loss_function->Evaluate(sq_norm, rho);
+            double sqrt_rho1 = sqrt(rho[1]);
+            double residual_scaling, alpha_sq_norm;
+            if ((sq_norm == 0.0) || (rho[2] <= 0.0))
+            {
+                residual_scaling = sqrt_rho1;
+                alpha_sq_norm = 0.0;
+            }
+            else
+            {
+                const double D = 1.0 + 2.0 * sq_norm * rho[2] / rho[1];
+                const double alpha = 1.0 - sqrt(D);
+                residual_scaling = sqrt_rho1 / (1 - alpha);
+                alpha_sq_norm = alpha / sq_norm;
+            }
+            robust = sqrt_rho1 * (Eigen::Matrix2d::Identity() - alpha_sq_norm * residual * residual.transpose());
+            residual *= residual_scaling;
+        }
+        Eigen::Map<Eigen::Vector2d>(residuals + 2 * k) = residual;
+
+        if (!jacobians)
+            continue;
+
+        Eigen::Matrix<double, 2, 3> reduce;    // ! 链式法则求导
+#ifdef UNIT_SPHERE_ERROR
+        double norm = pts_camera_j.norm();
+        Eigen::Matrix3d norm_jaco;
+        double x1, x2, x3;
+        x1 = pts_camera_j(0);
+        x2 = pts_camera_j(1);
+        x3 = pts_camera_j(2);
+        norm_jaco << 1.0 / norm - x1 * x1 / pow(norm, 3), - x1 * x2 / pow(norm, 3),            - x1 * x3 / pow(norm, 3),
+                     - x1 * x2 / pow(norm, 3),            1.0 / norm - x2 * x2 / pow(norm, 3), - x2 * x3 / pow(norm, 3),
+                     - x1 * x3 / pow(norm, 3),            - x2 * x3 / pow(norm, 3),            1.0 / norm - x3 * x3 / pow(norm, 3);
+        reduce = obs.tangent_base * norm_jaco;
+#else
+        reduce << 1. / dep_j, 0, -pts_camera_j(0) / (dep_j * dep_j),
+            0, 1. / dep_j, -pts_camera_j(1) / (dep_j * dep_j);
+#endif
+        Eigen::Matrix2d robust_info = robust * sqrt_info;
+        reduce = robust_info * reduce;
+        Eigen::Matrix3d ric_Rj = ric.transpose() * Rj.transpose();
+        Eigen::Matrix3d tmp_r = ric_Rj * Ri_ric;    // 起始帧相机系到观测帧相机系的旋转
+
+        if (jacobians[0])
+        {
+            PoseJacobian jacobian_pose_i(jacobians[0], num_rows, 7);
+            jacobian_pose_i.block<2, 3>(2 * k, 0) = reduce * ric_Rj;
+            jacobian_pose_i.block<2, 3>(2 * k, 3) = reduce * ric_Rj * Ri_skew_i;
+            jacobian_pose_i.block<2, 1>(2 * k, 6).setZero();
+        }
+        if (jacobians[1])
+        {
+            PoseJacobian jacobian_ex_pose(jacobians[1], num_rows, 7);
+            jacobian_ex_pose.block<2, 3>(2 * k, 0) = reduce * (ric_Rj * Ri - ric.transpose());
+            jacobian_ex_pose.block<2, 3>(2 * k, 3) = reduce * (-tmp_r * Utility::skewSymmetric(pts_camera_i) + Utility::skewSymmetric(tmp_r * pts_camera_i) +
+                                                               Utility::skewSymmetric(ric.transpose() * (Rj.transpose() * (Ri_tic_Pi - Pj) - tic)));
+            jacobian_ex_pose.block<2, 1>(2 * k, 6).setZero();
+        }
+        if (jacobians[2])
+        {
+            Eigen::Map<Eigen::VectorXd> jacobian_feature(jacobians[2], num_rows);
+            jacobian_feature.segment<2>(2 * k) = reduce * tmp_r * pts_i_td * -1.0 / (inv_dep_i * inv_dep_i);
+        }
+        if (with_td && jacobians[3])
+        {
+            Eigen::Map<Eigen::VectorXd> jacobian_td(jacobians[3], num_rows);
+            jacobian_td.segment<2>(2 * k) = reduce * tmp_r * velocity_i / inv_dep_i * -1.0 +
+                                            robust_info * obs.velocity_j.head<2>();
+        }
+        if (jacobians[first_pose + k])
+        {
+            PoseJacobian jacobian_pose_j(jacobians[first_pose + k], num_rows, 7);
+            jacobian_pose_j.block<2, 3>(2 * k, 0) = -reduce * ric_Rj;
+            jacobian_pose_j.block<2, 3>(2 * k, 3) = reduce * ric.transpose() * Utility::skewSymmetric(pts_imu_j);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include <ros/assert.h>
+#include <ceres/ceres.h>
+#include <Eigen/Dense>
+#include "../utility/utility.h"
+#include "../parameters.h"
+
+/**
+ * @brief 一个地图点在滑窗里的所有重投影残差放在一个残差块里
+ *
+ * 参数块依次是：起始帧位姿7，外参7，逆深度1，（估计时间延时的话还有td 1），然后是每个观测帧的位姿7；
+ * 残差是每个观测2维依次排开。起始帧到世界系的变换只算一次，雅克比全部是定长的解析形式。
+ *
+ * 核函数在这里按每个观测单独作用，不能再交给ceres（ceres会把整个残差块当成一个残差）。
+ * 每个观测按ceres的Corrector做Triggs修正，正规方程（H和g）和逐个观测加核函数完全一致；
+ * ceres报告的代价是修正后残差的平方和，不是sum(rho)
+ */
+class ProjectionGroupFactor : public ceres::CostFunction
+{
+  public:
+    ProjectionGroupFactor(const Eigen::Vector3d &_pts_i, const Eigen::Vector2d &_velocity_i,
+                          const double _td_i, const double _row_i, bool _with_td, ceres::LossFunction *_loss_function);
+    // 加一个观测帧，对应的位姿参数块接在已有参数块后面
+    void addObservation(const Eigen::Vector3d &_pts_j, const Eigen::Vector2d &_velocity_j, const double _td_j, const double _row_j);
+    virtual bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const;
+
+    int numObservations() const
+    {
+        return observations.size();
+    }
+
+    struct Observation
+    {
+        Eigen::Vector3d pts_j;
+        Eigen::Vector3d velocity_j;
+        double td_j, row_j;
+        Eigen::Matrix<double, 2, 3> tangent_base;
+    };
+
+    Eigen::Vector3d pts_i;
+    Eigen::Vector3d velocity_i;
+    double td_i, row_i;
+    bool with_td;
+    int first_pose;     // 第一个观测帧位姿参数块的序号
+    std::vector<Observation> observations;
+    ceres::LossFunction *loss_function;     // 不归这里管
+    static Eigen::Matrix2d sqrt_info;
+};
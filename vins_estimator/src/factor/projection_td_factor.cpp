@@ -1,7 +1,6 @@
 #include "projection_td_factor.h"
 
 Eigen::Matrix2d ProjectionTdFactor::sqrt_info;
-double ProjectionTdFactor::sum_t;
 
 ProjectionTdFactor::ProjectionTdFactor(const Eigen::Vector3d &_pts_i, const Eigen::Vector3d &_pts_j, 
                                        const Eigen::Vector2d &_velocity_i, const Eigen::Vector2d &_velocity_j,
@@ -33,7 +32,6 @@ ProjectionTdFactor::ProjectionTdFactor(const Eigen::Vector3d &_pts_i, const Eige
 
 bool ProjectionTdFactor::Evaluate(double const *const *parameters, double *residuals, double **jacobians) const
 {
-    TicToc tic_toc;
     Eigen::Vector3d Pi(parameters[0][0], parameters[0][1], parameters[0][2]);
     Eigen::Quaterniond Qi(parameters[0][6], parameters[0][3], parameters[0][4], parameters[0][5]);
 
@@ -135,7 +133,6 @@ bool ProjectionTdFactor::Evaluate(double const *const *parameters, double *resid
                           sqrt_info * velocity_j.head(2);
         }
     }
-    sum_t += tic_toc.toc();
 
     return true;
 }
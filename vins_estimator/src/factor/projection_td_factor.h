@@ -22,5 +22,4 @@ class ProjectionTdFactor : public ceres::SizedCostFunction<2, 7, 7, 7, 1, 1>
     Eigen::Matrix<double, 2, 3> tangent_base;
     double row_i, row_j;
     static Eigen::Matrix2d sqrt_info;
-    static double sum_t;
 };
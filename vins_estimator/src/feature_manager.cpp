@@ -1,18 +1,16 @@
 #include "feature_manager.h"
+#include "factor/marginalization_factor.h"
 
-int FeaturePerId::endFrame()
-{
-    return start_frame + feature_per_frame.size() - 1;
-}
-
-FeatureManager::FeatureManager(Matrix3d _Rs[])
+template <int WINDOW_SIZE>
+FeatureManager<WINDOW_SIZE>::FeatureManager(Matrix3d _Rs[])
     : Rs(_Rs)
 {
     for (int i = 0; i < NUM_OF_CAM; i++)
         ric[i].setIdentity();
 }
 
-void FeatureManager::setRic(Matrix3d _ric[])
+template <int WINDOW_SIZE>
+void FeatureManager<WINDOW_SIZE>::setRic(Matrix3d _ric[])
 {
     for (int i = 0; i < NUM_OF_CAM; i++)
     {
@@ -20,7 +18,8 @@ void FeatureManager::setRic(Matrix3d _ric[])
     }
 }
 
-void FeatureManager::clearState()
+template <int WINDOW_SIZE>
+void FeatureManager<WINDOW_SIZE>::clearState()
 {
     feature.clear();
 }
@@ -30,7 +29,8 @@ void FeatureManager::clearState()
  * 
  * @return int 
  */
-int FeatureManager::getFeatureCount()
+template <int WINDOW_SIZE>
+int FeatureManager<WINDOW_SIZE>::getFeatureCount()
 {
     int cnt = 0;
     for (auto &it : feature)
@@ -55,34 +55,34 @@ int FeatureManager::getFeatureCount()
  * @return true 
  * @return false 
  */
-bool FeatureManager::addFeatureCheckParallax(int frame_count, const map<int, vector<pair<int, Eigen::Matrix<double, 7, 1>>>> &image, double td)
-{   // ? map<int, vector<pair<int, Eigen::Matrix<double, 7, 1>>>> &image 什么格式？map<featureid, vector<?, 该特征在被看到帧中的信息>>
+template <int WINDOW_SIZE>
+bool FeatureManager<WINDOW_SIZE>::addFeatureCheckParallax(int frame_count, const ImageFeatures &image, double td)
+{   // image按特征点id排好序，同一个id的多个相机观测相邻
     ROS_DEBUG("input feature: %d", (int)image.size());
     ROS_DEBUG("num of feature: %d", getFeatureCount());
     double parallax_sum = 0;
     int parallax_num = 0;
     last_track_num = 0;
     // 遍历每个特征点
-    for (auto &id_pts : image)
+    for (unsigned int i = 0; i < image.size(); i++)
     {
+        // 只用第一个相机的观测，单目时每个id只有一个
+        if (i > 0 && image[i].feature_id == image[i - 1].feature_id)
+            continue;
         // 用特征点信息构造一个特征对象
-        FeaturePerFrame f_per_fra(id_pts.second[0].second, td);   // ? 取索引0？难道vector就一个？
-
-        int feature_id = id_pts.first;   // 特征id
-        // ! 在已有的id中寻找是否是有相同的特征点，feature存储了所有特征
-        auto it = find_if(feature.begin(), feature.end(), [feature_id](const FeaturePerId &it)
-                          {
-            return it.feature_id == feature_id;
-                          });
+        FeaturePerFrame f_per_fra(image[i].xyz_uv_velocity, td);
+
+        int feature_id = image[i].feature_id;   // 特征id
+        // ! 在已有的id中寻找是否是有相同的特征点，feature存储了所有特征，按id哈希查找
+        Feature *it = feature.find(feature_id);
         // 这是一个新的特征点，是在frame_count中代表帧中第一次被看到的
-        if (it == feature.end())
+        if (it == nullptr)
         {
             // 在特征点管理器中，新创建一个特征点id，这里的frame_count就是该特征点在滑窗中的当前位置，作为这个特征点的起始位置
-            feature.push_back(FeaturePerId(feature_id, frame_count));
-            feature.back().feature_per_frame.push_back(f_per_fra);
+            feature.add(feature_id, frame_count).feature_per_frame.push_back(f_per_fra);
         }
         // 如果这是一个已有的特征点，就在对应的“组织”下增加一个帧属性
-        else if (it->feature_id == feature_id)
+        else
         {
             it->feature_per_frame.push_back(f_per_fra);
             last_track_num++;   // 追踪到上一帧的特征点数目
@@ -117,7 +117,8 @@ bool FeatureManager::addFeatureCheckParallax(int frame_count, const map<int, vec
     }
 }
 
-void FeatureManager::debugShow()
+template <int WINDOW_SIZE>
+void FeatureManager<WINDOW_SIZE>::debugShow()
 {
     ROS_DEBUG("debug show");
     for (auto &it : feature)
@@ -146,7 +147,8 @@ void FeatureManager::debugShow()
  * @return vector<pair<Vector3d, Vector3d>> 
  */
 
-vector<pair<Vector3d, Vector3d>> FeatureManager::getCorresponding(int frame_count_l, int frame_count_r)
+template <int WINDOW_SIZE>
+vector<pair<Vector3d, Vector3d>> FeatureManager<WINDOW_SIZE>::getCorresponding(int frame_count_l, int frame_count_r)
 {
     vector<pair<Vector3d, Vector3d>> corres;
     for (auto &it : feature)
@@ -169,7 +171,8 @@ vector<pair<Vector3d, Vector3d>> FeatureManager::getCorresponding(int frame_coun
     return corres;
 }
 
-void FeatureManager::setDepth(const VectorXd &x)
+template <int WINDOW_SIZE>
+void FeatureManager<WINDOW_SIZE>::setDepth(const VectorXd &x)
 {
     int feature_index = -1;
     for (auto &it_per_id : feature)
@@ -193,15 +196,11 @@ void FeatureManager::setDepth(const VectorXd &x)
  * @brief 移除一些不能被三角化的点
  * 
  */
-void FeatureManager::removeFailures()
+template <int WINDOW_SIZE>
+void FeatureManager<WINDOW_SIZE>::removeFailures()
 {
-    for (auto it = feature.begin(), it_next = feature.begin();
-         it != feature.end(); it = it_next)
-    {
-        it_next++;
-        if (it->solve_flag == 2)
-            feature.erase(it);
-    }
+    feature.removeIf([](Feature &it)
+                     { return it.solve_flag == 2; });
 }
 
 /**
@@ -209,7 +208,8 @@ void FeatureManager::removeFailures()
  * 
  * @param[in] x 
  */
-void FeatureManager::clearDepth(const VectorXd &x)
+template <int WINDOW_SIZE>
+void FeatureManager<WINDOW_SIZE>::clearDepth(const VectorXd &x)
 {
     int feature_index = -1;
     for (auto &it_per_id : feature)
@@ -226,7 +226,8 @@ void FeatureManager::clearDepth(const VectorXd &x)
  * 
  * @return VectorXd 
  */
-VectorXd FeatureManager::getDepthVector()
+template <int WINDOW_SIZE>
+VectorXd FeatureManager<WINDOW_SIZE>::getDepthVector()
 {
     VectorXd dep_vec(getFeatureCount());
     int feature_index = -1;
@@ -244,16 +245,77 @@ VectorXd FeatureManager::getDepthVector()
     return dep_vec;
 }
 
+/**
+ * @brief 单个特征点的多帧三角化
+ *
+ * 每个观测贡献超定方程A的两行，直接累加定长的4x4矩阵A^T * A，不用构造2n x 4的A再做SVD；
+ * A^T * A最小特征值对应的特征向量就是A最小奇异值对应的右奇异向量
+ *
+ * @param[in] R_c t_c 滑窗每一帧相机在世界系下的位姿
+ */
+template <int WINDOW_SIZE>
+static void triangulatePoint(FeaturePerId<WINDOW_SIZE> &it_per_id, const Eigen::Matrix3d R_c[], const Eigen::Vector3d t_c[])
+{
+    int imu_i = it_per_id.start_frame, imu_j = imu_i - 1;
+    // 第一个观察到这个特征点的KF的位姿
+    const Eigen::Matrix3d &R0 = R_c[imu_i];
+    const Eigen::Vector3d &t0 = t_c[imu_i];
+    Eigen::Matrix4d ATA = Eigen::Matrix4d::Zero();
+    // 遍历所有看到这个特征点的KF
+    for (auto &it_per_frame : it_per_id.feature_per_frame)
+    {
+        imu_j++;
+        // T_w_cj -> T_c0_cj
+        Eigen::Vector3d t = R0.transpose() * (t_c[imu_j] - t0);
+        Eigen::Matrix3d R = R0.transpose() * R_c[imu_j];
+        Eigen::Matrix<double, 3, 4> P;
+        // T_c0_cj -> T_cj_c0相当于把c0当作世界系
+        P.leftCols<3>() = R.transpose();
+        P.rightCols<1>() = -R.transpose() * t;
+        Eigen::Vector3d f = it_per_frame.point.normalized();
+
+        // ! 超定方程的其中两个方程
+        Eigen::RowVector4d row0 = f[0] * P.row(2) - f[2] * P.row(0);
+        Eigen::RowVector4d row1 = f[1] * P.row(2) - f[2] * P.row(1);
+        ATA.noalias() += row0.transpose() * row0 + row1.transpose() * row1;
+    }
+    // 特征值升序排列，第0列就是最小特征值对应的特征向量
+    Eigen::Vector4d svd_V = Eigen::SelfAdjointEigenSolver<Eigen::Matrix4d>(ATA).eigenvectors().col(0);
+    // 求解齐次坐标下的深度
+    double svd_method = svd_V[2] / svd_V[3];
+    // 得到的深度值实际上就是第一个观察到这个特征点的相机坐标系下的深度值
+    it_per_id.estimated_depth = svd_method;
+
+    if (it_per_id.estimated_depth < 0.1)
+    {
+        it_per_id.estimated_depth = INIT_DEPTH; // 具体太近就设置成默认值
+    }
+}
+
 /**
  * @brief 利用观测到该特征点的 --所有位姿-- 来三角化特征点
  * 
+ * 每一帧的相机位姿只算一次，要三角化的特征点分段交给线程池，每个特征点只写自己的深度
+ * 
  * @param[in] Ps 
  * @param[in] tic 
  * @param[in] ric 
  */
-void FeatureManager::triangulate(Vector3d Ps[], Vector3d tic[], Matrix3d ric[])
+template <int WINDOW_SIZE>
+void FeatureManager<WINDOW_SIZE>::triangulate(Vector3d Ps[], Vector3d tic[], Matrix3d ric[])
 {
-    // 遍历每一个特征点
+    ROS_ASSERT(NUM_OF_CAM == 1);
+    // Twi -> Twc
+    Eigen::Matrix3d R_c[WINDOW_SIZE + 1];
+    Eigen::Vector3d t_c[WINDOW_SIZE + 1];
+    for (int i = 0; i <= WINDOW_SIZE; i++)
+    {
+        t_c[i] = Ps[i] + Rs[i] * tic[0];
+        R_c[i] = Rs[i] * ric[0];
+    }
+
+    // 挑出还没三角化过的有效特征点
+    vector<Feature *> points;
     for (auto &it_per_id : feature)
     {
         it_per_id.used_num = it_per_id.feature_per_frame.size();
@@ -262,73 +324,27 @@ void FeatureManager::triangulate(Vector3d Ps[], Vector3d tic[], Matrix3d ric[])
 
         if (it_per_id.estimated_depth > 0)  // 代表已经三角化过了
             continue;
-        int imu_i = it_per_id.start_frame, imu_j = imu_i - 1;
-
-        ROS_ASSERT(NUM_OF_CAM == 1);
-        Eigen::MatrixXd svd_A(2 * it_per_id.feature_per_frame.size(), 4);
-        int svd_idx = 0;
-
-        Eigen::Matrix<double, 3, 4> P0;
-        // Twi -> Twc,第一个观察到这个特征点的KF的位姿
-        Eigen::Vector3d t0 = Ps[imu_i] + Rs[imu_i] * tic[0];
-        Eigen::Matrix3d R0 = Rs[imu_i] * ric[0];
-        P0.leftCols<3>() = Eigen::Matrix3d::Identity();
-        P0.rightCols<1>() = Eigen::Vector3d::Zero();
-        // 遍历所有看到这个特征点的KF
-        for (auto &it_per_frame : it_per_id.feature_per_frame)
-        {
-            imu_j++;
-            // 得到该KF的相机坐标系位姿
-            Eigen::Vector3d t1 = Ps[imu_j] + Rs[imu_j] * tic[0];
-            Eigen::Matrix3d R1 = Rs[imu_j] * ric[0];
-            // T_w_cj -> T_c0_cj
-            Eigen::Vector3d t = R0.transpose() * (t1 - t0);
-            Eigen::Matrix3d R = R0.transpose() * R1;
-            Eigen::Matrix<double, 3, 4> P;
-            // T_c0_cj -> T_cj_c0相当于把c0当作世界系
-            P.leftCols<3>() = R.transpose();
-            P.rightCols<1>() = -R.transpose() * t;
-            Eigen::Vector3d f = it_per_frame.point.normalized();
-
-            // ! 构建超定方程的其中两个方程
-            svd_A.row(svd_idx++) = f[0] * P.row(2) - f[2] * P.row(0);
-            svd_A.row(svd_idx++) = f[1] * P.row(2) - f[2] * P.row(1);
-
-            if (imu_i == imu_j)  // ? 这个if没用啊
-                continue;
-        }
-        ROS_ASSERT(svd_idx == svd_A.rows());
-        Eigen::Vector4d svd_V = Eigen::JacobiSVD<Eigen::MatrixXd>(svd_A, Eigen::ComputeThinV).matrixV().rightCols<1>();
-        // 求解齐次坐标下的深度
-        double svd_method = svd_V[2] / svd_V[3];
-        //it_per_id->estimated_depth = -b / A;
-        //it_per_id->estimated_depth = svd_V[2] / svd_V[3];
-        // 得到的深度值实际上就是第一个观察到这个特征点的相机坐标系下的深度值
-        it_per_id.estimated_depth = svd_method;
-        //it_per_id->estimated_depth = INIT_DEPTH;
-
-        if (it_per_id.estimated_depth < 0.1)
-        {
-            it_per_id.estimated_depth = INIT_DEPTH; // 具体太近就设置成默认值
-        }
-
+        points.push_back(&it_per_id);
     }
+
+    // 平时每帧只有几个新点，一段就在调用线程里算完
+    const int chunk = 32;
+    int num_points = points.size();
+    estimatorPool().run((num_points + chunk - 1) / chunk, [&](int c)
+    {
+        int end = std::min(num_points, (c + 1) * chunk);
+        for (int k = c * chunk; k < end; k++)
+            triangulatePoint(*points[k], R_c, t_c);
+    });
+    ROS_DEBUG("triangulate %d features", num_points);
 }
 
-void FeatureManager::removeOutlier()
+template <int WINDOW_SIZE>
+void FeatureManager<WINDOW_SIZE>::removeOutlier()
 {
     ROS_BREAK();
-    int i = -1;
-    for (auto it = feature.begin(), it_next = feature.begin();
-         it != feature.end(); it = it_next)
-    {
-        it_next++;
-        i += it->used_num != 0;
-        if (it->used_num != 0 && it->is_outlier == true)
-        {
-            feature.erase(it);
-        }
-    }
+    feature.removeIf([](Feature &it)
+                     { return it.used_num != 0 && it.is_outlier == true; });
 }
 
 /**
@@ -340,91 +356,70 @@ void FeatureManager::removeOutlier()
  * @param[in] new_P 
  */
 
-void FeatureManager::removeBackShiftDepth(Eigen::Matrix3d marg_R, Eigen::Vector3d marg_P, Eigen::Matrix3d new_R, Eigen::Vector3d new_P)
+template <int WINDOW_SIZE>
+void FeatureManager<WINDOW_SIZE>::removeBackShiftDepth(Eigen::Matrix3d marg_R, Eigen::Vector3d marg_P, Eigen::Matrix3d new_R, Eigen::Vector3d new_P)
 {
-    for (auto it = feature.begin(), it_next = feature.begin();
-         it != feature.end(); it = it_next)
-    {
-        it_next++;
-
-        if (it->start_frame != 0)   // 如果不是被移除的帧看到，那么该地图点对应的起始帧id减一
-            it->start_frame--;
+    feature.removeIf([&](Feature &it)
+                     {
+        if (it.start_frame != 0)   // 如果不是被移除的帧看到，那么该地图点对应的起始帧id减一
+            it.start_frame--;
         else
         {
-            Eigen::Vector3d uv_i = it->feature_per_frame[0].point;    // 取出归一化相机坐标系坐标
-            it->feature_per_frame.erase(it->feature_per_frame.begin()); // 该点不再被原来的第一帧看到，因此从中移除
-            if (it->feature_per_frame.size() < 2)   // 如果这个地图点没有至少被两帧看到
-            {
-                feature.erase(it);  // 那他就没有存在的价值了
-                continue;
-            }
-            else    // 进行管辖权的转交
-            {
-                Eigen::Vector3d pts_i = uv_i * it->estimated_depth; // 实际相机坐标系下的坐标
-                Eigen::Vector3d w_pts_i = marg_R * pts_i + marg_P;  // 转到世界坐标系下
-                Eigen::Vector3d pts_j = new_R.transpose() * (w_pts_i - new_P);  // 转到新的最老帧的相机坐标系下
-                double dep_j = pts_j(2);
-                if (dep_j > 0)  // 看看深度是否有效
-                    it->estimated_depth = dep_j;    // 有效的话就得到在现在最老帧下的深度值
-                else
-                    it->estimated_depth = INIT_DEPTH;   // 无效就设置默认值
-            }
+            Eigen::Vector3d uv_i = it.feature_per_frame[0].point;    // 取出归一化相机坐标系坐标
+            it.feature_per_frame.erase(it.feature_per_frame.begin()); // 该点不再被原来的第一帧看到，因此从中移除
+            if (it.feature_per_frame.size() < 2)   // 如果这个地图点没有至少被两帧看到
+                return true;  // 那他就没有存在的价值了
+            // 进行管辖权的转交
+            Eigen::Vector3d pts_i = uv_i * it.estimated_depth; // 实际相机坐标系下的坐标
+            Eigen::Vector3d w_pts_i = marg_R * pts_i + marg_P;  // 转到世界坐标系下
+            Eigen::Vector3d pts_j = new_R.transpose() * (w_pts_i - new_P);  // 转到新的最老帧的相机坐标系下
+            double dep_j = pts_j(2);
+            if (dep_j > 0)  // 看看深度是否有效
+                it.estimated_depth = dep_j;    // 有效的话就得到在现在最老帧下的深度值
+            else
+                it.estimated_depth = INIT_DEPTH;   // 无效就设置默认值
         }
         // remove tracking-lost feature after marginalize
-        /*
-        if (it->endFrame() < WINDOW_SIZE - 1)
-        {
-            feature.erase(it);
-        }
-        */
-    }
+        return false; });
 }
 /**
  * @brief 这个还没初始化结束，因此相比刚才，不进行地图点新的深度的换算，因为此时还有进行视觉惯性对齐
  * 
  */
-void FeatureManager::removeBack()
+template <int WINDOW_SIZE>
+void FeatureManager<WINDOW_SIZE>::removeBack()
 {
-    for (auto it = feature.begin(), it_next = feature.begin();
-         it != feature.end(); it = it_next)
-    {
-        it_next++;
-
-        if (it->start_frame != 0)
-            it->start_frame--;
-        else
+    feature.removeIf([](Feature &it)
+                     {
+        if (it.start_frame != 0)
         {
-            it->feature_per_frame.erase(it->feature_per_frame.begin());
-            if (it->feature_per_frame.size() == 0)
-                feature.erase(it);
+            it.start_frame--;
+            return false;
         }
-    }
+        it.feature_per_frame.erase(it.feature_per_frame.begin());
+        return it.feature_per_frame.size() == 0; });
 }
 
 // 对margin倒数第二帧进行处理
-void FeatureManager::removeFront(int frame_count)
+template <int WINDOW_SIZE>
+void FeatureManager<WINDOW_SIZE>::removeFront(int frame_count)
 {
-    for (auto it = feature.begin(), it_next = feature.begin(); it != feature.end(); it = it_next)
-    {
-        it_next++;
-
-        if (it->start_frame == frame_count) // 如果地图点被最后一帧看到，由于滑窗，他的起始帧减1
+    feature.removeIf([frame_count](Feature &it)
+                     {
+        if (it.start_frame == frame_count) // 如果地图点被最后一帧看到，由于滑窗，他的起始帧减1
         {
-            it->start_frame--;
+            it.start_frame--;
+            return false;
         }
-        else
-        {
-            int j = WINDOW_SIZE - 1 - it->start_frame;  // 倒数第二帧在这个地图点对应KF vector的idx
-            if (it->endFrame() < frame_count - 1)   // 如果该地图点不能被倒数第二帧看到，那没什么好做的
-                continue;
-            it->feature_per_frame.erase(it->feature_per_frame.begin() + j); // 能被倒数第二帧看到，erase掉这个索引
-            if (it->feature_per_frame.size() == 0)  // 如果这个地图点没有别的观测了
-                feature.erase(it);  // 就没有存在的价值了
-        }
-    }
+        int j = WINDOW_SIZE - 1 - it.start_frame;  // 倒数第二帧在这个地图点对应KF vector的idx
+        if (it.endFrame() < frame_count - 1)   // 如果该地图点不能被倒数第二帧看到，那没什么好做的
+            return false;
+        it.feature_per_frame.erase(it.feature_per_frame.begin() + j); // 能被倒数第二帧看到，erase掉这个索引
+        return it.feature_per_frame.size() == 0; });  // 如果这个地图点没有别的观测了，就没有存在的价值了
 }
 
-double FeatureManager::compensatedParallax2(const FeaturePerId &it_per_id, int frame_count)
+template <int WINDOW_SIZE>
+double FeatureManager<WINDOW_SIZE>::compensatedParallax2(const Feature &it_per_id, int frame_count)
 {
     //check the second last frame is keyframe or not
     //parallax betwwen seconde last frame and third last frame
@@ -458,4 +453,10 @@ double FeatureManager::compensatedParallax2(const FeaturePerId &it_per_id, int f
     ans = max(ans, sqrt(min(du * du + dv * dv, du_comp * du_comp + dv_comp * dv_comp)));
 
     return ans;
-}
\ No newline at end of file
+}
+
+// 预先编译的滑窗大小，和createEstimator()里的一致
+template class FeatureManager<5>;
+template class FeatureManager<10>;
+template class FeatureManager<15>;
+template class FeatureManager<20>;
@@ -1,10 +1,10 @@
 #ifndef FEATURE_MANAGER_H
 #define FEATURE_MANAGER_H
 
-#include <list>
 #include <algorithm>
 #include <vector>
 #include <numeric>
+#include <unordered_map>
 using namespace std;
 
 #include <eigen3/Eigen/Dense>
@@ -15,10 +15,21 @@ using namespace Eigen;
 
 #include "parameters.h"
 
+// 前端一帧里某个特征点在某个相机中的观测：归一化坐标xyz，像素坐标uv，速度
+struct FeatureObservation
+{
+    int feature_id;
+    int camera_id;
+    Eigen::Matrix<double, 7, 1> xyz_uv_velocity;
+};
+// 前端的一帧，按(特征点id, 相机id)升序排列，同一个特征点的多个相机观测相邻
+typedef vector<FeatureObservation> ImageFeatures;
+
 // 某个特征点在被看到帧的属性
 class FeaturePerFrame
 {
   public:
+    FeaturePerFrame() {}
     FeaturePerFrame(const Eigen::Matrix<double, 7, 1> &_point, double td)
     {
         point.x() = _point(0);
@@ -37,18 +48,60 @@ class FeaturePerFrame
     double z;
     bool is_used;
     double parallax;
-    MatrixXd A;
-    VectorXd b;
     double dep_gradient;
 };
 
-// 特征点对象
+// 定长数组，接口和vector一样，一个特征点最多被滑窗里的WINDOW_SIZE + 1帧看到，观测不用动态分配
+template <typename T, int N>
+class FixedVector
+{
+  public:
+    typedef T *iterator;
+    typedef const T *const_iterator;
+
+    FixedVector() : n(0) {}
+
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    T &operator[](size_t i) { return data[i]; }
+    const T &operator[](size_t i) const { return data[i]; }
+    T &front() { return data[0]; }
+    const T &front() const { return data[0]; }
+    T &back() { return data[n - 1]; }
+    const T &back() const { return data[n - 1]; }
+    iterator begin() { return data; }
+    iterator end() { return data + n; }
+    const_iterator begin() const { return data; }
+    const_iterator end() const { return data + n; }
+
+    void push_back(const T &v)
+    {
+        ROS_ASSERT(n < (size_t)N);
+        data[n++] = v;
+    }
+
+    iterator erase(iterator pos)
+    {
+        std::move(pos + 1, end(), pos);
+        n--;
+        return pos;
+    }
+
+    void clear() { n = 0; }
+
+  private:
+    T data[N];
+    size_t n;
+};
+
+// 特征点对象，观测数组的长度跟着滑窗大小
+template <int WINDOW_SIZE>
 class FeaturePerId
 {
   public:
-    const int feature_id;  // id号
+    int feature_id;  // id号
     int start_frame;   // 滑窗内检测到该特征的最早帧
-    vector<FeaturePerFrame> feature_per_frame;  // 该id对应的特征点在被看到每个帧中的属性
+    FixedVector<FeaturePerFrame, WINDOW_SIZE + 1> feature_per_frame;  // 该id对应的特征点在被看到每个帧中的属性
 
     int used_num;
     bool is_outlier;
@@ -64,12 +117,123 @@ class FeaturePerId
     {
     }
 
-    int endFrame();
+    int endFrame() const
+    {
+        return start_frame + feature_per_frame.size() - 1;
+    }
 };
 
+/**
+ * @brief 滑窗里所有的特征点，连续存放在槽位数组里
+ *
+ * id->槽位用哈希表查，删掉的特征点的槽位回收给新特征点；遍历按加入的先后顺序，
+ * 也就是id升序，和原来的list一致，回环重定位按id归并匹配点依赖这个顺序
+ */
+template <int WINDOW_SIZE>
+class FeatureStore
+{
+    template <typename Store, typename Value>
+    class Iterator
+    {
+      public:
+        Iterator(Store *_store, size_t _i) : store(_store), i(_i) {}
+        Value &operator*() const { return store->slots[store->order[i]]; }
+        Value *operator->() const { return &store->slots[store->order[i]]; }
+        Iterator &operator++()
+        {
+            i++;
+            return *this;
+        }
+        bool operator==(const Iterator &other) const { return i == other.i; }
+        bool operator!=(const Iterator &other) const { return i != other.i; }
+
+      private:
+        Store *store;
+        size_t i;
+    };
+
+  public:
+    typedef FeaturePerId<WINDOW_SIZE> Feature;
+    typedef Iterator<FeatureStore, Feature> iterator;
+    typedef Iterator<const FeatureStore, const Feature> const_iterator;
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, order.size()); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, order.size()); }
+    size_t size() const { return order.size(); }
+
+    Feature *find(int feature_id)
+    {
+        auto it = index.find(feature_id);
+        return it == index.end() ? nullptr : &slots[it->second];
+    }
+
+    // 新特征点优先用回收的槽位，返回的引用在下一次add()之前有效
+    Feature &add(int feature_id, int start_frame)
+    {
+        int slot;
+        if (free_slots.empty())
+        {
+            slot = slots.size();
+            slots.push_back(Feature(feature_id, start_frame));
+        }
+        else
+        {
+            slot = free_slots.back();
+            free_slots.pop_back();
+            slots[slot] = Feature(feature_id, start_frame);
+        }
+        index[feature_id] = slot;
+        order.push_back(slot);
+        return slots[slot];
+    }
+
+    // 按顺序对每个特征点调用pred，返回true的删掉并回收槽位，剩下的保持原来的顺序
+    template <typename Pred>
+    void removeIf(Pred pred)
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            int slot = order[i];
+            if (pred(slots[slot]))
+            {
+                index.erase(slots[slot].feature_id);
+                free_slots.push_back(slot);
+            }
+            else
+                order[kept++] = slot;
+        }
+        order.resize(kept);
+    }
+
+    void clear()
+    {
+        slots.clear();
+        order.clear();
+        free_slots.clear();
+        index.clear();
+    }
+
+  private:
+    vector<Feature> slots;
+    vector<int> order;      // 在用的槽位，按加入顺序
+    vector<int> free_slots;
+    unordered_map<int, int> index;  // feature_id -> 槽位
+};
+
+/**
+ * @brief 滑窗里的特征点管理，滑窗大小是模板参数
+ *
+ * 预先实例化的滑窗大小见feature_manager.cpp末尾，和Estimator的一致
+ */
+template <int WINDOW_SIZE>
 class FeatureManager
 {
   public:
+    typedef FeaturePerId<WINDOW_SIZE> Feature;
+
     FeatureManager(Matrix3d _Rs[]);
 
     void setRic(Matrix3d _ric[]);
@@ -78,7 +242,7 @@ class FeatureManager
 
     int getFeatureCount();
 
-    bool addFeatureCheckParallax(int frame_count, const map<int, vector<pair<int, Eigen::Matrix<double, 7, 1>>>> &image, double td);
+    bool addFeatureCheckParallax(int frame_count, const ImageFeatures &image, double td);
     void debugShow();
     vector<pair<Vector3d, Vector3d>> getCorresponding(int frame_count_l, int frame_count_r);
 
@@ -92,11 +256,11 @@ class FeatureManager
     void removeBack();
     void removeFront(int frame_count);
     void removeOutlier();
-    list<FeaturePerId> feature;   // 存储所有的特征
+    FeatureStore<WINDOW_SIZE> feature;   // 存储所有的特征
     int last_track_num;
 
   private:
-    double compensatedParallax2(const FeaturePerId &it_per_id, int frame_count);
+    double compensatedParallax2(const Feature &it_per_id, int frame_count);
     const Matrix3d *Rs;
     Matrix3d ric[NUM_OF_CAM];
 };
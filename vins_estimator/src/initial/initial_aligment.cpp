@@ -5,8 +5,9 @@
  * 
  * @param[in] all_image_frame 
  * @param[in] Bgs 
+ * @param[in] window_size Bgs的长度是window_size + 1
  */
-void solveGyroscopeBias(map<double, ImageFrame> &all_image_frame, Vector3d* Bgs)
+void solveGyroscopeBias(map<double, ImageFrame> &all_image_frame, Vector3d* Bgs, int window_size)
 {
     Matrix3d A;
     Vector3d b;
@@ -32,7 +33,7 @@ void solveGyroscopeBias(map<double, ImageFrame> &all_image_frame, Vector3d* Bgs)
     delta_bg = A.ldlt().solve(b);   // delta_bg是个补偿
     ROS_WARN_STREAM("gyroscope bias initial calibration " << delta_bg.transpose());
     // 滑窗中的零偏设置为求解出来的零偏
-    for (int i = 0; i <= WINDOW_SIZE; i++)
+    for (int i = 0; i <= window_size; i++)
         Bgs[i] += delta_bg;  // ! 累加
     // 对all_image_frame中预积分量根据当前零偏重新积分
     for (frame_i = all_image_frame.begin(); next(frame_i) != all_image_frame.end( ); frame_i++)
@@ -228,15 +229,16 @@ bool LinearAlignment(map<double, ImageFrame> &all_image_frame, Vector3d &g, Vect
  * 
  * @param[in] all_image_frame 每帧的位姿和对应的预积分量
  * @param[out] Bgs 陀螺仪零偏
+ * @param[in] window_size 滑窗大小，Bgs的长度是window_size + 1
  * @param[out] g 重力向量
  * @param[out] x 其他状态量
  * @return true 
  * @return false 
  */
 
-bool VisualIMUAlignment(map<double, ImageFrame> &all_image_frame, Vector3d* Bgs, Vector3d &g, VectorXd &x)
+bool VisualIMUAlignment(map<double, ImageFrame> &all_image_frame, Vector3d* Bgs, int window_size, Vector3d &g, VectorXd &x)
 {
-    solveGyroscopeBias(all_image_frame, Bgs);
+    solveGyroscopeBias(all_image_frame, Bgs, window_size);
 
     if(LinearAlignment(all_image_frame, g, x))
         return true;
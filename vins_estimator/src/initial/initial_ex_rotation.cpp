@@ -1,7 +1,8 @@
 #include "initial_ex_rotation.h"
 
-InitialEXRotation::InitialEXRotation(){
+InitialEXRotation::InitialEXRotation(int _window_size){
     frame_count = 0;
+    window_size = _window_size;
     Rc.push_back(Matrix3d::Identity());
     Rc_g.push_back(Matrix3d::Identity());
     Rimu.push_back(Matrix3d::Identity());
@@ -72,7 +73,7 @@ bool InitialEXRotation::CalibrationExRotation(vector<pair<Vector3d, Vector3d>> c
     Vector3d ric_cov;
     ric_cov = svd.singularValues().tail<3>();
     // > 倒数第二个奇异值，因为旋转是3个自由度，因此检查一下第三小的奇异值是否足够大，通常需要足够的运动激励才能保证得到没有奇异的解
-    if (frame_count >= WINDOW_SIZE && ric_cov(1) > 0.25)
+    if (frame_count >= window_size && ric_cov(1) > 0.25)
     {
         calib_ric_result = ric;
         return true;
@@ -14,7 +14,7 @@ using namespace Eigen;
 class InitialEXRotation
 {
 public:
-	InitialEXRotation();
+	InitialEXRotation(int _window_size);
     bool CalibrationExRotation(vector<pair<Vector3d, Vector3d>> corres, Quaterniond delta_q_imu, Matrix3d &calib_ric_result);
 private:
 	Matrix3d solveRelativeR(const vector<pair<Vector3d, Vector3d>> &corres);
@@ -26,6 +26,7 @@ private:
                     cv::Mat_<double> &R1, cv::Mat_<double> &R2,
                     cv::Mat_<double> &t1, cv::Mat_<double> &t2);
     int frame_count;
+    int window_size;    // 估计器的滑窗大小，攒够这么多帧才认为标定结果可用
 
     vector< Matrix3d > Rc;
     vector< Matrix3d > Rimu;
@@ -4,6 +4,7 @@ double INIT_DEPTH;
 double MIN_PARALLAX;
 double ACC_N, ACC_W;
 double GYR_N, GYR_W;
+double IMU_AVERAGE_RATE;
 
 std::vector<Eigen::Matrix3d> RIC;
 std::vector<Eigen::Vector3d> TIC;
@@ -14,11 +15,14 @@ double BIAS_ACC_THRESHOLD;
 double BIAS_GYR_THRESHOLD;
 double SOLVER_TIME;
 int NUM_ITERATIONS;
+int WINDOW_SOLVER;
+int SLIDING_WINDOW_SIZE;
 int ESTIMATE_EXTRINSIC;
 int ESTIMATE_TD;
 int ROLLING_SHUTTER;
 std::string EX_CALIB_RESULT_PATH;
 std::string VINS_RESULT_PATH;
+std::string SOLVER_COMPARE_PATH;
 std::string IMU_TOPIC;
 double ROW, COL;
 double TD, TR;
@@ -53,6 +57,11 @@ void readParameters(ros::NodeHandle &n)
 
     SOLVER_TIME = fsSettings["max_solver_time"];    // 单次优化最大求解时间
     NUM_ITERATIONS = fsSettings["max_num_iterations"];  // 单词优化最大迭代次数
+    WINDOW_SOLVER = fsSettings["window_solver"];    // 0: ceres，1: 滑窗专用的LM，2: 两个都跑并对比，用ceres的结果
+    SLIDING_WINDOW_SIZE = fsSettings["window_size"];    // 滑窗大小，只能取预先编译的5/10/15/20
+    if (SLIDING_WINDOW_SIZE == 0)
+        SLIDING_WINDOW_SIZE = 10;
+    ROS_INFO("window size: %d", SLIDING_WINDOW_SIZE);
     MIN_PARALLAX = fsSettings["keyframe_parallax"]; // 根据视差确定关键帧
     MIN_PARALLAX = MIN_PARALLAX / FOCAL_LENGTH; // 虚拟相机的trick
 
@@ -66,6 +75,14 @@ void readParameters(ros::NodeHandle &n)
 
     std::ofstream fout(VINS_RESULT_PATH, std::ios::out);
     fout.close();
+    // 对比模式每帧记一行两个求解器的结果，整段序列跑完再对比
+    if (WINDOW_SOLVER == 2)
+    {
+        SOLVER_COMPARE_PATH = OUTPUT_PATH + "/solver_compare.csv";
+        std::ofstream fout_compare(SOLVER_COMPARE_PATH, std::ios::out);
+        fout_compare << "stamp,ceres_initial_cost,ceres_final_cost,ceres_iterations,ceres_ms,"
+                     << "window_initial_cost,window_final_cost,window_iterations,window_ms,max_position_diff,max_state_diff" << std::endl;
+    }
 
     // imu、图像相关参数
     ACC_N = fsSettings["acc_n"];  // nosie
@@ -73,8 +90,19 @@ void readParameters(ros::NodeHandle &n)
     GYR_N = fsSettings["gyr_n"];  // noise
     GYR_W = fsSettings["gyr_w"];  // 随机游走
     G.z() = fsSettings["g_norm"];  // g
+    IMU_AVERAGE_RATE = fsSettings["imu_average_rate"];  // 高频imu先分段预平均，0不启用
+    if (IMU_AVERAGE_RATE > 0)
+        ROS_INFO("pre-average imu into %f Hz intervals", IMU_AVERAGE_RATE);
     ROW = fsSettings["image_height"];
     COL = fsSettings["image_width"];
+    // 前端缩小解码时特征点的像素坐标在解码后的图像上，卷帘快门按行算时间也要用缩小后的行数
+    int compressed_image = fsSettings["compressed_image"];
+    int decode_scale = fsSettings["decode_scale"];
+    if (compressed_image && (decode_scale == 2 || decode_scale == 4 || decode_scale == 8))
+    {
+        ROW = ceil(ROW / decode_scale);
+        COL = ceil(COL / decode_scale);
+    }
     ROS_INFO("ROW: %f COL: %f ", ROW, COL);
 
     ESTIMATE_EXTRINSIC = fsSettings["estimate_extrinsic"];  // ! 是否在线标定外参
@@ -9,9 +9,8 @@
 #include <fstream>
 
 const double FOCAL_LENGTH = 460.0;
-const int WINDOW_SIZE = 10;
 const int NUM_OF_CAM = 1;
-const int NUM_OF_F = 1000;
+const int NUM_OF_F = 1000;    // 逆深度参数块每次扩充的个数
 //#define UNIT_SPHERE_ERROR
 
 extern double INIT_DEPTH;
@@ -20,6 +19,7 @@ extern int ESTIMATE_EXTRINSIC;
 
 extern double ACC_N, ACC_W;
 extern double GYR_N, GYR_W;
+extern double IMU_AVERAGE_RATE;
 
 extern std::vector<Eigen::Matrix3d> RIC;
 extern std::vector<Eigen::Vector3d> TIC;
@@ -29,8 +29,11 @@ extern double BIAS_ACC_THRESHOLD;
 extern double BIAS_GYR_THRESHOLD;
 extern double SOLVER_TIME;
 extern int NUM_ITERATIONS;
+extern int WINDOW_SOLVER;
+extern int SLIDING_WINDOW_SIZE;    // 估计器按这个大小实例化，滑窗内部的代码用模板参数WINDOW_SIZE
 extern std::string EX_CALIB_RESULT_PATH;
 extern std::string VINS_RESULT_PATH;
+extern std::string SOLVER_COMPARE_PATH;    // window_solver为2时两个求解器的逐帧对比
 extern std::string IMU_TOPIC;
 extern double TD;
 extern double TR;
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @brief 一帧的临时对象都从这里分配，最后整块释放
+ *
+ * 只顺序往后分配，不单独释放；clear()或析构时倒序调用对象的析构函数，内存块还给全局的空闲链表，
+ * 后面的帧直接复用，稳定运行后不再向系统申请内存。分配本身不是线程安全的，只能在一个线程里分配
+ */
+class FrameArena
+{
+  public:
+    enum : size_t
+    {
+        CHUNK_SIZE = 256 * 1024,
+        ALIGNMENT = 32  // 够Eigen的定长矩阵和avx用
+    };
+
+    FrameArena() : chunks(nullptr), large(nullptr), destructors(nullptr), cur(nullptr), end(nullptr), used(0) {}
+    ~FrameArena() { clear(); }
+    FrameArena(const FrameArena &) = delete;
+    FrameArena &operator=(const FrameArena &) = delete;
+
+    void *allocate(size_t size, size_t align = ALIGNMENT)
+    {
+        uintptr_t p = alignUp(reinterpret_cast<uintptr_t>(cur), align);
+        if (cur == nullptr || p + size > reinterpret_cast<uintptr_t>(end))
+        {
+            // 大块单独申请，不占用chunk
+            if (size + align > CHUNK_SIZE / 4)
+                return allocateLarge(size, align);
+            newChunk();
+            p = alignUp(reinterpret_cast<uintptr_t>(cur), align);
+        }
+        cur = reinterpret_cast<char *>(p + size);
+        used += size;
+        return reinterpret_cast<void *>(p);
+    }
+
+    // 未初始化的数组，只用于double、指针这类平凡类型
+    template <typename T>
+    T *allocateArray(size_t n)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "allocateArray only for trivial types");
+        return static_cast<T *>(allocate(sizeof(T) * n, std::max<size_t>(alignof(T), ALIGNMENT)));
+    }
+
+    // 在arena里构造对象，有析构函数的登记下来，clear()时统一析构
+    template <typename T, typename... Args>
+    T *create(Args &&... args)
+    {
+        void *mem = allocate(sizeof(T), std::max<size_t>(alignof(T), ALIGNMENT));
+        T *object = new (mem) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value)
+        {
+            Destructor *node = static_cast<Destructor *>(allocate(sizeof(Destructor), alignof(Destructor)));
+            node->destroy = &destroy<T>;
+            node->object = object;
+            node->next = destructors;
+            destructors = node;
+        }
+        return object;
+    }
+
+    void clear()
+    {
+        // 后构造的先析构
+        for (Destructor *node = destructors; node != nullptr; node = node->next)
+            node->destroy(node->object);
+        destructors = nullptr;
+
+        if (chunks != nullptr)
+        {
+            Block *last = chunks;
+            while (last->next != nullptr)
+                last = last->next;
+            std::lock_guard<std::mutex> lock(poolMutex());
+            last->next = poolHead();
+            poolHead() = chunks;
+        }
+        chunks = nullptr;
+
+        while (large != nullptr)
+        {
+            Block *next = large->next;
+            std::free(large);
+            large = next;
+        }
+        cur = end = nullptr;
+        used = 0;
+    }
+
+    // 已经分配出去的字节数
+    size_t bytes() const
+    {
+        return used;
+    }
+
+  private:
+    struct Block
+    {
+        Block *next;
+    };
+
+    struct Destructor
+    {
+        void (*destroy)(void *);
+        void *object;
+        Destructor *next;
+    };
+
+    template <typename T>
+    static void destroy(void *object)
+    {
+        static_cast<T *>(object)->~T();
+    }
+
+    static uintptr_t alignUp(uintptr_t p, size_t align)
+    {
+        return (p + align - 1) & ~(uintptr_t)(align - 1);
+    }
+
+    static std::mutex &poolMutex()
+    {
+        static std::mutex m;
+        return m;
+    }
+
+    // 所有arena共用的空闲chunk链表
+    static Block *&poolHead()
+    {
+        static Block *head = nullptr;
+        return head;
+    }
+
+    void newChunk()
+    {
+        Block *chunk = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(poolMutex());
+            if (poolHead() != nullptr)
+            {
+                chunk = poolHead();
+                poolHead() = chunk->next;
+            }
+        }
+        if (chunk == nullptr)
+        {
+            chunk = static_cast<Block *>(std::malloc(CHUNK_SIZE));
+            if (chunk == nullptr)
+                throw std::bad_alloc();
+        }
+        chunk->next = chunks;
+        chunks = chunk;
+        cur = reinterpret_cast<char *>(chunk) + sizeof(Block);
+        end = reinterpret_cast<char *>(chunk) + CHUNK_SIZE;
+    }
+
+    void *allocateLarge(size_t size, size_t align)
+    {
+        Block *block = static_cast<Block *>(std::malloc(sizeof(Block) + size + align));
+        if (block == nullptr)
+            throw std::bad_alloc();
+        block->next = large;
+        large = block;
+        used += size;
+        return reinterpret_cast<void *>(alignUp(reinterpret_cast<uintptr_t>(block) + sizeof(Block), align));
+    }
+
+    Block *chunks;
+    Block *large;
+    Destructor *destructors;
+    char *cur, *end;
+    size_t used;
+};
@@ -1,4 +1,5 @@
 #include "visualization.h"
+#include <boost/make_shared.hpp>
 
 using namespace ros;
 using namespace Eigen;
@@ -14,12 +15,14 @@ nav_msgs::Path path, relo_path;
 ros::Publisher pub_keyframe_pose;
 ros::Publisher pub_keyframe_point;
 ros::Publisher pub_extrinsic;
+ros::Publisher pub_pre_marginalization_time, pub_marginalization_time;
 
 CameraPoseVisualization cameraposevisual(0, 1, 0, 1);
 CameraPoseVisualization keyframebasevisual(0.0, 0.0, 1.0, 1.0);
 static double sum_of_path = 0;
 static Vector3d last_path(0.0, 0.0, 0.0);
 
+// pose_graph订阅的topic都按指针发布，nodelet装在同一个进程里时直接传指针，不做序列化
 void registerPub(ros::NodeHandle &n)
 {
     pub_latest_odometry = n.advertise<nav_msgs::Odometry>("imu_propagate", 1000);
@@ -35,6 +38,8 @@ void registerPub(ros::NodeHandle &n)
     pub_keyframe_point = n.advertise<sensor_msgs::PointCloud>("keyframe_point", 1000);
     pub_extrinsic = n.advertise<nav_msgs::Odometry>("extrinsic", 1000);
     pub_relo_relative_pose=  n.advertise<nav_msgs::Odometry>("relo_relative_pose", 1000);
+    pub_pre_marginalization_time = n.advertise<std_msgs::Float32>("pre_marginalization_time", 1000);
+    pub_marginalization_time = n.advertise<std_msgs::Float32>("marginalization_time", 1000);
 
     cameraposevisual.setScale(1);
     cameraposevisual.setLineWidth(0.05);
@@ -67,12 +72,13 @@ void pubLatestOdometry(const Eigen::Vector3d &P, const Eigen::Quaterniond &Q, co
     odometry.twist.twist.linear.x = V.x();
     odometry.twist.twist.linear.y = V.y();
     odometry.twist.twist.linear.z = V.z();
-    pub_latest_odometry.publish(odometry);
+    pub_latest_odometry.publish(boost::make_shared<nav_msgs::Odometry>(odometry));
 }
 
-void printStatistics(const Estimator &estimator, double t)
+template <int WINDOW_SIZE>
+void printStatistics(const Estimator<WINDOW_SIZE> &estimator, double t)
 {
-    if (estimator.solver_flag != Estimator::SolverFlag::NON_LINEAR)
+    if (estimator.solver_flag != EstimatorBase::SolverFlag::NON_LINEAR)
         return;
     printf("position: %f, %f, %f\r", estimator.Ps[WINDOW_SIZE].x(), estimator.Ps[WINDOW_SIZE].y(), estimator.Ps[WINDOW_SIZE].z());
     ROS_DEBUG_STREAM("position: " << estimator.Ps[WINDOW_SIZE].transpose());
@@ -111,9 +117,24 @@ void printStatistics(const Estimator &estimator, double t)
         ROS_INFO("td %f", estimator.td);
 }
 
-void pubOdometry(const Estimator &estimator, const std_msgs::Header &header)
+// 发布边缘化各阶段的耗时(ms)，方便在线监控
+template <int WINDOW_SIZE>
+void pubMarginalizationTime(const Estimator<WINDOW_SIZE> &estimator)
 {
-    if (estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR)
+    if (estimator.solver_flag != EstimatorBase::SolverFlag::NON_LINEAR)
+        return;
+    std_msgs::Float32Ptr pre_marginalization_time = boost::make_shared<std_msgs::Float32>();
+    pre_marginalization_time->data = estimator.t_pre_marginalization;
+    pub_pre_marginalization_time.publish(pre_marginalization_time);
+    std_msgs::Float32Ptr marginalization_time = boost::make_shared<std_msgs::Float32>();
+    marginalization_time->data = estimator.t_marginalization;
+    pub_marginalization_time.publish(marginalization_time);
+}
+
+template <int WINDOW_SIZE>
+void pubOdometry(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header)
+{
+    if (estimator.solver_flag == EstimatorBase::SolverFlag::NON_LINEAR)
     {
         nav_msgs::Odometry odometry;
         odometry.header = header;
@@ -131,7 +152,7 @@ void pubOdometry(const Estimator &estimator, const std_msgs::Header &header)
         odometry.twist.twist.linear.x = estimator.Vs[WINDOW_SIZE].x();
         odometry.twist.twist.linear.y = estimator.Vs[WINDOW_SIZE].y();
         odometry.twist.twist.linear.z = estimator.Vs[WINDOW_SIZE].z();
-        pub_odometry.publish(odometry);
+        pub_odometry.publish(boost::make_shared<nav_msgs::Odometry>(odometry));
 
         geometry_msgs::PoseStamped pose_stamped;
         pose_stamped.header = header;
@@ -181,7 +202,8 @@ void pubOdometry(const Estimator &estimator, const std_msgs::Header &header)
     }
 }
 
-void pubKeyPoses(const Estimator &estimator, const std_msgs::Header &header)
+template <int WINDOW_SIZE>
+void pubKeyPoses(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header)
 {
     if (estimator.key_poses.size() == 0)
         return;
@@ -215,11 +237,12 @@ void pubKeyPoses(const Estimator &estimator, const std_msgs::Header &header)
     pub_key_poses.publish(key_poses);
 }
 
-void pubCameraPose(const Estimator &estimator, const std_msgs::Header &header)
+template <int WINDOW_SIZE>
+void pubCameraPose(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header)
 {
     int idx2 = WINDOW_SIZE - 1;
 
-    if (estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR)
+    if (estimator.solver_flag == EstimatorBase::SolverFlag::NON_LINEAR)
     {
         int i = idx2;
         Vector3d P = estimator.Ps[i] + estimator.Rs[i] * estimator.tic[0];
@@ -245,7 +268,8 @@ void pubCameraPose(const Estimator &estimator, const std_msgs::Header &header)
 }
 
 
-void pubPointCloud(const Estimator &estimator, const std_msgs::Header &header)
+template <int WINDOW_SIZE>
+void pubPointCloud(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header)
 {
     sensor_msgs::PointCloud point_cloud, loop_point_cloud;
     point_cloud.header = header;
@@ -304,9 +328,10 @@ void pubPointCloud(const Estimator &estimator, const std_msgs::Header &header)
 }
 
 
-void pubTF(const Estimator &estimator, const std_msgs::Header &header)
+template <int WINDOW_SIZE>
+void pubTF(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header)
 {
-    if( estimator.solver_flag != Estimator::SolverFlag::NON_LINEAR)
+    if( estimator.solver_flag != EstimatorBase::SolverFlag::NON_LINEAR)
         return;
     static tf::TransformBroadcaster br;
     tf::Transform transform;
@@ -349,14 +374,15 @@ void pubTF(const Estimator &estimator, const std_msgs::Header &header)
     odometry.pose.pose.orientation.y = tmp_q.y();
     odometry.pose.pose.orientation.z = tmp_q.z();
     odometry.pose.pose.orientation.w = tmp_q.w();
-    pub_extrinsic.publish(odometry);
+    pub_extrinsic.publish(boost::make_shared<nav_msgs::Odometry>(odometry));
 
 }
 
-void pubKeyframe(const Estimator &estimator)
+template <int WINDOW_SIZE>
+void pubKeyframe(const Estimator<WINDOW_SIZE> &estimator)
 {
     // pub camera pose, 2D-3D points of keyframe
-    if (estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR && estimator.marginalization_flag == 0)
+    if (estimator.solver_flag == EstimatorBase::SolverFlag::NON_LINEAR && estimator.marginalization_flag == 0)
     {
         int i = WINDOW_SIZE - 2;
         //Vector3d P = estimator.Ps[i] + estimator.Rs[i] * estimator.tic[0];
@@ -375,7 +401,7 @@ void pubKeyframe(const Estimator &estimator)
         odometry.pose.pose.orientation.w = R.w();
         //printf("time: %f t: %f %f %f r: %f %f %f %f\n", odometry.header.stamp.toSec(), P.x(), P.y(), P.z(), R.w(), R.x(), R.y(), R.z());
 
-        pub_keyframe_pose.publish(odometry);
+        pub_keyframe_pose.publish(boost::make_shared<nav_msgs::Odometry>(odometry));
 
 
         sensor_msgs::PointCloud point_cloud;
@@ -410,11 +436,12 @@ void pubKeyframe(const Estimator &estimator)
             }
 
         }
-        pub_keyframe_point.publish(point_cloud);
+        pub_keyframe_point.publish(boost::make_shared<sensor_msgs::PointCloud>(std::move(point_cloud)));
     }
 }
 
-void pubRelocalization(const Estimator &estimator)
+template <int WINDOW_SIZE>
+void pubRelocalization(const Estimator<WINDOW_SIZE> &estimator)
 {
     nav_msgs::Odometry odometry;
     odometry.header.stamp = ros::Time(estimator.relo_frame_stamp);
@@ -432,5 +459,22 @@ void pubRelocalization(const Estimator &estimator)
     // 回环帧对应的当前帧在回环节点中的idx
     odometry.twist.twist.linear.y = estimator.relo_frame_index;
 
-    pub_relo_relative_pose.publish(odometry);
-}
\ No newline at end of file
+    pub_relo_relative_pose.publish(boost::make_shared<nav_msgs::Odometry>(odometry));
+}
+
+// 预先编译的滑窗大小，和createEstimator()里的一致
+#define INSTANTIATE_PUBLISHERS(N)                                                               \
+    template void printStatistics(const Estimator<N> &estimator, double t);                     \
+    template void pubMarginalizationTime(const Estimator<N> &estimator);                        \
+    template void pubOdometry(const Estimator<N> &estimator, const std_msgs::Header &header);   \
+    template void pubKeyPoses(const Estimator<N> &estimator, const std_msgs::Header &header);   \
+    template void pubCameraPose(const Estimator<N> &estimator, const std_msgs::Header &header); \
+    template void pubPointCloud(const Estimator<N> &estimator, const std_msgs::Header &header); \
+    template void pubTF(const Estimator<N> &estimator, const std_msgs::Header &header);         \
+    template void pubKeyframe(const Estimator<N> &estimator);                                   \
+    template void pubRelocalization(const Estimator<N> &estimator);
+
+INSTANTIATE_PUBLISHERS(5)
+INSTANTIATE_PUBLISHERS(10)
+INSTANTIATE_PUBLISHERS(15)
+INSTANTIATE_PUBLISHERS(20)
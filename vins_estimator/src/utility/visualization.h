@@ -33,20 +33,33 @@ void registerPub(ros::NodeHandle &n);
 
 void pubLatestOdometry(const Eigen::Vector3d &P, const Eigen::Quaterniond &Q, const Eigen::Vector3d &V, const std_msgs::Header &header);
 
-void printStatistics(const Estimator &estimator, double t);
+// 以下按滑窗大小预先实例化，见visualization.cpp末尾
+template <int WINDOW_SIZE>
+void printStatistics(const Estimator<WINDOW_SIZE> &estimator, double t);
 
-void pubOdometry(const Estimator &estimator, const std_msgs::Header &header);
+template <int WINDOW_SIZE>
+void pubMarginalizationTime(const Estimator<WINDOW_SIZE> &estimator);
 
-void pubInitialGuess(const Estimator &estimator, const std_msgs::Header &header);
+template <int WINDOW_SIZE>
+void pubOdometry(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header);
 
-void pubKeyPoses(const Estimator &estimator, const std_msgs::Header &header);
+template <int WINDOW_SIZE>
+void pubInitialGuess(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header);
 
-void pubCameraPose(const Estimator &estimator, const std_msgs::Header &header);
+template <int WINDOW_SIZE>
+void pubKeyPoses(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header);
 
-void pubPointCloud(const Estimator &estimator, const std_msgs::Header &header);
+template <int WINDOW_SIZE>
+void pubCameraPose(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header);
 
-void pubTF(const Estimator &estimator, const std_msgs::Header &header);
+template <int WINDOW_SIZE>
+void pubPointCloud(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header);
 
-void pubKeyframe(const Estimator &estimator);
+template <int WINDOW_SIZE>
+void pubTF(const Estimator<WINDOW_SIZE> &estimator, const std_msgs::Header &header);
 
-void pubRelocalization(const Estimator &estimator);
\ No newline at end of file
+template <int WINDOW_SIZE>
+void pubKeyframe(const Estimator<WINDOW_SIZE> &estimator);
+
+template <int WINDOW_SIZE>
+void pubRelocalization(const Estimator<WINDOW_SIZE> &estimator);
\ No newline at end of file
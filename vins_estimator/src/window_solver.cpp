@@ -0,0 +1,493 @@
+#include "window_solver.h"
+
+#include <cmath>
+#include <limits>
+
+typedef Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>, 0, Eigen::OuterStride<>> ConstJacobian;
+
+/**
+ * @brief 收集problem里的参数块和残差块，分配缓冲区
+ *
+ * 每帧problem的结构都可能变（地图点进出、残差块重建），每次求解都重新整理一遍，只是整理索引，很快
+ */
+bool WindowSolver::setup(ceres::Problem *problem, const std::vector<double *> &scalar_blocks)
+{
+    blocks.clear();
+    residuals.clear();
+    params.clear();
+    features.clear();
+    terms.clear();
+    block_index.clear();
+    feature_index.clear();
+    num_camera = 0;
+
+    for (double *x : scalar_blocks)
+    {
+        feature_index[x] = features.size();
+        Feature f;
+        f.x = x;
+        features.push_back(f);
+    }
+
+    std::vector<ceres::ResidualBlockId> ids;
+    problem->GetResidualBlocks(&ids);
+    std::vector<double *> block_params;
+    int residual_offset = 0, jacobian_offset = 0;
+    for (auto id : ids)
+    {
+        Residual r;
+        r.cost_function = problem->GetCostFunctionForResidualBlock(id);
+        r.loss_function = problem->GetLossFunctionForResidualBlock(id);
+        r.num_residuals = r.cost_function->num_residuals();
+        r.param_begin = params.size();
+        r.feature = -1;
+        problem->GetParameterBlocksForResidualBlock(id, &block_params);
+        r.num_params = block_params.size();
+        const std::vector<int> &sizes = r.cost_function->parameter_block_sizes();
+        for (int k = 0; k < r.num_params; k++)
+        {
+            Param p;
+            p.x = block_params[k];
+            p.size = sizes[k];
+            p.term = -1;
+            auto f = feature_index.find(p.x);
+            if (f != feature_index.end())
+            {
+                // 一个残差块连了两个逆深度，逆深度之间不再独立，不能逐个消去
+                if (r.feature >= 0)
+                    return false;
+                r.feature = f->second;
+                p.block = -1;
+            }
+            else if (problem->IsParameterBlockConstant(p.x))
+            {
+                p.block = -2;
+            }
+            else
+            {
+                auto it = block_index.find(p.x);
+                if (it == block_index.end())
+                {
+                    Block blk;
+                    blk.x = p.x;
+                    blk.size = p.size;
+                    blk.local = problem->ParameterBlockLocalSize(p.x);
+                    blk.idx = num_camera;
+                    blk.parameterization = problem->GetParameterization(p.x);
+                    num_camera += blk.local;
+                    it = block_index.emplace(p.x, blocks.size()).first;
+                    blocks.push_back(blk);
+                }
+                p.block = it->second;
+            }
+            params.push_back(p);
+        }
+        r.residual_offset = residual_offset;
+        r.jacobian_offset = jacobian_offset;
+        residual_offset += r.num_residuals;
+        for (int k = 0; k < r.num_params; k++)
+            jacobian_offset += r.num_residuals * sizes[k];
+        residuals.push_back(r);
+    }
+
+    // 每个逆深度连接了哪些相机参数块，hcf按逆深度连续存放
+    if (feature_blocks.size() < features.size())
+        feature_blocks.resize(features.size());
+    for (int i = 0; i < (int)features.size(); i++)
+        feature_blocks[i].clear();
+    for (const Residual &r : residuals)
+    {
+        if (r.feature < 0)
+            continue;
+        std::vector<int> &list = feature_blocks[r.feature];
+        for (int k = r.param_begin; k < r.param_begin + r.num_params; k++)
+            if (params[k].block >= 0 && std::find(list.begin(), list.end(), params[k].block) == list.end())
+                list.push_back(params[k].block);
+    }
+    int hcf_size = 0;
+    for (int i = 0; i < (int)features.size(); i++)
+    {
+        Feature &f = features[i];
+        f.term_begin = terms.size();
+        f.num_terms = feature_blocks[i].size();
+        for (int blk : feature_blocks[i])
+        {
+            Term t;
+            t.block = blk;
+            t.offset = hcf_size;
+            terms.push_back(t);
+            hcf_size += blocks[blk].local;
+        }
+    }
+    for (const Residual &r : residuals)
+    {
+        if (r.feature < 0)
+            continue;
+        const Feature &f = features[r.feature];
+        for (int k = r.param_begin; k < r.param_begin + r.num_params; k++)
+        {
+            Param &p = params[k];
+            if (p.block < 0)
+                continue;
+            for (int t = f.term_begin; t < f.term_begin + f.num_terms; t++)
+                if (terms[t].block == p.block)
+                    p.term = t;
+        }
+    }
+
+    // 缓冲区只增不减
+    residual_data.resize(residual_offset);
+    jacobian_data.resize(jacobian_offset);
+    jacobian_ptrs.resize(params.size());
+    param_ptrs.resize(params.size());
+    row_begin.resize(params.size());
+    row_end.resize(params.size());
+    for (const Residual &r : residuals)
+    {
+        double *jacobian = jacobian_data.data() + r.jacobian_offset;
+        for (int k = r.param_begin; k < r.param_begin + r.num_params; k++)
+        {
+            param_ptrs[k] = params[k].x;
+            // 固定的参数块不要雅克比
+            jacobian_ptrs[k] = params[k].block == -2 ? nullptr : jacobian;
+            jacobian += r.num_residuals * params[k].size;
+        }
+    }
+    hcf.resize(hcf_size);
+    int state_size = features.size();
+    for (const Block &blk : blocks)
+        state_size += blk.size;
+    state_backup.resize(state_size);
+    H.resize(num_camera, num_camera);
+    S.resize(num_camera, num_camera);
+    b.resize(num_camera);
+    rhs.resize(num_camera);
+    dx.resize(num_camera);
+    return true;
+}
+
+/**
+ * @brief 计算所有残差块的残差（和雅克比），返回0.5 * sum(rho)；有核函数的残差块和ceres一样做修正
+ */
+double WindowSolver::evaluate(bool jacobians)
+{
+    double cost = 0;
+    for (const Residual &r : residuals)
+    {
+        int nr = r.num_residuals;
+        double *residual = residual_data.data() + r.residual_offset;
+        double **jacobian = jacobians ? &jacobian_ptrs[r.param_begin] : nullptr;
+        if (!r.cost_function->Evaluate(&param_ptrs[r.param_begin], residual, jacobian))
+            return std::numeric_limits<double>::infinity();
+
+        Eigen::Map<Eigen::VectorXd> res(residual, nr);
+        double sq_norm = res.squaredNorm();
+        if (!r.loss_function)
+        {
+            cost += 0.5 * sq_norm;
+        }
+        else
+        {
+            double rho[3];
+            r.loss_function->Evaluate(sq_norm, rho);
+            cost += 0.5 * rho[0];
+            if (jacobians)
+            {
+                double sqrt_rho1 = sqrt(rho[1]);
+                double residual_scaling, alpha_sq_norm;
+                if ((sq_norm == 0.0) || (rho[2] <= 0.0))
+                {
+                    residual_scaling = sqrt_rho1;
+                    alpha_sq_norm = 0.0;
+                }
+                else
+                {
+                    const double D = 1.0 + 2.0 * sq_norm * rho[2] / rho[1];
+                    const double alpha = 1.0 - sqrt(D);
+                    residual_scaling = sqrt_rho1 / (1 - alpha);
+                    alpha_sq_norm = alpha / sq_norm;
+                }
+                for (int k = r.param_begin; k < r.param_begin + r.num_params; k++)
+                {
+                    if (!jacobian_ptrs[k])
+                        continue;
+                    Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> J(jacobian_ptrs[k], nr, params[k].size);
+                    J = sqrt_rho1 * (J - alpha_sq_norm * res * (res.transpose() * J));
+                }
+                res *= residual_scaling;
+            }
+        }
+
+        if (!jacobians)
+            continue;
+        // 去掉雅克比首尾的全零行，多观测的残差块里每一帧位姿只占两行
+        for (int k = r.param_begin; k < r.param_begin + r.num_params; k++)
+        {
+            if (!jacobian_ptrs[k])
+                continue;
+            Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> J(jacobian_ptrs[k], nr, params[k].size);
+            int r0 = 0, r1 = nr;
+            while (r0 < r1 && J.row(r0).isZero(0))
+                r0++;
+            while (r1 > r0 && J.row(r1 - 1).isZero(0))
+                r1--;
+            row_begin[k] = r0;
+            row_end[k] = r1;
+        }
+    }
+    return std::isfinite(cost) ? cost : std::numeric_limits<double>::infinity();
+}
+
+/**
+ * @brief 累加正规方程：相机部分的H（上三角）和b，逆深度的hff、bf、hcf
+ */
+void WindowSolver::buildNormalEquation()
+{
+    H.setZero();
+    b.setZero();
+    std::fill(hcf.begin(), hcf.end(), 0.0);
+    for (Feature &f : features)
+    {
+        f.hff = 0;
+        f.bf = 0;
+    }
+
+    for (const Residual &r : residuals)
+    {
+        Eigen::Map<const Eigen::VectorXd> res(residual_data.data() + r.residual_offset, r.num_residuals);
+        for (int k1 = r.param_begin; k1 < r.param_begin + r.num_params; k1++)
+        {
+            const Param &p1 = params[k1];
+            if (p1.block == -2 || row_end[k1] <= row_begin[k1])
+                continue;
+            int local1 = p1.block >= 0 ? blocks[p1.block].local : 1;
+            ConstJacobian J1(jacobian_ptrs[k1], r.num_residuals, local1, Eigen::OuterStride<>(p1.size));
+            int rb1 = row_begin[k1], n1 = row_end[k1] - row_begin[k1];
+
+            if (p1.block == -1)
+            {
+                Feature &f = features[r.feature];
+                f.hff += J1.middleRows(rb1, n1).squaredNorm();
+                f.bf += J1.middleRows(rb1, n1).col(0).dot(res.segment(rb1, n1));
+            }
+            else
+            {
+                int idx1 = blocks[p1.block].idx;
+                b.segment(idx1, local1).noalias() += J1.middleRows(rb1, n1).transpose() * res.segment(rb1, n1);
+                H.block(idx1, idx1, local1, local1).noalias() += J1.middleRows(rb1, n1).transpose() * J1.middleRows(rb1, n1);
+            }
+
+            for (int k2 = k1 + 1; k2 < r.param_begin + r.num_params; k2++)
+            {
+                const Param &p2 = params[k2];
+                if (p2.block == -2)
+                    continue;
+                int r0 = std::max(row_begin[k1], row_begin[k2]);
+                int r1 = std::min(row_end[k1], row_end[k2]);
+                if (r1 <= r0)
+                    continue;
+                int local2 = p2.block >= 0 ? blocks[p2.block].local : 1;
+                ConstJacobian J2(jacobian_ptrs[k2], r.num_residuals, local2, Eigen::OuterStride<>(p2.size));
+                if (p1.block >= 0 && p2.block >= 0)
+                {
+                    int idx1 = blocks[p1.block].idx, idx2 = blocks[p2.block].idx;
+                    if (idx1 < idx2)
+                        H.block(idx1, idx2, local1, local2).noalias() += J1.middleRows(r0, r1 - r0).transpose() * J2.middleRows(r0, r1 - r0);
+                    else
+                        H.block(idx2, idx1, local2, local1).noalias() += J2.middleRows(r0, r1 - r0).transpose() * J1.middleRows(r0, r1 - r0);
+                }
+                else
+                {
+                    // 一个是逆深度，一个是相机参数块
+                    const Param &pc = p1.block >= 0 ? p1 : p2;
+                    const ConstJacobian &Jc = p1.block >= 0 ? J1 : J2;
+                    const ConstJacobian &Jf = p1.block >= 0 ? J2 : J1;
+                    int local = blocks[pc.block].local;
+                    Eigen::Map<Eigen::VectorXd>(hcf.data() + terms[pc.term].offset, local).noalias() +=
+                        Jc.middleRows(r0, r1 - r0).transpose() * Jf.middleRows(r0, r1 - r0).col(0);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief 加阻尼，消去逆深度，LDLT求解相机部分，再回代逆深度
+ *
+ * @param[out] model_decrease 线性化模型预测的代价下降量
+ */
+bool WindowSolver::solveStep(double lambda, double &model_decrease)
+{
+    // 和ceres一样用H的对角线做阻尼，限制在[1e-6, 1e32]
+    auto clampDiag = [](double d)
+    { return std::min(std::max(d, 1e-6), 1e32); };
+
+    S.triangularView<Eigen::Upper>() = H.triangularView<Eigen::Upper>();
+    for (int i = 0; i < num_camera; i++)
+        S(i, i) += lambda * clampDiag(H(i, i));
+    rhs = -b;
+
+    // 逐个消去逆深度，每个只更新它连接的那几个块
+    for (Feature &f : features)
+    {
+        double hff = f.hff + lambda * clampDiag(f.hff);
+        f.inv_hff = f.num_terms > 0 && hff > 1e-12 ? 1.0 / hff : 0.0;
+        if (f.inv_hff == 0)
+            continue;
+        for (int t1 = f.term_begin; t1 < f.term_begin + f.num_terms; t1++)
+        {
+            const Block &blk1 = blocks[terms[t1].block];
+            Eigen::Map<const Eigen::VectorXd> h1(hcf.data() + terms[t1].offset, blk1.local);
+            rhs.segment(blk1.idx, blk1.local).noalias() += h1 * (f.bf * f.inv_hff);
+            for (int t2 = t1; t2 < f.term_begin + f.num_terms; t2++)
+            {
+                const Block &blk2 = blocks[terms[t2].block];
+                Eigen::Map<const Eigen::VectorXd> h2(hcf.data() + terms[t2].offset, blk2.local);
+                if (blk1.idx <= blk2.idx)
+                    S.block(blk1.idx, blk2.idx, blk1.local, blk2.local).noalias() -= (f.inv_hff * h1) * h2.transpose();
+                else
+                    S.block(blk2.idx, blk1.idx, blk2.local, blk1.local).noalias() -= (f.inv_hff * h2) * h1.transpose();
+            }
+        }
+    }
+
+    ldlt.compute(S);
+    if (ldlt.info() != Eigen::Success)
+        return false;
+    dx = ldlt.solve(rhs);
+    if (!dx.allFinite())
+        return false;
+
+    // 模型下降量 -(g^T dx + 0.5 dx^T H dx) = 0.5 * (lambda * dx^T D dx - g^T dx)
+    double damped = 0, gdx = b.dot(dx);
+    for (int i = 0; i < num_camera; i++)
+        damped += clampDiag(H(i, i)) * dx(i) * dx(i);
+    for (Feature &f : features)
+    {
+        f.dx = 0;
+        if (f.inv_hff == 0)
+            continue;
+        double v = -f.bf;
+        for (int t = f.term_begin; t < f.term_begin + f.num_terms; t++)
+        {
+            const Block &blk = blocks[terms[t].block];
+            v -= Eigen::Map<const Eigen::VectorXd>(hcf.data() + terms[t].offset, blk.local).dot(dx.segment(blk.idx, blk.local));
+        }
+        f.dx = v * f.inv_hff;
+        damped += clampDiag(f.hff) * f.dx * f.dx;
+        gdx += f.bf * f.dx;
+    }
+    model_decrease = 0.5 * (lambda * damped - gdx);
+    return std::isfinite(model_decrease) && model_decrease > 0;
+}
+
+void WindowSolver::saveState()
+{
+    double *data = state_backup.data();
+    for (const Block &blk : blocks)
+    {
+        std::copy(blk.x, blk.x + blk.size, data);
+        data += blk.size;
+    }
+    for (const Feature &f : features)
+        *data++ = *f.x;
+}
+
+void WindowSolver::restoreState()
+{
+    const double *data = state_backup.data();
+    for (const Block &blk : blocks)
+    {
+        std::copy(data, data + blk.size, blk.x);
+        data += blk.size;
+    }
+    for (const Feature &f : features)
+        *f.x = *data++;
+}
+
+void WindowSolver::applyStep()
+{
+    for (const Block &blk : blocks)
+    {
+        if (blk.parameterization)
+        {
+            plus_buffer.resize(blk.size);
+            blk.parameterization->Plus(blk.x, dx.data() + blk.idx, plus_buffer.data());
+            std::copy(plus_buffer.begin(), plus_buffer.end(), blk.x);
+        }
+        else
+        {
+            for (int i = 0; i < blk.size; i++)
+                blk.x[i] += dx(blk.idx + i);
+        }
+    }
+    for (const Feature &f : features)
+        *f.x += f.dx;
+}
+
+/**
+ * @brief LM迭代，步长被拒绝时正规方程不用重新累加，只换阻尼重新消元求解
+ */
+bool WindowSolver::solve(ceres::Problem *problem, const std::vector<double *> &scalar_blocks, int max_iterations, double max_time_in_seconds,
+                         Summary *summary)
+{
+    TicToc t_solve;
+    if (!setup(problem, scalar_blocks))
+        return false;
+    double cost = evaluate(true);
+    if (!std::isfinite(cost))
+        return false;
+    summary->initial_cost = cost;
+
+    double lambda = 1e-4, nu = 2;   // 对应ceres的初始信赖域半径1e4
+    bool relinearize = true;
+    int iter = 0;
+    while (iter < max_iterations && t_solve.toc() < max_time_in_seconds * 1000 && lambda < 1e16)
+    {
+        if (relinearize)
+        {
+            buildNormalEquation();
+            relinearize = false;
+            // 梯度已经足够小
+            double max_gradient = b.size() > 0 ? b.lpNorm<Eigen::Infinity>() : 0.0;
+            for (const Feature &f : features)
+                max_gradient = std::max(max_gradient, std::abs(f.bf));
+            if (max_gradient < 1e-10)
+                break;
+        }
+        iter++;
+        double model_decrease;
+        if (!solveStep(lambda, model_decrease))
+        {
+            lambda *= nu;
+            nu *= 2;
+            continue;
+        }
+        saveState();
+        applyStep();
+        // 雅克比顺带算好，步长被接受时直接用来累加下一次的正规方程
+        double new_cost = evaluate(true);
+        double rho = (cost - new_cost) / model_decrease;
+        if (std::isfinite(new_cost) && rho > 1e-3)
+        {
+            lambda *= std::max(1.0 / 3.0, 1.0 - pow(2 * rho - 1, 3));
+            nu = 2;
+            bool converged = cost - new_cost < 1e-6 * cost;
+            cost = new_cost;
+            relinearize = true;
+            if (converged)
+                break;
+        }
+        else
+        {
+            restoreState();
+            lambda *= nu;
+            nu *= 2;
+        }
+    }
+    summary->iterations = iter;
+    summary->final_cost = cost;
+    summary->time = t_solve.toc();
+    ROS_DEBUG("window solver: %d iterations, cost %f -> %f, %f ms", iter, summary->initial_cost, cost, summary->time);
+    return true;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <ceres/ceres.h>
+#include <eigen3/Eigen/Dense>
+#include <ros/console.h>
+
+#include "utility/tic_toc.h"
+
+/**
+ * @brief 针对滑窗结构的LM求解器，直接求解估计器里常驻的ceres problem
+ *
+ * 滑窗的参数永远是这几类：位姿、速度零偏、外参、td，外加N个一维的逆深度，每个残差块最多连一个逆深度。
+ * 每次迭代把所有残差块的雅克比累加成正规方程，逆深度的对角块是标量，直接消去得到相机部分的舒尔补（~170维），
+ * 稠密LDLT求解后回代逆深度。雅克比、H和分解的内存跨迭代、跨帧复用。
+ *
+ * 和边缘化一样，7维参数块的局部雅克比取前6列（PoseLocalParameterization的雅克比是[I; 0]）
+ */
+class WindowSolver
+{
+  public:
+    struct Summary
+    {
+        Summary() : iterations(0), initial_cost(0), final_cost(0), time(0) {}
+        int iterations;
+        double initial_cost, final_cost;    // 0.5 * sum(rho)，和ceres的cost一致
+        double time;                        // ms
+    };
+
+    /**
+     * @brief 求解problem
+     *
+     * @param[in] scalar_blocks 先消去的逆深度参数块
+     * @return false 问题结构不符合（某个残差块连了多个逆深度），没有改动参数，应该交给ceres
+     */
+    bool solve(ceres::Problem *problem, const std::vector<double *> &scalar_blocks, int max_iterations, double max_time_in_seconds,
+               Summary *summary);
+
+  private:
+    // 相机部分的参数块（不含逆深度），在舒尔补矩阵里按顺序排开
+    struct Block
+    {
+        double *x;
+        int size, local, idx;
+        const ceres::LocalParameterization *parameterization;
+    };
+
+    struct Residual
+    {
+        const ceres::CostFunction *cost_function;
+        const ceres::LossFunction *loss_function;
+        int num_residuals;
+        int param_begin;    // 在params里的起点
+        int num_params;
+        int feature;        // 连接的逆深度，没有是-1
+        int residual_offset, jacobian_offset;
+    };
+
+    // 残差块里的一个参数块
+    struct Param
+    {
+        double *x;
+        int block;          // 相机参数块的序号，逆深度是-1，固定的参数块是-2
+        int size;
+        int term;           // 残差块连了逆深度时，这个相机参数块在terms里的序号
+    };
+
+    // 一个逆深度对应的那一行：标量的hff、bf，以及和每个相连相机参数块的hcf
+    struct Feature
+    {
+        double *x;
+        double hff, bf, dx;
+        double inv_hff;     // 加阻尼之后的1 / hff，不可观的逆深度为0，不更新
+        int term_begin, num_terms;  // 在terms里的起点
+    };
+
+    struct Term
+    {
+        int block;
+        int offset;         // 在hcf里的起点
+    };
+
+    bool setup(ceres::Problem *problem, const std::vector<double *> &scalar_blocks);
+    double evaluate(bool jacobians);
+    void buildNormalEquation();
+    bool solveStep(double lambda, double &model_decrease);
+    void saveState();
+    void restoreState();
+    void applyStep();
+
+    std::vector<Block> blocks;
+    std::vector<Residual> residuals;
+    std::vector<Param> params;
+    std::vector<Feature> features;
+    std::vector<Term> terms;
+    std::unordered_map<double *, int> block_index, feature_index;
+    std::vector<std::vector<int>> feature_blocks;   // 每个逆深度连接的相机参数块，建terms用
+    int num_camera;     // 相机部分的维数
+
+    // 以下缓冲区只增不减，跨迭代、跨帧复用
+    std::vector<double> residual_data, jacobian_data, state_backup, plus_buffer;
+    std::vector<double *> jacobian_ptrs;
+    std::vector<const double *> param_ptrs;
+    std::vector<int> row_begin, row_end;    // 每个参数块雅克比非零行的范围，和params一一对应
+    std::vector<double> hcf;
+    Eigen::MatrixXd H, S;       // 相机部分的H和舒尔补，只用上三角
+    Eigen::VectorXd b, rhs, dx;
+    Eigen::LDLT<Eigen::MatrixXd, Eigen::Upper> ldlt;
+};
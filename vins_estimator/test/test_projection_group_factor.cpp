@@ -0,0 +1,140 @@
+#include <gtest/gtest.h>
+#include <map>
+#include <vector>
+#include <eigen3/Eigen/Dense>
+
+#include "../src/parameters.h"
+#include "../src/factor/projection_factor.h"
+#include "../src/factor/projection_group_factor.h"
+#include "../src/factor/marginalization_factor.h"
+
+namespace
+{
+void setPose(double *pose, const Eigen::Vector3d &p, const Eigen::Quaterniond &q)
+{
+    pose[0] = p.x();
+    pose[1] = p.y();
+    pose[2] = p.z();
+    pose[3] = q.x();
+    pose[4] = q.y();
+    pose[5] = q.z();
+    pose[6] = q.w();
+}
+
+// 按参数块地址把残差块累加成正规方程，7维参数块取前6列，和边缘化的做法一致
+struct NormalEquation
+{
+    NormalEquation(const std::vector<double *> &blocks, const std::vector<int> &sizes)
+    {
+        int dim = 0;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            offset[blocks[i]] = dim;
+            dim += sizes[i];
+        }
+        H = Eigen::MatrixXd::Zero(dim, dim);
+        g = Eigen::VectorXd::Zero(dim);
+    }
+
+    void add(const ResidualBlockInfo &info)
+    {
+        const std::vector<int> &sizes = info.cost_function->parameter_block_sizes();
+        for (size_t i = 0; i < info.parameter_blocks.size(); i++)
+        {
+            int size_i = sizes[i] == 7 ? 6 : sizes[i];
+            int idx_i = offset.at(info.parameter_blocks[i]);
+            Eigen::MatrixXd J_i = info.jacobians[i].leftCols(size_i);
+            g.segment(idx_i, size_i) += J_i.transpose() * info.residuals;
+            for (size_t j = 0; j < info.parameter_blocks.size(); j++)
+            {
+                int size_j = sizes[j] == 7 ? 6 : sizes[j];
+                int idx_j = offset.at(info.parameter_blocks[j]);
+                H.block(idx_i, idx_j, size_i, size_j) += J_i.transpose() * info.jacobians[j].leftCols(size_j);
+            }
+        }
+    }
+
+    std::map<const double *, int> offset;
+    Eigen::MatrixXd H;
+    Eigen::VectorXd g;
+};
+}
+
+// 核函数在组残差里按观测做Triggs修正，正规方程要和逐个观测的ProjectionFactor加柯西核完全一致，包括拐点之外的观测
+TEST(ProjectionGroupFactor, MatchesPerObservationCauchy)
+{
+    ProjectionFactor::sqrt_info = FOCAL_LENGTH / 1.5 * Eigen::Matrix2d::Identity();
+    ProjectionGroupFactor::sqrt_info = ProjectionFactor::sqrt_info;
+
+    const int num_frames = 4;
+    double para_pose[num_frames][7], para_ex[7], para_depth[1];
+    std::vector<Eigen::Vector3d> P(num_frames);
+    std::vector<Eigen::Quaterniond> Q(num_frames);
+    for (int i = 0; i < num_frames; i++)
+    {
+        P[i] = Eigen::Vector3d(0.3 * i, -0.1 * i, 0.05 * i * i);
+        Q[i] = Eigen::Quaterniond(Eigen::AngleAxisd(0.05 * i, Eigen::Vector3d(0.2, 1, 0.1).normalized()));
+        setPose(para_pose[i], P[i], Q[i]);
+    }
+    Eigen::Vector3d tic(0.05, -0.02, 0.01);
+    Eigen::Quaterniond qic(Eigen::AngleAxisd(0.1, Eigen::Vector3d(1, 0.3, 0).normalized()));
+    setPose(para_ex, tic, qic);
+
+    // 起始帧里深度5m的点，残差只来自下面加的像素噪声
+    Eigen::Vector3d pts_i(0.1, -0.05, 1.0);
+    Eigen::Vector3d pts_w = Q[0] * (qic * (pts_i * 5.0) + tic) + P[0];
+    para_depth[0] = 1.0 / 5.0;
+
+    // 像素噪声：核内、刚过拐点、远在拐点之外（柯西核在s = 1处，对应1.5个像素）
+    const double pixel_noise[num_frames] = {0, 0.5, 3.0, 20.0};
+    std::vector<Eigen::Vector3d> pts_j(num_frames);
+    for (int j = 1; j < num_frames; j++)
+    {
+        Eigen::Vector3d pts_c = qic.inverse() * (Q[j].inverse() * (pts_w - P[j]) - tic);
+        pts_j[j] = pts_c / pts_c.z();
+        pts_j[j].x() += pixel_noise[j] / FOCAL_LENGTH;
+        pts_j[j].y() -= 0.5 * pixel_noise[j] / FOCAL_LENGTH;
+    }
+
+    ceres::CauchyLoss loss(1.0);
+    FrameArena arena;
+    std::vector<double *> blocks = {para_pose[0], para_ex, para_depth, para_pose[1], para_pose[2], para_pose[3]};
+    std::vector<int> sizes = {6, 6, 1, 6, 6, 6};
+
+    // 原来的做法：每个观测一个ProjectionFactor，核函数由ResidualBlockInfo按ceres的方式修正
+    NormalEquation per_observation(blocks, sizes);
+    std::vector<ProjectionFactor *> factors;
+    int beyond_knee = 0;
+    for (int j = 1; j < num_frames; j++)
+    {
+        ProjectionFactor *factor = new ProjectionFactor(pts_i, pts_j[j]);
+        factors.push_back(factor);
+        ResidualBlockInfo info(factor, nullptr, {para_pose[0], para_pose[j], para_ex, para_depth}, {});
+        info.allocate(arena);
+        info.Evaluate();
+        if (info.residuals.squaredNorm() > 1.0)
+            beyond_knee++;
+
+        ResidualBlockInfo robust_info(factor, &loss, {para_pose[0], para_pose[j], para_ex, para_depth}, {});
+        robust_info.allocate(arena);
+        robust_info.Evaluate();
+        per_observation.add(robust_info);
+    }
+    ASSERT_GE(beyond_knee, 2);
+
+    // 组残差：核函数在因子里，不再交给ResidualBlockInfo
+    ProjectionGroupFactor group_factor(pts_i, Eigen::Vector2d::Zero(), 0, 0, false, &loss);
+    for (int j = 1; j < num_frames; j++)
+        group_factor.addObservation(pts_j[j], Eigen::Vector2d::Zero(), 0, 0);
+    NormalEquation group(blocks, sizes);
+    ResidualBlockInfo group_info(&group_factor, nullptr, blocks, {});
+    group_info.allocate(arena);
+    group_info.Evaluate();
+    group.add(group_info);
+
+    EXPECT_LT((group.H - per_observation.H).norm(), 1e-9 * per_observation.H.norm());
+    EXPECT_LT((group.g - per_observation.g).norm(), 1e-9 * per_observation.g.norm());
+
+    for (ProjectionFactor *factor : factors)
+        delete factor;
+}